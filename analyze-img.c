@@ -0,0 +1,345 @@
+/*
+ * file:        analyze-img.c
+ * description: layout and fragmentation report for a file system image
+ *
+ * usage: ./analyze-img [-j] disk.img
+ *          -j  - print JSON instead of text
+ *
+ * Walks the directory tree from the root and reports, for the image as
+ * a whole:
+ *   - per-file fragment counts and average run length
+ *   - a histogram of free extent sizes
+ *   - placement: directory inode -> entry block, directory -> child
+ *     inode, and inode -> first data block distances
+ *   - space lost to whole-block inodes, partial last blocks, blocks
+ *     that are allocated but hold only zeros, and preallocated blocks
+ *   - how many small files are packed into shared tail blocks
+ * Use it to decide when to defragment or rebuild an image, and to
+ * compare allocator changes.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "fs5600.h"
+
+#define MAX_DEPTH 10
+#define N_BUCKETS 16            /* free extent histogram: 1, 2-3, 4-7, ... */
+
+int fd;
+int nblks;
+struct fs_super super;
+unsigned char bitmap[FS_BLOCK_SIZE];
+unsigned char *visited;
+
+struct file_info {
+    char path[MAX_DEPTH * 28 + 2];
+    int inum;
+    int isdir;
+    int size;
+    int blocks;
+    int fragments;
+    int packed;
+};
+struct file_info *files;
+int nfiles, files_max;
+
+struct distance {
+    long long total;
+    int max;
+    int count;
+};
+struct distance dir_dist, child_dist, data_dist;
+
+struct {
+    long long inode_slack;      /* bytes of inode blocks beyond the header/ptrs in use */
+    long long tail_slack;       /* unused bytes in files' last blocks */
+    int zero_blocks;            /* written blocks holding only zeros */
+    int unwritten_blocks;       /* preallocated, never written */
+    int packed_files;           /* files kept in a tail block */
+    long long packed_slack;     /* unused bytes in their slots */
+} waste;
+
+int bit_test(unsigned char *map, int i)
+{
+    return map[i/8] & (1 << (i%8));
+}
+
+int read_blk(void *buf, int lba)
+{
+    if (lba <= 0 || lba >= nblks)
+        return -EINVAL;
+    if (pread(fd, buf, FS_BLOCK_SIZE, (off_t)lba * FS_BLOCK_SIZE) != FS_BLOCK_SIZE)
+        return -EIO;
+    return 0;
+}
+
+void add_distance(struct distance *d, int from, int to)
+{
+    int n = abs(to - from);
+    d->total += n;
+    d->count++;
+    if (n > d->max)
+        d->max = n;
+}
+
+int is_zero(char *buf)
+{
+    for (int i = 0; i < FS_BLOCK_SIZE; i++)
+        if (buf[i] != 0)
+            return 0;
+    return 1;
+}
+
+/* add_file - record fragment and waste figures for one inode
+ */
+void add_file(const char *path, int inum, struct fs_inode *in)
+{
+    if (nfiles == files_max) {
+        files_max = files_max ? files_max * 2 : 64;
+        files = realloc(files, files_max * sizeof(*files));
+    }
+    struct file_info *f = &files[nfiles++];
+    snprintf(f->path, sizeof(f->path), "%s", path[0] ? path : "/");
+    f->inum = inum;
+    f->isdir = S_ISDIR(in->mode);
+    f->size = in->size;
+    f->blocks = f->fragments = 0;
+    f->packed = in->tail_blk != 0;
+    if (f->packed) {
+        waste.packed_files++;
+        waste.packed_slack += in->tail_len - in->size;
+    }
+
+    char buf[FS_BLOCK_SIZE];
+    uint32_t prev = 0;
+    int last = 0;
+    for (int i = 0; i < PTRS_PER_INODE; i++) {
+        uint32_t p = in->ptrs[i];
+        if (p == 0)
+            continue;
+        last = i + 1;
+        f->blocks++;
+        if (prev == 0 || FS_PTR_BLK(p) != FS_PTR_BLK(prev) + 1)
+            f->fragments++;
+        prev = p;
+        if (p & FS_PTR_UNWRITTEN)
+            waste.unwritten_blocks++;
+        else if (!f->isdir && read_blk(buf, p) == 0 && is_zero(buf))
+            waste.zero_blocks++;
+    }
+    waste.inode_slack += FS_BLOCK_SIZE - (sizeof(*in) - sizeof(in->ptrs)) -
+        last * sizeof(uint32_t);
+    if (!f->isdir && in->size % FS_BLOCK_SIZE != 0 &&
+        in->ptrs[(in->size - 1) / FS_BLOCK_SIZE] != 0)
+        waste.tail_slack += FS_BLOCK_SIZE - in->size % FS_BLOCK_SIZE;
+    if (f->blocks > 0)
+        add_distance(f->isdir ? &dir_dist : &data_dist, inum,
+                     FS_PTR_BLK(in->ptrs[0]));
+}
+
+void walk(const char *path, int inum, int depth)
+{
+    struct fs_inode in;
+    if (inum <= 0 || inum >= nblks || visited[inum] || depth > MAX_DEPTH)
+        return;
+    visited[inum] = 1;
+    if (read_blk(&in, inum) < 0)
+        return;
+    add_file(path, inum, &in);
+    if (!S_ISDIR(in.mode) || in.ptrs[0] == 0)
+        return;
+
+    struct fs_dirent de[DIRECTORY_ENTS_PER_BLK];
+    if (read_blk(de, in.ptrs[0]) < 0)
+        return;
+    for (int i = 0; i < DIRECTORY_ENTS_PER_BLK; i++) {
+        if (!de[i].valid)
+            continue;
+        char child[sizeof(files[0].path)];
+        snprintf(child, sizeof(child), "%s/%.27s", path, de[i].name);
+        add_distance(&child_dist, in.ptrs[0], de[i].inode);
+        walk(child, de[i].inode, depth + 1);
+    }
+}
+
+double avg(long long total, int count)
+{
+    return count ? (double)total / count : 0.0;
+}
+
+/* free_extents - histogram of free extent lengths, bucket b holding
+ * extents of 2^b .. 2^(b+1)-1 blocks. Returns the number of extents.
+ */
+int free_extents(int *hist, int *largest)
+{
+    int n = 0;
+    *largest = 0;
+    for (int i = 0; i < nblks; ) {
+        if (bit_test(bitmap, i)) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < nblks && !bit_test(bitmap, i))
+            i++;
+        int len = i - start, b = 0;
+        while (b < N_BUCKETS - 1 && (2 << b) <= len)
+            b++;
+        hist[b]++;
+        n++;
+        if (len > *largest)
+            *largest = len;
+    }
+    return n;
+}
+
+void print_text(int used, int *hist, int nextents, int largest)
+{
+    printf("image: %d blocks, %d used, %d free, %d orphans\n",
+           nblks, used, nblks - used, super.n_orphans);
+
+    int frag_files = 0, data_blocks = 0, runs = 0;
+    for (int i = 0; i < nfiles; i++) {
+        data_blocks += files[i].blocks;
+        runs += files[i].fragments;
+        frag_files += files[i].fragments > 1;
+    }
+    printf("\nfiles: %d (%d fragmented), %d data blocks in %d runs, "
+           "avg run %.1f blocks\n", nfiles, frag_files, data_blocks, runs,
+           avg(data_blocks, runs));
+    if (frag_files)
+        printf("  %-40s %7s %6s %6s %8s\n", "path", "inode", "blocks",
+               "frags", "avg run");
+    for (int i = 0; i < nfiles; i++) {
+        struct file_info *f = &files[i];
+        if (f->fragments > 1)
+            printf("  %-40s %7d %6d %6d %8.1f\n", f->path, f->inum, f->blocks,
+                   f->fragments, avg(f->blocks, f->fragments));
+    }
+
+    printf("\nfree extents: %d, largest %d blocks\n", nextents, largest);
+    for (int b = 0; b < N_BUCKETS; b++)
+        if (hist[b] && b == 0)
+            printf("  %5d%6s %6d\n", 1, "", hist[b]);
+        else if (hist[b])
+            printf("  %5d-%-5d %6d\n", 1 << b, (2 << b) - 1, hist[b]);
+
+    printf("\nplacement (distance in blocks):       avg      max\n");
+    printf("  dir inode -> entry block       %9.1f %8d\n",
+           avg(dir_dist.total, dir_dist.count), dir_dist.max);
+    printf("  dir entries -> child inode     %9.1f %8d\n",
+           avg(child_dist.total, child_dist.count), child_dist.max);
+    printf("  file inode -> first data block %9.1f %8d\n",
+           avg(data_dist.total, data_dist.count), data_dist.max);
+
+    printf("\nspace lost:\n");
+    printf("  inode blocks       %9lld bytes (%d inodes)\n",
+           waste.inode_slack, nfiles);
+    printf("  partial last block %9lld bytes\n", waste.tail_slack);
+    printf("  zero-filled blocks %9d blocks\n", waste.zero_blocks);
+    printf("  preallocated       %9d blocks\n", waste.unwritten_blocks);
+    printf("  packed tail slots  %9lld bytes (%d files)\n", waste.packed_slack,
+           waste.packed_files);
+}
+
+void print_json(int used, int *hist, int nextents, int largest)
+{
+    printf("{\n  \"blocks\": %d, \"used\": %d, \"free\": %d, \"orphans\": %d,\n",
+           nblks, used, nblks - used, super.n_orphans);
+    printf("  \"files\": [\n");
+    for (int i = 0; i < nfiles; i++) {
+        struct file_info *f = &files[i];
+        printf("    {\"path\": \"%s\", \"inode\": %d, \"dir\": %s, \"size\": %d, "
+               "\"blocks\": %d, \"fragments\": %d, \"avg_run\": %.2f, \"packed\": %s}%s\n",
+               f->path, f->inum, f->isdir ? "true" : "false", f->size,
+               f->blocks, f->fragments, avg(f->blocks, f->fragments),
+               f->packed ? "true" : "false",
+               i < nfiles - 1 ? "," : "");
+    }
+    printf("  ],\n  \"free_extents\": {\"count\": %d, \"largest\": %d, "
+           "\"histogram\": [", nextents, largest);
+    for (int b = 0; b < N_BUCKETS; b++)
+        printf("%s{\"min\": %d, \"count\": %d}", b ? ", " : "", 1 << b, hist[b]);
+    printf("]},\n");
+    printf("  \"distance\": {\n");
+    printf("    \"dir_to_entries\": {\"avg\": %.2f, \"max\": %d},\n",
+           avg(dir_dist.total, dir_dist.count), dir_dist.max);
+    printf("    \"dir_to_child\": {\"avg\": %.2f, \"max\": %d},\n",
+           avg(child_dist.total, child_dist.count), child_dist.max);
+    printf("    \"inode_to_data\": {\"avg\": %.2f, \"max\": %d}\n  },\n",
+           avg(data_dist.total, data_dist.count), data_dist.max);
+    printf("  \"waste\": {\"inode_bytes\": %lld, \"tail_bytes\": %lld, "
+           "\"zero_blocks\": %d, \"unwritten_blocks\": %d, "
+           "\"packed_files\": %d, \"packed_slack\": %lld}\n}\n",
+           waste.inode_slack, waste.tail_slack, waste.zero_blocks,
+           waste.unwritten_blocks, waste.packed_files, waste.packed_slack);
+}
+
+int main(int argc, char **argv)
+{
+    int json = 0;
+    if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+        json = 1;
+        argv++, argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s [-j] disk.img\n", argv[0]);
+        exit(1);
+    }
+    if ((fd = open(argv[1], O_RDONLY)) < 0) {
+        fprintf(stderr, "cannot open image file '%s': %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    struct stat sb;
+    fstat(fd, &sb);
+    if (pread(fd, &super, sizeof(super), 0) != sizeof(super) ||
+        pread(fd, bitmap, sizeof(bitmap), FS_BLOCK_SIZE) != sizeof(bitmap) ||
+        super.magic != FS_MAGIC) {
+        fprintf(stderr, "%s: not a file system image\n", argv[1]);
+        exit(1);
+    }
+    if (super.n_members > 1) {
+        fprintf(stderr, "%s: striped image, not supported (read-img.py reads them)\n", argv[1]);
+        exit(1);
+    }
+    if (super.tier_slots != 0) {
+        fprintf(stderr, "%s: tiered image, not supported (read-img.py reads them)\n", argv[1]);
+        exit(1);
+    }
+    if (FS_SUPER_BLOCK_SIZE(&super) != FS_BLOCK_SIZE) {
+        fprintf(stderr, "%s: block size is %d, not %d\n", argv[1],
+                FS_SUPER_BLOCK_SIZE(&super), FS_BLOCK_SIZE);
+        exit(1);
+    }
+    nblks = super.disk_size;
+    if ((off_t)nblks * FS_BLOCK_SIZE > sb.st_size)
+        fprintf(stderr, "warning: image is shorter than %d blocks\n", nblks);
+
+    visited = calloc(nblks, 1);
+    walk("", 2, 0);
+
+    int used = 0;
+    for (int i = 0; i < nblks; i++)
+        used += bit_test(bitmap, i) != 0;
+    int hist[N_BUCKETS] = {0}, largest;
+    int nextents = free_extents(hist, &largest);
+
+    if (json)
+        print_json(used, hist, nextents, largest);
+    else
+        print_text(used, hist, nextents, largest);
+
+    free(visited);
+    free(files);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * file:        crc32c.c
+ * description: CRC-32C (Castagnoli), as used for block checksums
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it - about one
+ * 8-byte word per cycle - and a table otherwise; both give the same
+ * result (the iSCSI/ext4/btrfs CRC, with the usual pre- and
+ * post-inversion).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fs5600.h"
+
+#define CRC32C_POLY 0x82f63b78  /* reversed */
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    if (crc_table[1] == 0) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+            crc_table[i] = c;
+        }
+    }
+    while (len-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = c;
+    for (; len > 0; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+static int have_sse42(void)
+{
+    static int cached = -1;
+    if (cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("sse4.2");
+    }
+    return cached;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (have_sse42())
+        return ~crc32c_hw(crc, buf, len);
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,199 @@
+/*
+ * file:        delta-img.c
+ * description: incremental copy of a file system image
+ *
+ * usage: ./delta-img export N disk.img > delta
+ *        ./delta-img apply delta disk.img
+ *
+ * The file system records, for each group of FS_GROUP_SIZE blocks, the
+ * generation it was last written in (see FS_IOC_CHECKPOINT). 'export'
+ * writes out the in-use blocks of every group changed since
+ * generation N, and 'apply' writes them into an older copy of the
+ * image - one made at or after checkpoint N - to bring it up to date.
+ * Free blocks are left out, since nothing reads them, so a delta is
+ * about the size of the data actually changed.
+ *
+ * Delta format: a struct delta_hdr, then a series of struct delta_rec
+ * each followed by 'nblks' blocks of data, then a record with nblks = 0.
+ * The superblock is the last record, so a copy that crashes half way
+ * through an apply still has its old generation and can be applied to
+ * again.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fs5600.h"
+
+#define DELTA_MAGIC "5600DLT1"
+#define MAX_RUN 64              /* blocks per record */
+
+struct delta_hdr {
+    char magic[8];
+    uint32_t since;             /* changes since this generation... */
+    uint32_t gen;               /* ...up to this one */
+    uint32_t disk_size;
+    uint32_t pad;
+};
+
+struct delta_rec {
+    uint32_t lba;
+    uint32_t nblks;
+};
+
+int bit_test(unsigned char *map, int i)
+{
+    return map[i / 8] & (1 << (i % 8));
+}
+
+void die(const char *msg, const char *file)
+{
+    fprintf(stderr, "%s: %s\n", file, msg);
+    exit(1);
+}
+
+void xwrite(FILE *fp, void *buf, size_t len)
+{
+    if (fwrite(buf, len, 1, fp) != 1)
+        die(strerror(errno), "write");
+}
+
+int read_super(int fd, struct fs_super *super, unsigned char *bitmap)
+{
+    return pread(fd, super, sizeof(*super), 0) == sizeof(*super) &&
+        pread(fd, bitmap, FS_BLOCK_SIZE, FS_BLOCK_SIZE) == FS_BLOCK_SIZE &&
+        super->magic == FS_MAGIC && FS_SUPER_BLOCK_SIZE(super) == FS_BLOCK_SIZE &&
+        super->n_members <= 1 && super->tier_slots == 0;  // not striped or tiered
+}
+
+/* export - copy out runs of in-use blocks in groups changed since 'since'
+ */
+int do_export(uint32_t since, char *image)
+{
+    struct fs_super super;
+    unsigned char bitmap[FS_BLOCK_SIZE];
+    char *buf = malloc(MAX_RUN * FS_BLOCK_SIZE);
+    int fd = open(image, O_RDONLY);
+    if (fd < 0)
+        die(strerror(errno), image);
+    if (!read_super(fd, &super, bitmap))
+        die("not a file system image", image);
+    if (since > super.gen)
+        die("generation is newer than the image", image);
+
+    struct delta_hdr hdr = {.since = since, .gen = super.gen,
+                            .disk_size = super.disk_size};
+    memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+    xwrite(stdout, &hdr, sizeof(hdr));
+
+    int nblks = super.disk_size, ngroups = 0, nsent = 0;
+    for (int g = 0; g * FS_GROUP_SIZE < nblks; g++) {
+        if (super.group_gen[g] < since)
+            continue;
+        ngroups++;
+        int end = (g + 1) * FS_GROUP_SIZE;
+        if (end > nblks)
+            end = nblks;
+        // block 0 is sent last, below
+        for (int i = g == 0 ? 1 : g * FS_GROUP_SIZE; i < end; ) {
+            if (!bit_test(bitmap, i)) {
+                i++;
+                continue;
+            }
+            int n = 1;
+            while (i + n < end && n < MAX_RUN && bit_test(bitmap, i + n))
+                n++;
+            if (pread(fd, buf, n * FS_BLOCK_SIZE, (off_t)i * FS_BLOCK_SIZE) !=
+                n * FS_BLOCK_SIZE)
+                die("short read", image);
+            struct delta_rec rec = {.lba = i, .nblks = n};
+            xwrite(stdout, &rec, sizeof(rec));
+            xwrite(stdout, buf, n * FS_BLOCK_SIZE);
+            nsent += n;
+            i += n;
+        }
+    }
+    struct delta_rec rec = {.lba = 0, .nblks = 1};
+    xwrite(stdout, &rec, sizeof(rec));
+    xwrite(stdout, &super, FS_BLOCK_SIZE);
+    rec.nblks = 0;
+    xwrite(stdout, &rec, sizeof(rec));
+    fflush(stdout);
+
+    fprintf(stderr, "generation %u -> %u: %d of %d groups changed, %d blocks\n",
+            since, super.gen, ngroups, DIV_ROUND_UP(nblks, FS_GROUP_SIZE), nsent + 1);
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+/* apply - write a delta into an image made at or after its 'since'
+ */
+int do_apply(char *delta, char *image)
+{
+    struct fs_super super;
+    unsigned char bitmap[FS_BLOCK_SIZE];
+    char *buf = malloc(MAX_RUN * FS_BLOCK_SIZE);
+    FILE *fp = strcmp(delta, "-") == 0 ? stdin : fopen(delta, "r");
+    if (fp == NULL)
+        die(strerror(errno), delta);
+    int fd = open(image, O_RDWR);
+    if (fd < 0)
+        die(strerror(errno), image);
+    if (!read_super(fd, &super, bitmap))
+        die("not a file system image", image);
+
+    struct delta_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) != 0)
+        die("not a delta", delta);
+    if (hdr.disk_size != super.disk_size)
+        die("delta is for a different size of image", image);
+    if (super.gen < hdr.since)
+        die("image is older than the delta's base generation", image);
+
+    int napplied = 0;
+    for (;;) {
+        struct delta_rec rec;
+        if (fread(&rec, sizeof(rec), 1, fp) != 1)
+            die("truncated delta", delta);
+        if (rec.nblks == 0)
+            break;
+        if (rec.nblks > MAX_RUN || rec.lba + rec.nblks > hdr.disk_size)
+            die("bad record in delta", delta);
+        if (fread(buf, FS_BLOCK_SIZE, rec.nblks, fp) != rec.nblks)
+            die("truncated delta", delta);
+        if (pwrite(fd, buf, rec.nblks * FS_BLOCK_SIZE, (off_t)rec.lba * FS_BLOCK_SIZE) !=
+            rec.nblks * FS_BLOCK_SIZE)
+            die(strerror(errno), image);
+        napplied += rec.nblks;
+    }
+    if (fsync(fd) < 0)
+        die(strerror(errno), image);
+
+    fprintf(stderr, "generation %u -> %u: %d blocks written\n",
+            super.gen, hdr.gen, napplied);
+    free(buf);
+    close(fd);
+    if (fp != stdin)
+        fclose(fp);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && strcmp(argv[1], "export") == 0)
+        return do_export(strtoul(argv[2], NULL, 0), argv[3]);
+    if (argc == 4 && strcmp(argv[1], "apply") == 0)
+        return do_apply(argv[2], argv[3]);
+    fprintf(stderr, "usage: %s export N disk.img > delta\n"
+            "       %s apply delta disk.img\n", argv[0], argv[0]);
+    exit(1);
+}
@@ -1,4 +1,5 @@
 from ctypes import *
+import struct
 
 MAGIC = 0x30303635
 
@@ -6,35 +7,108 @@ class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
                 ("inode", c_uint, 31),
                 ("name", c_char * 28)]
-        
-class super(Structure):
-    _fields_ = [("magic", c_uint),
-                ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
-
-class inode(Structure):
-    _fields_ = [("uid", c_ushort),
-                ("gid", c_ushort),
-                ("mode", c_uint),
-                ("ctime", c_uint),
-                ("mtime", c_uint),
-                ("size", c_int),
-                ("ptrs", c_uint * 1019)]
-
-class bitmap(Structure):
-    _fields_ = [("vals", c_uint * 1024)]
-    def get(self, i):
-        n = self.vals[i // 32]
-        mask = 1 << (i % 32)
-        return (n & mask) != 0
-    def set(self, i, val):
-        mask = 1 << (i % 32)
-        n = self.vals[i // 32]
-        if val:
-            n = n | mask
-        else:
-            n = n & (mask ^ 0xffffffff)
-        self.vals[i // 32] = n
+
+MAX_ORPHANS = 64
+MAX_REF_BLKS = 16
+MAX_SNAPS = 16
+MAX_CSUM_BLKS = 32
+STATE_CLEAN = 1
+MAX_MEMBERS = 8
+MEMBER_NAME_LEN = 64
+TIER_MAGIC = '5600TIER'
+TIER_PINNED = 0x80000000
+
+class snap(Structure):
+    _fields_ = [("root", c_uint),
+                ("name", c_char * 28)]
+
+# the block size is at the same offset in the superblock for any block
+# size; 0 (older images) means 4096
+BLOCK_SIZE_OFFSET = 4 * (3 + MAX_ORPHANS + MAX_REF_BLKS) + 32 * MAX_SNAPS
+
+def block_size(data):
+    bs, = struct.unpack_from('<I', data, BLOCK_SIZE_OFFSET)
+    return bs or 4096
+
+# define super, inode and bitmap for a block size of 'bs' bytes
+def layout(bs):
+    global BLOCK_SIZE, MAX_GROUPS, super, inode, bitmap
+    BLOCK_SIZE = bs
+    MAX_GROUPS = 8 * bs // 256
+
+    class _super(Structure):
+        _fields_ = [("magic", c_uint),
+                    ("disk_sz", c_uint),
+                    ("n_orphans", c_uint),
+                    ("orphans", c_uint * MAX_ORPHANS),
+                    ("ref_blks", c_uint * MAX_REF_BLKS),
+                    ("snaps", snap * MAX_SNAPS),
+                    ("block_size", c_uint),
+                    ("gen", c_uint),
+                    ("group_gen", c_uint * MAX_GROUPS),
+                    ("csum_blks", c_uint * MAX_CSUM_BLKS),
+                    ("state", c_uint),
+                    ("group_free", c_ushort * MAX_GROUPS),
+                    ("stripe_unit", c_uint),
+                    ("n_members", c_uint),
+                    ("members", (c_char * MEMBER_NAME_LEN) * (MAX_MEMBERS - 1)),
+                    ("tier_slots", c_uint),
+                    ("tier_file", c_char * MEMBER_NAME_LEN),
+                    ("mount_gen", c_uint),
+                    ("_pad", c_char * (bs - 4 * (10 + MAX_ORPHANS + MAX_REF_BLKS + MAX_GROUPS +
+                                                 MAX_CSUM_BLKS)
+                                       - 2 * MAX_GROUPS - 32 * MAX_SNAPS
+                                       - MEMBER_NAME_LEN * MAX_MEMBERS))]
+
+    class _inode(Structure):
+        _fields_ = [("uid", c_ushort),
+                    ("gid", c_ushort),
+                    ("mode", c_uint),
+                    ("ctime", c_uint),
+                    ("mtime", c_uint),
+                    ("size", c_int),
+                    ("ptrs", c_uint * (bs // 4 - 8)),
+                    ("flags", c_uint),
+                    ("tail_blk", c_uint),
+                    ("tail_off", c_ushort),
+                    ("tail_len", c_ushort)]
+
+    class _bitmap(Structure):
+        _fields_ = [("vals", c_uint * (bs // 4))]
+        def get(self, i):
+            n = self.vals[i // 32]
+            mask = 1 << (i % 32)
+            return (n & mask) != 0
+        def set(self, i, val):
+            mask = 1 << (i % 32)
+            n = self.vals[i // 32]
+            if val:
+                n = n | mask
+            else:
+                n = n & (mask ^ 0xffffffff)
+            self.vals[i // 32] = n
+
+    super, inode, bitmap = _super, _inode, _bitmap
+
+# where block b of a striped image is: (member, block within it)
+def stripe_map(sb, b):
+    s = b // sb.stripe_unit
+    return s % sb.n_members, (s // sb.n_members) * sb.stripe_unit + b % sb.stripe_unit
+
+# the fast tier of a tiered image: a header block, the map (one
+# uint32 per slot) and then the slots; returns {block: slot}
+def tier_map(sb, data):
+    bs = BLOCK_SIZE
+    n, = struct.unpack_from('<I', data, 8)
+    if data[:8] != TIER_MAGIC or n != sb.tier_slots:
+        return None
+    m = struct.unpack_from('<%dI' % n, data, bs)
+    return dict([(e & ~TIER_PINNED, s) for s, e in enumerate(m) if s == 0 or e])
+
+def tier_base(n_slots):
+    return 1 + (4 * n_slots + BLOCK_SIZE - 1) // BLOCK_SIZE
+
+layout(4096)
 
 S_IFMT  = 0o0170000  # bit mask for the file type bit field
 S_IFREG = 0o0100000  # regular file
@@ -8,7 +8,17 @@
 #ifndef __CSX600_H__
 #define __CSX600_H__
 
+/* The block size is chosen at compile time (make BLOCK_SIZE=16384),
+ * and recorded in the superblock; an image can only be used by a build
+ * with the same block size. Since it's a constant, loops over blocks,
+ * bitmaps and directories are compiled for the one size.
+ */
+#ifndef FS_BLOCK_SIZE
 #define FS_BLOCK_SIZE 4096
+#endif
+#if FS_BLOCK_SIZE < 2048 || FS_BLOCK_SIZE > 65536 || (FS_BLOCK_SIZE & (FS_BLOCK_SIZE - 1))
+#error "FS_BLOCK_SIZE must be a power of 2 from 2048 to 65536"
+#endif
 #define FS_MAGIC 0x30303635
 
 /* how many buckets of size M do you need to hold N items? 
@@ -25,14 +35,128 @@ struct fs_dirent {
 
 /* Superblock - holds file system parameters. 
  */
+#define FS_MAX_ORPHANS 64
+
+/* Reference counts: one uint16_t per block on the disk, the number of
+ * references to it beyond the first (0 unless the block is shared).
+ */
+#define FS_REFS_PER_BLK (FS_BLOCK_SIZE / 2)
+#define FS_MAX_REF_BLKS (8 * FS_BLOCK_SIZE / FS_REFS_PER_BLK)
+
+/* Block checksums: one CRC-32C (see crc32c.c) per block on the disk,
+ * 0 if not known. Not kept for the superblock or the table itself.
+ */
+#define FS_CSUMS_PER_BLK (FS_BLOCK_SIZE / 4)
+#define FS_MAX_CSUM_BLKS (8 * FS_BLOCK_SIZE / FS_CSUMS_PER_BLK)
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Snapshots: read-only copies of the whole tree, each with its own
+ * copy of the root inode; everything below is shared with the live
+ * tree (and counted in the reference count table) until one of them
+ * changes it.
+ */
+#define FS_MAX_SNAPS 16
+
+struct fs_snap {
+    uint32_t root;              /* copy of the root inode, 0 if slot unused */
+    char name[28];              /* with trailing NUL */
+};
+
+/* Changed-block tracking: the disk is divided into groups of
+ * FS_GROUP_SIZE blocks, and group_gen[g] is the generation in which
+ * group g was last written. The generation is bumped by a checkpoint
+ * (FS_IOC_CHECKPOINT), so the groups changed since checkpoint N are
+ * those with group_gen >= N.
+ */
+#define FS_GROUP_SIZE 256
+#define FS_MAX_GROUPS (8 * FS_BLOCK_SIZE / FS_GROUP_SIZE)
+
+/* Striping: an image can be spread over several files (members),
+ * stripe_unit blocks at a time - see misc.c. Member 0 is the image
+ * file itself, and holds the superblock.
+ */
+#define FS_MAX_MEMBERS 8
+#define FS_MEMBER_NAME_LEN 64
+
+/* Tiering: an image can have a second, smaller image on fast storage
+ * (the fast tier) holding its metadata and most-used blocks - see
+ * misc.c. The fast image starts with a header block, then the map:
+ * one uint32_t per slot giving the block held there, with
+ * FS_TIER_PINNED set for file system metadata. Slot 0 always holds
+ * block 0, and any other slot with 0 is free. The slots follow the map.
+ */
+#define FS_TIER_MAGIC "5600TIER"
+#define FS_TIER_PINNED 0x80000000
+#define FS_TIER_BLK(e) ((e) & ~FS_TIER_PINNED)
+
+struct fs_tier_hdr {
+    char magic[8];
+    uint32_t n_slots;           /* = tier_slots in the superblock */
+};
+
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
-    
+
+    /* unlinked inodes whose blocks haven't been freed yet */
+    uint32_t n_orphans;
+    uint32_t orphans[FS_MAX_ORPHANS];
+
+    /* blocks holding the reference count table, 0 if not allocated */
+    uint32_t ref_blks[FS_MAX_REF_BLKS];
+
+    struct fs_snap snaps[FS_MAX_SNAPS];
+
+    /* block size in bytes, at a fixed offset for any block size; 0 in
+     * images older than this field means 4096 (see FS_SUPER_BLOCK_SIZE)
+     */
+    uint32_t block_size;
+
+    /* current generation, and the one each group was last written in */
+    uint32_t gen;
+    uint32_t group_gen[FS_MAX_GROUPS];
+
+    /* blocks holding the checksum table, 0 if checksums are off */
+    uint32_t csum_blks[FS_MAX_CSUM_BLKS];
+
+    /* FS_STATE_CLEAN if unmounted cleanly, in which case group_free
+     * holds the free blocks in each group and the bitmap needn't be
+     * counted at mount
+     */
+    uint32_t state;
+    uint16_t group_free[FS_MAX_GROUPS];
+
+    /* striping: n_members files, members[i] being the name of member
+     * i+1, in the same directory as this one. 0 and 0 if not striped
+     */
+    uint32_t stripe_unit;       /* in blocks */
+    uint32_t n_members;
+    char members[FS_MAX_MEMBERS - 1][FS_MEMBER_NAME_LEN];
+
+    /* tiering: the fast image, in the same directory as this one unless
+     * it starts with '/', and its number of slots. 0 if not tiered
+     */
+    uint32_t tier_slots;
+    char tier_file[FS_MEMBER_NAME_LEN];
+
+    /* gen when last mounted: after a crash, the groups written since
+     * (group_gen >= mount_gen) may have checksums that weren't written
+     */
+    uint32_t mount_gen;
+
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - (10 + FS_MAX_ORPHANS + FS_MAX_REF_BLKS + FS_MAX_GROUPS +
+                              FS_MAX_CSUM_BLKS) * sizeof(uint32_t)
+             - FS_MAX_GROUPS * sizeof(uint16_t)
+             - FS_MAX_SNAPS * sizeof(struct fs_snap)
+             - FS_MAX_MEMBERS * FS_MEMBER_NAME_LEN];
 };
 
+#define FS_STATE_CLEAN 1
+
+#define FS_SUPER_BLOCK_SIZE(s) ((s)->block_size ? (s)->block_size : 4096)
+
 struct fs_inode {
     uint16_t uid;
     uint16_t gid;
@@ -40,12 +164,78 @@ struct fs_inode {
     uint32_t ctime;
     uint32_t mtime;
     int32_t  size;
-    uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
+    uint32_t ptrs[FS_BLOCK_SIZE/4 - 8];
+    uint32_t flags;             /* FS_*_FL from <linux/fs.h>; only FS_COMPR_FL used */
+
+    /* packed tail (see below): all of a small file's data, kept at
+     * tail_off in shared block tail_blk; tail_blk == 0 if none */
+    uint32_t tail_blk;
+    uint16_t tail_off;          /* bytes */
+    uint16_t tail_len;          /* bytes reserved, >= size */
+};                              /* inode = one block */
+
+/* Tail blocks hold the data of several small files, in 64 units of
+ * FS_TAIL_UNIT bytes. Unit 0 is the header; bit i of 'used' is set if
+ * unit i belongs to some file.
+ */
+#define FS_TAIL_MAGIC 0x4c494154        /* "TAIL" */
+#define FS_TAIL_UNIT (FS_BLOCK_SIZE / 64)
+
+struct fs_tail_hdr {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t used;
+};
+
+/* Block pointer flags. Block numbers never exceed 8 * FS_BLOCK_SIZE
+ * (one bitmap block), so the top bits of a pointer are free to use.
+ * UNWRITTEN marks a block reserved by fallocate that has never been
+ * written; it reads as zeros.
+ * COMPRESSED, on the first pointer of a cluster of FS_CLUSTER_BLKS
+ * pointers, means the cluster's data is stored deflated: the non-zero
+ * pointers of the cluster are, in order, the blocks holding a 32-bit
+ * length followed by that many bytes of zlib stream.
+ */
+#define FS_PTR_UNWRITTEN 0x80000000
+#define FS_PTR_COMPRESSED 0x40000000
+#define FS_PTR_FLAGS (FS_PTR_UNWRITTEN | FS_PTR_COMPRESSED)
+#define FS_PTR_BLK(p) ((p) & ~FS_PTR_FLAGS)
+
+#define FS_CLUSTER_BLKS 4
+
+/* ioctls understood by the file system (besides FITRIM and
+ * FS_IOC_GETFLAGS/SETFLAGS)
+ *   FS_IOC_DEFRAG - rewrite the file or directory as one contiguous run
+ *   FS_IOC_CLONE_FROM - make the file a copy of 'src' (a path from the
+ *       root of the file system) that shares all its blocks
+ *   FS_IOC_CHECKPOINT - start a new generation, and return its number;
+ *       delta-img exports the blocks changed since then
+ */
+#define FS_IOC_DEFRAG _IO('f', 0x60)
+
+struct fs_clone_arg {
+    char src[256];
+};
+#define FS_IOC_CLONE_FROM _IOW('f', 0x61, struct fs_clone_arg)
+#define FS_IOC_CHECKPOINT _IOR('f', 0x62, uint32_t)
+
+/* I/O classes, in priority order, for block_io_class() in misc.c
+ */
+enum {
+    IO_READ,                    /* reads for file system operations */
+    IO_META,                    /* their synchronous writes */
+    IO_WRITEBACK,               /* the write-back flusher */
+    IO_MAINT,                   /* reaper, defrag, discards */
+    IO_NCLASSES
 };
 
 enum {
     // directory entries per block
-    DIRECTORY_ENTS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dirent)  
+    DIRECTORY_ENTS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dirent),
+    // block pointers per inode
+    PTRS_PER_INODE = FS_BLOCK_SIZE/4 - 8,
+    // units per tail block
+    TAIL_UNITS = 64
 };
 
 #endif
@@ -1,10 +1,19 @@
 #!/usr/bin/python
 #
-# usage: gen-disk2.py input output.img
+# usage: gen-disk2.py [-q] [-b blocksize] [-s members:unit] [-t fast.img:slots] input output.img
 #
-# see comments in disk1.in for file format
+# see comments in disk1.in for file format; with -b the blocks are
+# bigger or smaller than 4096, and the image needs a build of the file
+# system with the same size (make BLOCK_SIZE=...). With -s the image is
+# striped over 'members' files, 'unit' blocks at a time: output.img and
+# output-1.img, output-2.img etc. next to it. With -t it has a fast tier
+# of 'slots' blocks in fast.img (next to output.img unless it's an
+# absolute path), which starts out holding the superblock, bitmap,
+# inodes and directories.
 
 import sys
+import os
+import struct
 import diskfmt as fs
 import random as rnd
 
@@ -12,6 +21,24 @@ quiet = False
 if sys.argv[1] == '-q':
     quiet = True
     sys.argv.pop(1)
+if sys.argv[1] == '-b':
+    fs.layout(int(sys.argv[2]))
+    sys.argv[1:3] = []
+n_members, stripe_unit = 1, 0
+if sys.argv[1] == '-s':
+    n_members, stripe_unit = [int(x) for x in sys.argv[2].split(':')]
+    sys.argv[1:3] = []
+    if not 1 < n_members <= fs.MAX_MEMBERS or stripe_unit < 1:
+        print 'bad -s: 2 to %d members, unit >= 1' % fs.MAX_MEMBERS
+        sys.exit(1)
+tier_file, tier_slots = None, 0
+if sys.argv[1] == '-t':
+    tier_file, tier_slots = sys.argv[2].rsplit(':', 1)
+    tier_slots = int(tier_slots)
+    sys.argv[1:3] = []
+    if tier_slots < 2 or len(tier_file) >= fs.MEMBER_NAME_LEN:
+        print 'bad -t: at least 2 slots, name under %d bytes' % fs.MEMBER_NAME_LEN
+        sys.exit(1)
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
 
@@ -35,7 +62,7 @@ class file(object):
             print("block", self.name, offset)
         rnd.seed(hash(self.name) + offset)
         val = ''
-        for i in range(4096):
+        for i in range(fs.BLOCK_SIZE):
             n = rnd.randint(0,50)
             val = val + chars[n]
         return bytearray(val)
@@ -64,12 +91,13 @@ class dir(object):
             i.ptrs[j] = self.blocks[j]
         return bytearray(i)
 
-    # dirent is 32 bytes, 128 per block
+    # dirent is 32 bytes, 128 per 4096-byte block
     def block(self,offset):
-        data = bytearray(4096)
+        data = bytearray(fs.BLOCK_SIZE)
         de = fs.dirent()
         j = 0
-        for i in range(offset*128, min(len(self.entries), (offset+1)*128)):
+        n = fs.BLOCK_SIZE // 32
+        for i in range(offset*n, min(len(self.entries), (offset+1)*n)):
             val,name,num = self.entries[i]
             de.valid, de.inode, de.name = val, num, name
             data[j:j+32] = bytearray(de)
@@ -123,23 +151,69 @@ for f in files + dirs:
         i += 1
 
 sb = fs.super()
-sb.magic, sb.disk_sz = magic, nblocks
-zeros = bytearray(4096)
-
-fp = open(sys.argv[2], 'wb')
-fp.write(bytearray(sb))
-fp.write(bytearray(blockmap))
+sb.magic, sb.disk_sz, sb.block_size = magic, nblocks, fs.BLOCK_SIZE
+zeros = bytearray(fs.BLOCK_SIZE)
+
+members = [sys.argv[2]]
+if n_members > 1:
+    stem = sys.argv[2][:-4] if sys.argv[2].endswith('.img') else sys.argv[2]
+    members += ['%s-%d.img' % (stem, i) for i in range(1, n_members)]
+    sb.stripe_unit, sb.n_members = stripe_unit, n_members
+    for i in range(1, n_members):
+        sb.members[i-1].value = os.path.basename(members[i])
+if tier_file:
+    sb.tier_slots, sb.tier_file = tier_slots, tier_file
+
+data = [bytes(bytearray(sb)), bytes(bytearray(blockmap))]
 for i in range(2,nblocks):
     if not blocks[i]:
-        fp.write(zeros)
+        data.append(bytes(zeros))
     elif len(blocks[i]) == 1:
         inode = blocks[i][0]
-        fp.write(inode.inode())
+        data.append(bytes(inode.inode()))
     else:
         item,offset = blocks[i]
         if not quiet:
             print('item', item.name)
-        fp.write(item.block(offset))
-fp.close()
+        data.append(bytes(item.block(offset)))
+
+if n_members == 1:
+    fp = open(sys.argv[2], 'wb')
+    for d in data:
+        fp.write(d)
+    fp.close()
+else:
+    # whole rows of stripes, so the members are the same size
+    row = n_members * stripe_unit
+    data += [bytes(zeros)] * (-nblocks % row)
+    out = [[None] * (len(data) // n_members) for m in members]
+    for b in range(len(data)):
+        m, i = fs.stripe_map(sb, b)
+        out[m][i] = data[b]
+    for m in range(n_members):
+        fp = open(members[m], 'wb')
+        for d in out[m]:
+            fp.write(d)
+        fp.close()
+
+# the fast tier: header, map, slots. The metadata goes in the first
+# slots (block 0 always in slot 0), pinned; its copies in the image
+# are never read
+if tier_file:
+    meta = [0, 1] + sorted([f.inum for f in files + dirs] +
+                           [b for d in dirs for b in d.blocks])
+    meta = meta[:tier_slots]
+    hdr = bytearray(fs.BLOCK_SIZE)
+    hdr[:8] = fs.TIER_MAGIC
+    hdr[8:12] = struct.pack('<I', tier_slots)
+    tmap = [b | fs.TIER_PINNED for b in meta] + [0] * (tier_slots - len(meta))
+    tmap = struct.pack('<%dI' % tier_slots, *tmap)
+    tmap += bytes(bytearray(-len(tmap) % fs.BLOCK_SIZE))
+    fp = open(os.path.join(os.path.dirname(sys.argv[2]), tier_file), 'wb')
+    fp.write(bytes(hdr) + tmap)
+    for b in meta:
+        fp.write(data[b])
+    fp.write(bytes(zeros) * (tier_slots - len(meta)))
+    fp.close()
 
 
@@ -17,7 +17,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <zlib.h>
 #include "fs5600.h"
+#include "libfs5600.h"
 
 /* if you don't understand why you can't use these system calls here, 
  * you need to read the assignment description another time
@@ -29,12 +37,32 @@
 
 #define MAX_PATH_LEN 10
 #define MAX_NAME_LEN 27
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 /* disk access. All access is in terms of 4KB blocks; read and
  * write functions return 0 (success) or -EIO.
  */
 extern int block_read(void *buf, int lba, int nblks);
 extern int block_write(void *buf, int lba, int nblks);
+extern int block_discard(int lba, int nblks);
+extern int block_write_super(void *buf);
+extern int block_flush(void);
+extern void block_writeback_start(void);
+extern int block_writeback_stop(void);
+extern void block_io_class(int cls);
+extern void block_hot_start(void);
+extern void block_hot_stop(void);
+extern void block_tier_start(void);
+extern void block_tier_stop(void);
+extern void block_pin(int lba);
+extern void block_unpin(int lba);
+extern void block_set_hooks(void (*write_hook)(const char *buf, int lba, int nblks),
+                            int (*read_hook)(const char *buf, int lba, int nblks));
+extern struct blkdev *block_open(const char *file);
+extern void block_close(struct blkdev *d);
+extern void block_use(struct blkdev *d);
+extern struct blkdev *block_default(void);
 
 /* bitmap functions
  */
@@ -52,26 +80,297 @@ int bit_test(unsigned char *map, int i)
 }
 
 
+#define MAX_DISCARD 64
+#define MAX_RESV 32
+#define DEDUP_BUCKETS 4096
+#define TAIL_CACHE 16
+
+struct fs_extent {
+    int start;
+    int len;
+};
+
+struct fs_resv {
+    int inum;                   /* owner, 0 if slot unused */
+    int start;                  /* next reserved block */
+    int len;                    /* reserved blocks left */
+};
+
+struct tail_info {
+    int blk;                    /* 0 if slot unused */
+    int nfree;                  /* free units */
+};
+
+/* a file being copied by defrag_file: any write to its inode or blocks,
+ * or freeing one, while the mutex is dropped marks it changed (see
+ * defrag_note)
+ */
+struct defrag_watch {
+    unsigned char map[FS_BLOCK_SIZE];   /* the blocks it's copying from */
+    int changed;
+    struct defrag_watch *next;
+};
+
+/* one mounted image. Everything the file system keeps in memory is
+ * here, so a process can have several open through the library API
+ * (libfs5600.h) - each with its own caches, allocator and threads. The
+ * FUSE operations (fs_ops) work on a single default instance, on the
+ * image given to block_init. Code below works on 'fs', the instance
+ * the calling thread entered with fs_enter.
+ */
+struct fs5600 {
+    struct blkdev *dev;
+    int fuse;                   /* the FUSE instance: uid/gid from the request */
+    struct fs5600_opts opts;
+
+    struct fs_super super;
+    unsigned char bitmap[FS_BLOCK_SIZE];
+
+    /* every operation holds the mutex, as do the reaper (see fs_unlink)
+     * and the defragger when they run alongside them.
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t reap_cond;
+    pthread_cond_t defrag_cond;
+    pthread_t reap_thread, defrag_thread;
+    int stop;
+
+    /* see the sections below */
+    struct fs_extent discard_list[MAX_DISCARD];
+    int discard_count;
+
+    int group_free[FS_MAX_GROUPS];
+    int n_groups;
+    int group_free_valid;
+
+    struct fs_resv resv_table[MAX_RESV];
+    unsigned char resv_map[FS_BLOCK_SIZE];  /* blocks held by some window */
+    int resv_next;                          /* round-robin victim slot */
+
+    uint16_t ref_count[8 * FS_BLOCK_SIZE];
+    unsigned int ref_dirty;     /* bit i: table block i needs writing */
+    unsigned int ref_loaded;    /* bit i: table block i has been read */
+
+    uint32_t csum[8 * FS_BLOCK_SIZE];
+    unsigned int csum_dirty;    /* bit i: table block i needs writing */
+    unsigned int csum_loaded;   /* bit i: table block i has been read */
+
+    int dedup_head[DEDUP_BUCKETS];          /* block numbers, 0 = none */
+    int dedup_next[8 * FS_BLOCK_SIZE];
+    uint64_t dedup_hash[8 * FS_BLOCK_SIZE]; /* 0 = not in the index */
+
+    struct tail_info tail_cache[TAIL_CACHE];
+
+    struct defrag_watch *defrags;       /* copies in progress */
+};
+
+static __thread struct fs5600 *fs;
+
+static void fs_enter(struct fs5600 *inst)
+{
+    fs = inst;
+    block_use(inst->dev);
+}
+
+/* options for the FUSE instance, set by hwfuse before it mounts. The
+ * unit tests change some between operations, so they're copied into
+ * the instance as each operation starts (fuse_opts).
+ */
+int fs_discard;
+int defrag_rate;                /* blocks/sec for background defrag, 0 = off */
+int fs_compress;                /* zlib level for all files, 0 = per file */
+int fs_dedup;
+int fs_checksum;                /* -checksum: add a table if there isn't one */
+int fs_writeback;               /* -writeback: cache writes, flush in the background */
+int fs_warm;                    /* -warm: save hot blocks, prefetch them at mount */
+
+void csum_flush(void);
+
+void fs_lock(void)
+{
+    pthread_mutex_lock(&fs->mutex);
+}
+void fs_unlock(void)
+{
+    csum_flush();               // checksums of what the operation wrote
+    pthread_mutex_unlock(&fs->mutex);
+}
+
+void groups_init(void);
+void groups_check(void);
+void mark_clean(void);
+void write_super(void);
+void ref_load(void);
+void dedup_forget(int blk);
+void csum_init(int clean);
+void pin_tables(void);
+int translate_w(int pathc, char **pathv);
+int snap_create(const char *name);
+int snap_delete(const char *name);
+void *reaper(void *arg);
+void *defragger(void *arg);
+
+/* mount - read the current instance's superblock and bitmap and start
+ * its threads. The reaper picks up any orphans left over from the
+ * last mount.
+ */
+static void fs_mount(void)
+{
+    pthread_mutex_init(&fs->mutex, NULL);
+    pthread_cond_init(&fs->reap_cond, NULL);
+    pthread_cond_init(&fs->defrag_cond, NULL);
+    if (fs->opts.writeback) {
+        block_writeback_start();
+    }
+    if (fs->opts.warm) {
+        block_hot_start();
+    }
+    block_read(&fs->super, 0, 1);
+    block_read(fs->bitmap, 1, 1);
+    int clean = fs->super.state == FS_STATE_CLEAN;
+    groups_init();
+    ref_load();
+    csum_init(clean);
+    pin_tables();
+    block_tier_start();
+
+    fs->stop = 0;
+    pthread_create(&fs->reap_thread, NULL, reaper, fs);
+    if (fs->opts.defrag_rate > 0) {
+        pthread_create(&fs->defrag_thread, NULL, defragger, fs);
+    }
+}
+
+/* unmount - orphans that haven't been reaped yet stay on the list and
+ * are finished after the next mount. The image is marked clean,
+ * anything still in the write-back cache is flushed, and the hot block
+ * list and fast tier map saved. Returns -EIO if some of the cache
+ * couldn't be written.
+ */
+static int fs_unmount(void)
+{
+    fs_lock();
+    fs->stop = 1;
+    pthread_cond_signal(&fs->reap_cond);
+    pthread_cond_broadcast(&fs->defrag_cond);      // the defragger, and any FS_IOC_DEFRAG
+    fs_unlock();
+    pthread_join(fs->reap_thread, NULL);
+    if (fs->opts.defrag_rate > 0) {
+        pthread_join(fs->defrag_thread, NULL);
+    }
+    fs_lock();
+    mark_clean();
+    fs_unlock();
+    block_tier_stop();
+    int rv = block_writeback_stop();
+    block_hot_stop();
+    pthread_mutex_destroy(&fs->mutex);
+    pthread_cond_destroy(&fs->reap_cond);
+    pthread_cond_destroy(&fs->defrag_cond);
+    return rv;
+}
+
+/* old images - one made before the block size was recorded
+ * (block_size 0) has the original inode, with FS_BLOCK_SIZE/4 - 5
+ * block pointers. The last three of those are now flags and the
+ * packed tail, so they have to be 0 in every inode, as they are
+ * unless some file has more than FS_BLOCK_SIZE/4 - 8 blocks. If they
+ * are, the image is marked with its block size and used as it is;
+ * otherwise it can't be mounted. Works on the current block device,
+ * as hwfuse calls it before there's an instance.
+ */
+static int old_inode_ok(int inum, int disk_size)
+{
+    struct fs_inode _inode, *inode = &_inode;
+    if (inum <= 0 || inum >= disk_size || block_read(inode, inum, 1) < 0) {
+        return 0;
+    }
+    if (inode->flags != 0 || inode->tail_blk != 0 || inode->tail_off != 0 ||
+        inode->tail_len != 0) {
+        return 0;
+    }
+    if (S_ISDIR(inode->mode)) {
+        struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
+        if (block_read(entries, inode->ptrs[0], 1) < 0) {
+            return 0;
+        }
+        for (int i = 0; i < DIRECTORY_ENTS_PER_BLK; i++) {
+            if (entries[i].valid && !old_inode_ok(entries[i].inode, disk_size)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* fs_format_check - 0 if 'super' (block 0 of the current device) can
+ * be mounted by this build, -EINVAL if it's an old image that can't
+ */
+int fs_format_check(struct fs_super *super)
+{
+    if (super->block_size != 0) {
+        return 0;
+    }
+    int ok = old_inode_ok(2, super->disk_size);
+    for (int i = 0; ok && i < super->n_orphans && i < FS_MAX_ORPHANS; i++) {
+        ok = old_inode_ok(super->orphans[i], super->disk_size);
+    }
+    for (int i = 0; ok && i < FS_MAX_SNAPS; i++) {
+        if (super->snaps[i].root != 0) {
+            ok = old_inode_ok(super->snaps[i].root, super->disk_size);
+        }
+    }
+    if (!ok) {
+        return -EINVAL;
+    }
+    super->block_size = FS_BLOCK_SIZE;
+    return block_write_super(super);
+}
+
+/* the instance FUSE operations work on
+ */
+static struct fs5600 *fs_default;
+
+static void fuse_opts(void)
+{
+    fs->opts.discard = fs_discard;
+    fs->opts.defrag_rate = defrag_rate;
+    fs->opts.compress = fs_compress;
+    fs->opts.dedup = fs_dedup;
+    fs->opts.checksum = fs_checksum;
+    fs->opts.writeback = fs_writeback;
+    fs->opts.warm = fs_warm;
+}
+
 /* init - this is called once by the FUSE framework at startup. Ignore
  * the 'conn' argument.
  * recommended actions:
  *   - read superblock
  *   - allocate memory, block allocation bitmap
  */
-
-struct fs_super super;
-unsigned char bitmap[FS_BLOCK_SIZE];
-
 void* fs_init(struct fuse_conn_info *conn)
 {
-    /* your code here */
- 
-    block_read(&super, 0, 1);
-    block_read(bitmap, 1, 1);
-
+    // here rather than in main, as FUSE forks before calling us
+    fs_default = calloc(1, sizeof(*fs_default));
+    fs_default->dev = block_default();
+    fs_default->fuse = 1;
+    fs_enter(fs_default);
+    fuse_opts();
+    fs_mount();
     return NULL;
 }
 
+/* destroy - called on unmount. (FUSE has no way to report an error
+ * from here.)
+ */
+void fs_destroy(void *private_data)
+{
+    fs_enter(fs_default);
+    fs_unmount();
+    free(fs_default);
+    fs_default = NULL;
+}
+
 static void set_attr(struct fs_inode *inode, struct stat *sb){
     memset(sb, 0, sizeof(*sb));
     sb->st_uid = inode->uid;
@@ -83,7 +382,14 @@ static void set_attr(struct fs_inode *inode, struct stat *sb){
     sb->st_size = inode->size;
     sb->st_blksize = FS_BLOCK_SIZE;
     sb->st_nlink = 1;
-    sb->st_blocks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    // holes don't take up space; st_blocks is in 512-byte units
+    sb->st_blocks = 0;
+    for (int i = 0; i < PTRS_PER_INODE; i++) {
+        if (inode->ptrs[i] != 0) {
+            sb->st_blocks += FS_BLOCK_SIZE / 512;
+        }
+    }
+    sb->st_blocks += DIV_ROUND_UP(inode->tail_len, 512);
 }
 
 /* Note on path translation errors:
@@ -100,12 +406,13 @@ static void set_attr(struct fs_inode *inode, struct stat *sb){
  * the value passed in by the FUSE framework is declared as 'const',
  * which means you can't modify it. The standard mechanisms for
  * splitting strings in C (strtok, strsep) modify the string in place,
- * so you have to copy the string and then free the copy when you're
- * done. One way of doing this:
+ * so you have to copy the string. We copy it to the stack, which
+ * keeps malloc out of every operation (the inode buffers below are on
+ * the stack for the same reason):
  *
- *    char *_path = strdup(path);
- *    int inum = translate(_path);
- *    free(_path);
+ *    char _path[strlen(path) + 1];
+ *    strcpy(_path, path);
+ *    int pathc = parse(_path, pathv);
  */
 
 
@@ -128,24 +435,48 @@ int parse(char *path, char **argv)
 
 /* search - search specific file/dir given inum and file/dir name
 *  return 0 if not found else inum
+*  Every inode and directory block it passes is metadata, for a tiered
+*  image (misc.c) to keep on the fast tier.
 */
 int search(int inum, char *name) {
     int found = 0;
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
     struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
     block_read(entries, inode->ptrs[0], 1);
+    block_pin(inum);
+    block_pin(inode->ptrs[0]);
     for (int j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
         if (entries[j].valid && strcmp(entries[j].name, name) == 0) {
             inum = entries[j].inode;
-            free(inode);
+            block_pin(inum);
             return inum;
         }
     }
-    free(inode);
     return found;
 }
 
+/* snapshots - /.snapshots is a directory that isn't on the disk
+ * (and isn't listed in the root): its entries are the snapshots in
+ * the superblock, and /.snapshots/<name> is that snapshot's copy of
+ * the root. It uses inode number 1, which is never a real inode.
+ */
+#define SNAP_DIR ".snapshots"
+#define SNAP_DIR_INUM 1
+
+/* snap_find - return the slot of snapshot 'name', or -1
+ */
+int snap_find(const char *name) {
+    for (int i = 0; i < FS_MAX_SNAPS; i++)
+        if (fs->super.snaps[i].root != 0 && strcmp(fs->super.snaps[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+int is_snap_path(int pathc, char **pathv) {
+    return pathc > 0 && strcmp(pathv[0], SNAP_DIR) == 0;
+}
+
 /* translate - given path token array and count
  *             return inum if found, else return error
  * errors -ENOTDIR: the intermediate of path is not a directory
@@ -153,20 +484,27 @@ int search(int inum, char *name) {
  */
 int translate(int pathc, char **pathv) {
     int inum = 2; // alway start from root 
-    struct fs_inode *inode = malloc(sizeof(*inode));
-    for (int i = 0; i < pathc; i++) {
+    int i = 0;
+    if (is_snap_path(pathc, pathv)) {
+        if (pathc == 1)
+            return SNAP_DIR_INUM;
+        int s = snap_find(pathv[1]);
+        if (s < 0)
+            return -ENOENT;
+        inum = fs->super.snaps[s].root;
+        i = 2;
+    }
+    struct fs_inode _inode, *inode = &_inode;
+    for (; i < pathc; i++) {
         block_read(inode, inum, 1);
         if (!S_ISDIR(inode->mode)) {
-            free(inode);
             return -ENOTDIR;
         }
         inum = search(inum, pathv[i]);
         if (inum == 0) {
-            free(inode);
             return -ENOENT;
         }
     }
-    free(inode);
     return inum;
 }
 
@@ -187,20 +525,23 @@ int translate(int pathc, char **pathv) {
 
 int fs_getattr(const char *path, struct stat *sb)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
     int inum = translate(pathc, pathv);
-    free(_path);
     if (inum == -ENOENT || inum == -ENOTDIR) {
     	return inum;
     }
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
-    block_read(inode, inum, 1);
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum == SNAP_DIR_INUM ? 2 : inum, 1);
     set_attr(inode, sb);
+    if (inum == SNAP_DIR_INUM) {
+        sb->st_mode = S_IFDIR | 0555;
+        sb->st_size = sb->st_blocks = 0;
+    }
 
-    free(inode);
     return 0;
 }
 
@@ -219,25 +560,36 @@ int fs_getattr(const char *path, struct stat *sb)
 int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
     int inum = translate(pathc, pathv);
-    free(_path);
     if (inum == -ENOENT || inum == -ENOTDIR) {
     	return inum;
     }
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
+    struct stat _sb, *sb = &_sb;
+    if (inum == SNAP_DIR_INUM) {
+        for (int i = 0; i < FS_MAX_SNAPS; i++) {
+            if (fs->super.snaps[i].root != 0) {
+                block_read(inode, fs->super.snaps[i].root, 1);
+                set_attr(inode, sb);
+                filler(ptr, fs->super.snaps[i].name, sb, 0);
+            }
+        }
+        return 0;
+    }
     block_read(inode, inum, 1);
     if (!S_ISDIR(inode->mode)) {
-        free(inode);
         return -ENOTDIR;
     }
 
     struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
     block_read(entries, inode->ptrs[0], 1);
-    struct stat *sb = malloc(sizeof(*sb));
+    block_pin(inum);
+    block_pin(inode->ptrs[0]);
     for (int j=0; j < DIRECTORY_ENTS_PER_BLK; j++) {
         if (entries[j].valid) {
             set_attr(inode, sb);
@@ -245,249 +597,1847 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
         }
     }
 
-    free(inode);
     return 0;
 }
 
-int get_free_blk(void) {
-    for (int i = 0; i < FS_BLOCK_SIZE; i++) {
-        if (!bit_test(bitmap, i)) {
-            return i;
+/* discard - with discard enabled (hwfuse -discard) the blocks freed
+ * by an operation are collected here and, once the operation's
+ * metadata has been written, merged into extents and punched out of
+ * the image file, so that host disk usage follows the live data.
+ */
+
+static int cmp_extent(const void *a, const void *b) {
+    return ((struct fs_extent *)a)->start - ((struct fs_extent *)b)->start;
+}
+
+/* sort the pending extents and merge the ones that touch */
+void discard_merge(void) {
+    if (fs->discard_count == 0) return;
+    qsort(fs->discard_list, fs->discard_count, sizeof(struct fs_extent), cmp_extent);
+    int n = 0;
+    for (int i = 1; i < fs->discard_count; i++) {
+        struct fs_extent *e = &fs->discard_list[n];
+        if (e->start + e->len == fs->discard_list[i].start) {
+            e->len += fs->discard_list[i].len;
+        } else {
+            fs->discard_list[++n] = fs->discard_list[i];
         }
     }
-    return -ENOSPC;
+    fs->discard_count = n + 1;
 }
 
-int get_free_dirent(struct fs_dirent *entries) {
-    for (int j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
-        if (!entries[j].valid) {
-            return j;
+/* discard_flush - called once an operation's metadata is on disk to
+ * finish freeing blocks: writes back reference counts dropped by
+ * put_blk, then discards the blocks freed.
+ */
+void ref_flush(void);
+void discard_flush(void) {
+    ref_flush();
+    discard_merge();
+    for (int i = 0; i < fs->discard_count; i++) {
+        block_discard(fs->discard_list[i].start, fs->discard_list[i].len);
+    }
+    fs->discard_count = 0;
+}
+
+void discard_add(int blk) {
+    if (!fs->opts.discard) return;
+    if (fs->discard_count > 0) {
+        struct fs_extent *e = &fs->discard_list[fs->discard_count-1];
+        if (e->start + e->len == blk) {
+            e->len++;
+            return;
+        }
+        if (blk + 1 == e->start) {
+            e->start--;
+            e->len++;
+            return;
         }
     }
-    return -ENOSPC;
+    if (fs->discard_count == MAX_DISCARD) {
+        discard_merge();
+    }
+    if (fs->discard_count == MAX_DISCARD) {
+        discard_flush();
+    }
+    fs->discard_list[fs->discard_count].start = blk;
+    fs->discard_list[fs->discard_count].len = 1;
+    fs->discard_count++;
 }
 
-int create_inode(mode_t mode, int inum) {
-    struct fs_inode *inode = malloc(sizeof(*inode));
-    struct fuse_context *ctx = fuse_get_context();
-    uint16_t uid = ctx->uid;
-    uint16_t gid = ctx->gid;
-    inode->uid = uid;
-    inode->gid = gid;
-    inode->mode = mode;
-    inode->mtime = inode->ctime = time(NULL);
-    inode->size = FS_BLOCK_SIZE;
-    memset(inode->ptrs, 0, (FS_BLOCK_SIZE/4 - 5) * sizeof(uint32_t));
-    block_write(inode, inum, 1);
+/* changed-block tracking - every block written or discarded marks its
+ * group with the current generation, and FS_IOC_CHECKPOINT starts a
+ * new one, so delta-img can copy just the groups changed since a
+ * checkpoint. The first time a group changes in a generation the
+ * superblock is written before the block, so a crash can't lose
+ * track of a change; that's one extra write per group per checkpoint.
+ */
+void track_write(int lba, int nblks) {
+    int changed = 0;
+    for (int g = lba / FS_GROUP_SIZE; g <= (lba + nblks - 1) / FS_GROUP_SIZE; g++) {
+        if (fs->super.group_gen[g] != fs->super.gen) {
+            fs->super.group_gen[g] = fs->super.gen;
+            changed = 1;
+        }
+    }
+    if (changed) {
+        write_super();
+    }
+}
 
-    free(inode);
-    return 0;
+uint32_t checkpoint(void) {
+    fs->super.gen++;
+    write_super();
+    return fs->super.gen;
 }
 
-int create_empty_entries(struct fs_dirent *entries) {
-    for (int j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
-        entries[j].valid = 0;
+/* placement - the disk is divided into groups of GROUP_SIZE blocks
+ * and we keep a count of the free blocks in each. A new directory goes
+ * in the emptiest group, which spreads directories over the disk; a
+ * file's inode goes just after its directory's entries and its data
+ * just after the inode (see alloc_file_blk), so a directory and its
+ * files end up close together and can be read mostly sequentially.
+ */
+#define GROUP_SIZE FS_GROUP_SIZE
+#define MAX_GROUPS FS_MAX_GROUPS
+
+void count_group_free(void) {
+    memset(fs->group_free, 0, sizeof(fs->group_free));
+    for (int i = 0; i < fs->super.disk_size; i++) {
+        if (!bit_test(fs->bitmap, i)) {
+            fs->group_free[i / GROUP_SIZE]++;
+        }
     }
-    return 0;
+    fs->group_free_valid = 1;
 }
-/* create - create a new file with specified permissions
- *
- * success - return 0
- * errors - path resolution, EEXIST
- *          in particular, for create("/a/b/c") to succeed,
- *          "/a/b" must exist, and "/a/b/c" must not.
- *
- * Note that 'mode' will already have the S_IFREG bit set, so you can
- * just use it directly. Ignore the third parameter.
- *
- * If a file or directory of this name already exists, return -EEXIST.
- * If there are already 128 entries in the directory (i.e. it's filled an
- * entire block), you are free to return -ENOSPC instead of expanding it.
+
+/* A clean image (see mark_clean) has the counts in the superblock, so
+ * mounting it reads nothing else; otherwise they're counted from the
+ * bitmap by the reaper as it starts, or by the first allocation if
+ * that comes first. Either way the image is marked as in use until
+ * it's unmounted.
  */
-int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
-{
-    char *_path = strdup(path);
-    char *pathv[MAX_NAME_LEN];
-    int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
-    int parent_inum = translate(pathc-1, pathv);
-    char name[MAX_NAME_LEN];
-    strcpy(name, pathv[pathc-1]);
-    free(_path);
+void groups_init(void) {
+    fs->n_groups = DIV_ROUND_UP(fs->super.disk_size, GROUP_SIZE);
+    fs->group_free_valid = 0;
+    if (fs->super.state == FS_STATE_CLEAN) {
+        for (int g = 0; g < fs->n_groups; g++) {
+            fs->group_free[g] = fs->super.group_free[g];
+        }
+        fs->group_free_valid = 1;
+        fs->super.state = 0;
+        write_super();
+    }
+}
 
-    if (inum > 0) return -EEXIST;
-    if (parent_inum < 0 ) return parent_inum;
-    
-    struct fs_inode *parent_inode = malloc(sizeof(*parent_inode));
-    block_read(parent_inode, parent_inum, 1);
-    if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
-    
-    // find a free entry on parent dir
-    // find a free blk to store file inode
-    struct fs_dirent parent_entries[DIRECTORY_ENTS_PER_BLK];
-    block_read(parent_entries, parent_inode->ptrs[0], 1);
-    int free_block = get_free_blk();
-    int free_dirent = get_free_dirent(parent_entries);
-    if (free_block < 0 || free_dirent < 0) {
-        free(parent_inode);
-        return -ENOSPC;
+void groups_check(void) {
+    if (!fs->group_free_valid) {
+        count_group_free();
     }
-    bit_set(bitmap, free_block);
-    block_write(bitmap, 1, 1);
+}
 
-    // create file inode
-    if (create_inode(mode, free_block) != 0) {         
-        free(parent_inode);
-        return -ENOSPC;
+/* mark_clean - save the counts and mark the image clean; from
+ * fs_destroy, once nothing else is running
+ */
+void mark_clean(void) {
+    groups_check();
+    for (int g = 0; g < fs->n_groups; g++) {
+        fs->super.group_free[g] = fs->group_free[g];
     }
-    // push new inode onto parent dir's entry
-    parent_entries[free_dirent].valid = 1;
-    strcpy(parent_entries[free_dirent].name, name);
-    parent_entries[free_dirent].inode = free_block;
-    block_write(parent_entries, parent_inode->ptrs[0], 1);
+    fs->super.state = FS_STATE_CLEAN;
+    write_super();
+}
 
-    // find another free blk to store file content
-    inum = free_block;
-    free_block = get_free_blk();
-    if (free_block < 0) {
-        free(parent_inode);
-        return -ENOSPC;
+int emptiest_group(void) {
+    groups_check();
+    int best = 0;
+    for (int g = 1; g < fs->n_groups; g++) {
+        if (fs->group_free[g] > fs->group_free[best]) {
+            best = g;
+        }
     }
-    bit_set(bitmap, free_block);
-    block_write(bitmap, 1, 1);
+    return best;
+}
 
-    // file inode -> file content blk
-    struct fs_inode *inode = malloc(sizeof(*inode));
-    block_read(inode, inum, 1);
-    char *buf[FS_BLOCK_SIZE];
-    memset(buf, 0, FS_BLOCK_SIZE);
-    inode->ptrs[0] = free_block;
-    block_write(inode, inum, 1);
-    block_write(buf, free_block, 1);
+/* use_blk - mark a block in use in the (in-memory) bitmap; the caller
+ * writes the bitmap.
+ */
+void use_blk(int blk) {
+    if (!bit_test(fs->bitmap, blk)) {
+        bit_set(fs->bitmap, blk);
+        fs->group_free[blk / GROUP_SIZE]--;
+    }
+}
 
-    free(parent_inode);
-    free(inode);
-    return 0;
+/* defrag_note - blocks lba..lba+nblks-1 are being written or freed;
+ * any copy in progress from one of them is out of date
+ */
+void defrag_note(int lba, int nblks) {
+    for (struct defrag_watch *w = fs->defrags; w != NULL; w = w->next) {
+        for (int i = lba; i < lba + nblks; i++) {
+            if (bit_test(w->map, i)) w->changed = 1;
+        }
+    }
 }
 
-/* mkdir - create a directory with the given mode.
- *
- * WARNING: unlike fs_create, @mode only has the permission bits. You
- * have to OR it with S_IFDIR before setting the inode 'mode' field.
- *
- * success - return 0
- * Errors - path resolution, EEXIST
- * Conditions for EEXIST are the same as for create. 
- */ 
-int fs_mkdir(const char *path, mode_t mode)
-{
-    mode |= S_IFDIR;
-    char *_path = strdup(path);
-    char *pathv[MAX_NAME_LEN];
-    int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
-    int parent_inum = translate(pathc-1, pathv);
-    char name[MAX_NAME_LEN];
-    strcpy(name, pathv[pathc-1]);
-    free(_path);
+/* free_blk - mark a block free in the (in-memory) bitmap; the caller
+ * writes the bitmap and then calls discard_flush().
+ */
+void free_blk(int blk) {
+    defrag_note(blk, 1);
+    if (bit_test(fs->bitmap, blk)) {
+        bit_clear(fs->bitmap, blk);
+        fs->group_free[blk / GROUP_SIZE]++;
+    }
+    dedup_forget(blk);
+    discard_add(blk);
+    block_unpin(blk);
+}
+
+/* trim - discard every free block on the disk, like fstrim(8) does for
+ * a mounted file system. Free runs shorter than 'minlen' blocks are
+ * skipped. Returns the number of blocks discarded.
+ */
+int fs_trim(int minlen) {
+    int trimmed = 0;
+    int i = 0;
+    while (i < fs->super.disk_size) {
+        if (bit_test(fs->bitmap, i)) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < fs->super.disk_size && !bit_test(fs->bitmap, i)) i++;
+        if (i - start >= minlen && block_discard(start, i - start) == 0) {
+            trimmed += i - start;
+        }
+    }
+    return trimmed;
+}
+
+/* block reservations - the first append to a file grabs a window of
+ * up to RESV_WINDOW contiguous free blocks; it uses one and holds the
+ * rest (in memory only, nothing on disk) for its following appends,
+ * so files written concurrently don't interleave their blocks. The
+ * window is handed back on release/truncate/unlink, or taken away if
+ * the disk is otherwise full.
+ */
+#define RESV_WINDOW 16
+
+struct fs_resv *resv_find(int inum) {
+    for (int i = 0; i < MAX_RESV; i++) {
+        if (fs->resv_table[i].inum == inum) {
+            return &fs->resv_table[i];
+        }
+    }
+    return NULL;
+}
+
+void resv_release(struct fs_resv *r) {
+    for (int i = 0; i < r->len; i++) {
+        bit_clear(fs->resv_map, r->start + i);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+void resv_drop(int inum) {
+    struct fs_resv *r = resv_find(inum);
+    if (r != NULL) {
+        resv_release(r);
+    }
+}
+
+void resv_drop_all(void) {
+    for (int i = 0; i < MAX_RESV; i++) {
+        if (fs->resv_table[i].inum != 0) {
+            resv_release(&fs->resv_table[i]);
+        }
+    }
+}
+
+void resv_add(int inum, int start, int len) {
+    struct fs_resv *r = resv_find(inum);
+    if (r == NULL) {
+        r = resv_find(0);
+    }
+    if (r == NULL) {
+        r = &fs->resv_table[fs->resv_next];
+        fs->resv_next = (fs->resv_next + 1) % MAX_RESV;
+    }
+    if (r->inum != 0) {
+        resv_release(r);
+    }
+    r->inum = inum;
+    r->start = start;
+    r->len = len;
+    for (int i = 0; i < len; i++) {
+        bit_set(fs->resv_map, start + i);
+    }
+}
+
+int blk_is_free(int i) {
+    return !bit_test(fs->bitmap, i) && !bit_test(fs->resv_map, i);
+}
+
+int get_free_blk(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < fs->super.disk_size; i++) {
+            if (blk_is_free(i)) {
+                return i;
+            }
+        }
+        resv_drop_all();        /* only reserved blocks left - steal them */
+    }
+    return -ENOSPC;
+}
+
+/* find_free_run - look for 'want' contiguous free blocks, searching
+ * forward from 'goal' and wrapping around. Returns the start of the
+ * first run that is long enough, or else of the longest run seen;
+ * its length goes in *got. Returns -ENOSPC if nothing is free.
+ */
+int find_free_run(int goal, int want, int *got) {
+    int n = fs->super.disk_size;
+    int best = -ENOSPC, best_len = 0;
+    if (goal < 0 || goal >= n) {
+        goal = 0;
+    }
+    int i = goal, scanned = 0;
+    while (scanned < n) {
+        if (!blk_is_free(i)) {
+            i = (i + 1) % n;
+            scanned++;
+            continue;
+        }
+        int start = i, len = 0;
+        while (len < want && i < n && blk_is_free(i)) {
+            i++;
+            len++;
+            scanned++;
+        }
+        if (len > best_len) {
+            best = start;
+            best_len = len;
+        }
+        if (len >= want) {
+            break;
+        }
+        i %= n;
+    }
+    *got = best_len;
+    return best;
+}
+
+/* alloc_near - allocate the first free block at or after 'goal' in
+ * goal's group (wrapping around within the group). If that group is
+ * full, try the others, most free blocks first.
+ */
+int alloc_near(int goal) {
+    char tried[MAX_GROUPS] = {0};
+    if (goal < 0 || goal >= fs->super.disk_size) {
+        goal = 0;
+    }
+    int g = goal / GROUP_SIZE;
+    groups_check();
+    for (int n = 0; n < fs->n_groups; n++) {
+        int start = g * GROUP_SIZE;
+        int end = MIN(start + GROUP_SIZE, (int)fs->super.disk_size);
+        if (n > 0) {
+            goal = start;
+        }
+        tried[g] = 1;
+        for (int i = 0; fs->group_free[g] > 0 && i < end - start; i++) {
+            int blk = start + (goal - start + i) % (end - start);
+            if (blk_is_free(blk)) {
+                use_blk(blk);
+                return blk;
+            }
+        }
+        // next: the emptiest group we haven't looked at
+        int next = -1;
+        for (int h = 0; h < fs->n_groups; h++) {
+            if (!tried[h] && (next < 0 || fs->group_free[h] > fs->group_free[next])) {
+                next = h;
+            }
+        }
+        if (next < 0) break;
+        g = next;
+    }
+    int blk = get_free_blk();   // last resort - steals reservations
+    if (blk >= 0) {
+        use_blk(blk);
+    }
+    return blk;
+}
+
+/* alloc_file_blk - allocate a block to hold block 'idx' of file 'inum'
+ * and mark it in the (in-memory) bitmap; the caller writes the bitmap.
+ * Takes the file's reservation window first; otherwise opens a new
+ * window at the first full-size free run following the file's previous
+ * block (which is the block right after it, if that run is free).
+ */
+int alloc_file_blk(int inum, struct fs_inode *inode, int idx) {
+    int goal = inum + 1;
+    if (idx > 0 && inode->ptrs[idx-1] != 0) {
+        goal = FS_PTR_BLK(inode->ptrs[idx-1]) + 1;
+    }
+
+    int blk;
+    struct fs_resv *r = resv_find(inum);
+    if (r != NULL && r->len > 0) {
+        blk = r->start;
+        bit_clear(fs->resv_map, blk);
+        r->start++;
+        r->len--;
+    } else {
+        int got;
+        blk = find_free_run(goal, RESV_WINDOW, &got);
+        if (blk < 0) {
+            blk = get_free_blk();
+        } else if (got > 1) {
+            resv_add(inum, blk + 1, got - 1);
+        }
+    }
+    if (blk < 0) {
+        return blk;
+    }
+    use_blk(blk);
+    return blk;
+}
+
+/* reference counts - a data block can be shared by several files, or
+ * several places in one file, through dedup or cloning, and inodes and
+ * directory blocks are shared with snapshots. ref_count[b] is the
+ * number of references to b beyond the first, so 0 for a block that
+ * isn't shared. The table is kept in memory and in the blocks listed
+ * in super.ref_blks, which are allocated the first time anything is
+ * shared. A count is written before the inode that takes the new
+ * reference, and dropped (put_blk) only after the inode that gave it
+ * up; a crash in between can leak a block, but never free one that's
+ * in use. Shared blocks are never written in place - writers take a
+ * copy and put_blk the original.
+ */
+/* ref_load - the table is read a block at a time as it's needed, so
+ * this just forgets the last mount's
+ */
+void ref_load(void) {
+    memset(fs->ref_count, 0, sizeof(fs->ref_count));
+    fs->ref_loaded = 0;
+}
+
+/* ref_ptr - the count for block 'blk'
+ */
+uint16_t *ref_ptr(int blk) {
+    int i = blk / FS_REFS_PER_BLK;
+    if (!(fs->ref_loaded & (1u << i))) {
+        if (fs->super.ref_blks[i] != 0) {
+            block_read(&fs->ref_count[i * FS_REFS_PER_BLK], fs->super.ref_blks[i], 1);
+        }
+        fs->ref_loaded |= 1u << i;
+    }
+    return &fs->ref_count[blk];
+}
+
+int is_shared(int blk) {
+    return *ref_ptr(blk) > 0;
+}
+
+void ref_write(int i) {
+    block_write(&fs->ref_count[i * FS_REFS_PER_BLK], fs->super.ref_blks[i], 1);
+}
+
+void ref_flush(void) {
+    for (int i = 0; fs->ref_dirty != 0; i++) {
+        if (fs->ref_dirty & (1 << i)) {
+            ref_write(i);
+            fs->ref_dirty &= ~(1 << i);
+        }
+    }
+}
+
+int ref_table_alloc(void) {
+    int rv = 0;
+    int n = DIV_ROUND_UP(fs->super.disk_size, FS_REFS_PER_BLK);
+    for (int i = 0; i < n; i++) {
+        if (fs->super.ref_blks[i] != 0) continue;
+        int blk = alloc_near(0);
+        if (blk < 0) {
+            rv = blk;
+            break;
+        }
+        fs->super.ref_blks[i] = blk;
+        ref_write(i);
+    }
+    block_write(fs->bitmap, 1, 1);
+    write_super();
+    pin_tables();
+    return rv;
+}
+
+/* ref_inc - take another reference to block 'blk', in memory; the
+ * caller calls ref_flush() before writing the inode that uses it.
+ */
+int ref_inc(int blk) {
+    uint16_t *count = ref_ptr(blk);
+    if (*count == UINT16_MAX) {
+        return -EMLINK;
+    }
+    int i = blk / FS_REFS_PER_BLK;
+    if (fs->super.ref_blks[i] == 0 && ref_table_alloc() < 0) {
+        return -ENOSPC;
+    }
+    (*count)++;
+    fs->ref_dirty |= 1 << i;
+    return 0;
+}
+
+/* ref_get - same, written out at once
+ */
+int ref_get(int blk) {
+    int rv = ref_inc(blk);
+    if (rv == 0) {
+        ref_flush();
+    }
+    return rv;
+}
+
+/* ref_inc_ptrs - take a reference to every block 'inode' points to;
+ * all of them or (on error) none. The caller calls ref_flush().
+ */
+int ref_inc_ptrs(struct fs_inode *inode) {
+    int i, rv = 0;
+    for (i = 0; i < PTRS_PER_INODE; i++) {
+        if (inode->ptrs[i] != 0 && (rv = ref_inc(FS_PTR_BLK(inode->ptrs[i]))) < 0) {
+            break;
+        }
+    }
+    if (rv < 0) {
+        // undo the ones that worked
+        while (--i >= 0) {
+            if (inode->ptrs[i] != 0) {
+                (*ref_ptr(FS_PTR_BLK(inode->ptrs[i])))--;
+            }
+        }
+    }
+    return rv;
+}
+
+/* put_blk - drop a reference to a file's block, freeing the block
+ * along with the last one. As with free_blk, the caller writes the
+ * bitmap and then calls discard_flush().
+ */
+void put_blk(int blk) {
+    uint16_t *count = ref_ptr(blk);
+    if (*count > 0) {
+        (*count)--;
+        fs->ref_dirty |= 1 << (blk / FS_REFS_PER_BLK);
+    } else {
+        free_blk(blk);
+    }
+}
+
+/* checksums - an image with a checksum table (mount with -checksum to
+ * add one) keeps a CRC-32C of every block, updated as blocks are
+ * written and checked as they're read; a block that doesn't match is
+ * reported, and the read fails with EIO. Like the reference counts the
+ * table is kept in memory, and the parts changed by an operation are
+ * written when it finishes, from fs_unlock. Discarded blocks have
+ * checksum 0, meaning unknown, and aren't checked. scrub-img checks a
+ * whole image offline.
+ *
+ * As the table is written after the blocks it covers, a crash can
+ * leave checksums that don't match what did reach the disk. So an
+ * unclean mount recomputes them for the groups written since the
+ * last mount (see csum_recover), and every mount saves the generation
+ * it started in.
+ */
+
+int is_csum_blk(int blk) {
+    for (int i = 0; i < FS_MAX_CSUM_BLKS && fs->super.csum_blks[i] != 0; i++) {
+        if (fs->super.csum_blks[i] == blk) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* csum_ptr - the checksum of block 'blk', reading that part of the
+ * table the first time
+ */
+uint32_t *csum_ptr(int blk) {
+    int i = blk / FS_CSUMS_PER_BLK;
+    if (!(fs->csum_loaded & (1u << i))) {
+        fs->csum_loaded |= 1u << i;
+        block_read(&fs->csum[i * FS_CSUMS_PER_BLK], fs->super.csum_blks[i], 1);
+    }
+    return &fs->csum[blk];
+}
+
+void csum_update(const char *buf, int lba, int nblks) {
+    for (int i = 0; i < nblks; i++) {
+        if (is_csum_blk(lba + i)) {
+            continue;
+        }
+        *csum_ptr(lba + i) = buf ? crc32c(0, buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE) : 0;
+        fs->csum_dirty |= 1u << ((lba + i) / FS_CSUMS_PER_BLK);
+    }
+}
+
+void csum_flush(void) {
+    for (int i = 0; fs->csum_dirty != 0; i++) {
+        if (fs->csum_dirty & (1u << i)) {
+            fs->csum_dirty &= ~(1u << i);
+            block_write(&fs->csum[i * FS_CSUMS_PER_BLK], fs->super.csum_blks[i], 1);
+        }
+    }
+}
+
+int csum_check(const char *buf, int lba, int nblks) {
+    int rv = 0;
+    for (int i = 0; i < nblks; i++) {
+        // (table blocks aren't checked, which also keeps csum_ptr's
+        // read of one from coming back here)
+        if (is_csum_blk(lba + i)) {
+            continue;
+        }
+        uint32_t c = *csum_ptr(lba + i);
+        if (c != 0 && crc32c(0, buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE) != c) {
+            rv = -EIO;
+        }
+    }
+    return rv;
+}
+
+void blk_written(const char *buf, int lba, int nblks) {
+    track_write(lba, nblks);
+    defrag_note(lba, nblks);
+    if (fs->super.csum_blks[0] != 0) {
+        csum_update(buf, lba, nblks);
+    }
+}
+
+/* csum_table_alloc - add a checksum table to the image, with the
+ * checksum of every block in use
+ */
+int csum_table_alloc(void) {
+    int n = DIV_ROUND_UP(fs->super.disk_size, FS_CSUMS_PER_BLK);
+    for (int i = 0; i < n; i++) {
+        int blk = alloc_near(0);
+        if (blk < 0) {
+            for (i--; i >= 0; i--) {
+                free_blk(fs->super.csum_blks[i]);
+                fs->super.csum_blks[i] = 0;
+            }
+            return blk;
+        }
+        fs->super.csum_blks[i] = blk;
+    }
+    char buf[FS_BLOCK_SIZE];
+    memset(fs->csum, 0, sizeof(fs->csum));
+    for (int b = 1; b < fs->super.disk_size; b++) {
+        if (bit_test(fs->bitmap, b) && !is_csum_blk(b)) {
+            block_read(buf, b, 1);
+            fs->csum[b] = crc32c(0, buf, FS_BLOCK_SIZE);
+        }
+    }
+    fs->csum_dirty = fs->csum_loaded = ((uint64_t)1 << n) - 1;
+    block_write(fs->bitmap, 1, 1);
+    csum_flush();
+    write_super();
+    return 0;
+}
+
+/* csum_recover - after a crash, the checksum of every block in the
+ * groups written since mount_gen, from what's on the disk
+ */
+void csum_recover(void) {
+    char buf[FS_BLOCK_SIZE];
+    for (int g = 0; g < fs->n_groups; g++) {
+        if (fs->super.group_gen[g] < fs->super.mount_gen) {
+            continue;
+        }
+        for (int b = MAX(g * GROUP_SIZE, 1); b < MIN((g + 1) * GROUP_SIZE, fs->super.disk_size); b++) {
+            if (is_csum_blk(b)) {
+                continue;
+            }
+            uint32_t c = 0;
+            if (bit_test(fs->bitmap, b)) {
+                block_read(buf, b, 1);
+                c = crc32c(0, buf, FS_BLOCK_SIZE);
+            }
+            if (*csum_ptr(b) != c) {
+                *csum_ptr(b) = c;
+                fs->csum_dirty |= 1u << (b / FS_CSUMS_PER_BLK);
+            }
+        }
+    }
+    csum_flush();
+}
+
+void csum_init(int clean) {
+    block_set_hooks(blk_written, NULL);
+    fs->csum_dirty = fs->csum_loaded = 0;
+    if (fs->super.csum_blks[0] != 0 && !clean) {
+        csum_recover();         // with the hooks off, so nothing is checked
+    }
+    if (fs->super.mount_gen != fs->super.gen) {
+        fs->super.mount_gen = fs->super.gen;
+        write_super();
+    }
+    if (fs->super.csum_blks[0] == 0 && (!fs->opts.checksum || csum_table_alloc() < 0)) {
+        return;
+    }
+    block_set_hooks(blk_written, csum_check);   // which reads the table as needed
+}
+
+/* pin_tables - the metadata that path lookups don't pass through: the
+ * superblock, bitmap, root inode and the reference count and checksum
+ * tables. See search().
+ */
+void pin_tables(void) {
+    for (int b = 0; b <= 2; b++) {
+        block_pin(b);
+    }
+    for (int i = 0; i < FS_MAX_REF_BLKS; i++) {
+        if (fs->super.ref_blks[i] != 0) block_pin(fs->super.ref_blks[i]);
+    }
+    for (int i = 0; i < FS_MAX_CSUM_BLKS; i++) {
+        if (fs->super.csum_blks[i] != 0) block_pin(fs->super.csum_blks[i]);
+    }
+}
+
+/* dedup - with hwfuse -dedup, every block written through fs_write is
+ * hashed, and looked up in an index of the blocks written so far; if
+ * a block with the same contents is found (compared in full, not just
+ * by hash) the file takes a reference to it instead of writing its
+ * own. The index is in memory only and starts out empty at mount.
+ * Blocks leave it when freed; one overwritten since it was indexed
+ * just fails the compare.
+ */
+/* 64-bit FNV-1a, a word at a time */
+uint64_t blk_hash(const char *data) {
+    const uint64_t *w = (const uint64_t*)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < FS_BLOCK_SIZE / 8; i++) {
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+    }
+    return h | 1;
+}
+
+void dedup_forget(int blk) {
+    if (fs->dedup_hash[blk] == 0) return;
+    int *p = &fs->dedup_head[fs->dedup_hash[blk] % DEDUP_BUCKETS];
+    while (*p != 0 && *p != blk) {
+        p = &fs->dedup_next[*p];
+    }
+    if (*p == blk) {
+        *p = fs->dedup_next[blk];
+    }
+    fs->dedup_hash[blk] = 0;
+}
+
+void dedup_add(int blk, const char *data) {
+    dedup_forget(blk);
+    uint64_t h = blk_hash(data);
+    fs->dedup_hash[blk] = h;
+    fs->dedup_next[blk] = fs->dedup_head[h % DEDUP_BUCKETS];
+    fs->dedup_head[h % DEDUP_BUCKETS] = blk;
+}
+
+/* dedup_find - a block in the index holding exactly 'data', or -1
+ */
+int dedup_find(const char *data) {
+    char buf[FS_BLOCK_SIZE];
+    uint64_t h = blk_hash(data);
+    for (int b = fs->dedup_head[h % DEDUP_BUCKETS]; b != 0; b = fs->dedup_next[b]) {
+        if (fs->dedup_hash[b] != h) continue;
+        block_read(buf, b, 1);
+        if (memcmp(buf, data, FS_BLOCK_SIZE) == 0) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+/* tail packing - a file of at most TAIL_MAX bytes with no blocks of
+ * its own keeps all its data in a slot of a shared tail block (inode
+ * tail_blk/tail_off/tail_len), so small files don't each take a whole
+ * block. Bytes in a slot past EOF are always zero. A file that grows
+ * past TAIL_MAX, or is preallocated, is unpacked into an ordinary
+ * block. tail_cache remembers blocks with free units in them; it is
+ * empty at mount, so older tail blocks are only filled up again once
+ * one of their files is freed.
+ */
+#define TAIL_MAX (FS_BLOCK_SIZE / 2)
+
+void tail_cache_set(int blk, int nfree) {
+    struct tail_info *t = NULL, *victim = &fs->tail_cache[0];
+    for (int i = 0; i < TAIL_CACHE; i++) {
+        if (fs->tail_cache[i].blk == blk) {
+            t = &fs->tail_cache[i];
+            break;
+        }
+        if (fs->tail_cache[i].nfree < victim->nfree) {
+            victim = &fs->tail_cache[i];
+        }
+    }
+    if (t == NULL) {
+        if (nfree <= victim->nfree) return;
+        t = victim;
+    }
+    t->blk = nfree > 0 ? blk : 0;
+    t->nfree = nfree;
+}
+
+uint64_t unit_mask(int first, int n) {
+    return ((1ULL << n) - 1) << first;
+}
+
+/* find_units - first run of 'n' free units in a tail block, or -1
+ */
+int find_units(uint64_t used, int n) {
+    int len = 0;
+    for (int i = 1; i < TAIL_UNITS; i++) {
+        len = (used >> i) & 1 ? 0 : len + 1;
+        if (len == n) {
+            return i - n + 1;
+        }
+    }
+    return -1;
+}
+
+/* tail_alloc - find a slot for 'len' bytes (0 < len <= TAIL_MAX), in a
+ * cached tail block if possible, else in a new one near 'inum'. Leaves
+ * the block in 'buf' with the slot zeroed and marked used, for the
+ * caller to fill in and write. Returns the block number.
+ */
+int tail_alloc(int inum, int len, char *buf, int *off) {
+    struct fs_tail_hdr *hdr = (void*)buf;
+    int n = DIV_ROUND_UP(len, FS_TAIL_UNIT);
+    int u, blk = -ENOSPC;
+    for (int i = 0; i < TAIL_CACHE && blk < 0; i++) {
+        struct tail_info *t = &fs->tail_cache[i];
+        if (t->blk == 0 || t->nfree < n) continue;
+        block_read(buf, t->blk, 1);
+        if (hdr->magic != FS_TAIL_MAGIC) {
+            t->blk = t->nfree = 0;
+            continue;
+        }
+        if ((u = find_units(hdr->used, n)) >= 0) {
+            blk = t->blk;
+        }
+    }
+    if (blk < 0) {
+        if ((blk = alloc_near(inum + 1)) < 0) {
+            return blk;
+        }
+        block_write(fs->bitmap, 1, 1);
+        memset(buf, 0, FS_BLOCK_SIZE);
+        hdr->magic = FS_TAIL_MAGIC;
+        hdr->used = 1;
+        u = 1;
+    }
+    hdr->used |= unit_mask(u, n);
+    memset(buf + u * FS_TAIL_UNIT, 0, n * FS_TAIL_UNIT);
+    tail_cache_set(blk, TAIL_UNITS - __builtin_popcountll(hdr->used));
+    *off = u * FS_TAIL_UNIT;
+    return blk;
+}
+
+/* tail_release - give back a slot; the block itself is freed (and the
+ * bitmap written) when the last slot in it goes.
+ */
+void tail_release(int blk, int off, int len) {
+    char buf[FS_BLOCK_SIZE];
+    struct fs_tail_hdr *hdr = (void*)buf;
+    block_read(buf, blk, 1);
+    hdr->used &= ~unit_mask(off / FS_TAIL_UNIT, DIV_ROUND_UP(len, FS_TAIL_UNIT));
+    if (hdr->used == 1) {
+        tail_cache_set(blk, 0);
+        free_blk(blk);
+        block_write(fs->bitmap, 1, 1);
+    } else {
+        block_write(buf, blk, 1);
+        tail_cache_set(blk, TAIL_UNITS - __builtin_popcountll(hdr->used));
+    }
+}
+
+/* tail_write - write to a packed (or empty) file that stays within
+ * TAIL_MAX. Moves the data to a bigger slot if it doesn't fit; the new
+ * slot is written, then the inode, then the old slot given back.
+ */
+int tail_write(int inum, struct fs_inode *inode, const char *buf, int len, int offset) {
+    char blk[FS_BLOCK_SIZE];
+    int end = MAX(offset + len, inode->size);
+    if (inode->tail_blk != 0 && end <= inode->tail_len) {
+        block_read(blk, inode->tail_blk, 1);
+        memcpy(blk + inode->tail_off + offset, buf, len);
+        block_write(blk, inode->tail_blk, 1);
+        if (end > inode->size) {
+            inode->size = end;
+            block_write(inode, inum, 1);
+        }
+        return len;
+    }
+
+    char old[TAIL_MAX];
+    int old_blk = inode->tail_blk, old_off = inode->tail_off, old_len = inode->tail_len;
+    if (old_blk != 0) {
+        block_read(blk, old_blk, 1);
+        memcpy(old, blk + old_off, inode->size);
+    }
+    int off;
+    int tblk = tail_alloc(inum, end, blk, &off);
+    if (tblk < 0) {
+        return tblk;
+    }
+    if (old_blk != 0) {
+        memcpy(blk + off, old, inode->size);
+    }
+    memcpy(blk + off + offset, buf, len);
+    block_write(blk, tblk, 1);
+
+    inode->tail_blk = tblk;
+    inode->tail_off = off;
+    inode->tail_len = DIV_ROUND_UP(end, FS_TAIL_UNIT) * FS_TAIL_UNIT;
+    inode->size = end;
+    block_write(inode, inum, 1);
+    if (old_blk != 0) {
+        tail_release(old_blk, old_off, old_len);
+    }
+    return len;
+}
+
+/* tail_unpack - move a packed file's data into a block of its own
+ */
+int tail_unpack(int inum, struct fs_inode *inode) {
+    char buf[FS_BLOCK_SIZE], data[FS_BLOCK_SIZE];
+    int blk = alloc_file_blk(inum, inode, 0);
+    if (blk < 0) {
+        return blk;
+    }
+    block_read(buf, inode->tail_blk, 1);
+    memset(data, 0, FS_BLOCK_SIZE);
+    memcpy(data, buf + inode->tail_off, inode->size);
+    block_write(data, blk, 1);
+    block_write(fs->bitmap, 1, 1);
+
+    int old_blk = inode->tail_blk, old_off = inode->tail_off, old_len = inode->tail_len;
+    inode->ptrs[0] = blk;
+    inode->tail_blk = inode->tail_off = inode->tail_len = 0;
+    block_write(inode, inum, 1);
+    tail_release(old_blk, old_off, old_len);
+    return 0;
+}
+
+/* tail_truncate - truncate a packed file to 'len' <= tail_len bytes
+ */
+int tail_truncate(int inum, struct fs_inode *inode, int len) {
+    int old_blk = inode->tail_blk, old_off = inode->tail_off, old_len = inode->tail_len;
+    if (len == 0) {
+        inode->tail_blk = inode->tail_off = inode->tail_len = 0;
+    } else if (len < inode->size) {
+        char buf[FS_BLOCK_SIZE];
+        block_read(buf, old_blk, 1);
+        memset(buf + old_off + len, 0, inode->size - len);
+        block_write(buf, old_blk, 1);
+    }
+    inode->size = len;
+    block_write(inode, inum, 1);
+    if (len == 0) {
+        tail_release(old_blk, old_off, old_len);
+    }
+    return 0;
+}
+
+/* compression - files with FS_COMPR_FL set (chattr +c), or every file
+ * if the image is mounted with -compress, are written a cluster of
+ * FS_CLUSTER_BLKS blocks at a time: the cluster is deflated, and
+ * stored in the blocks the compressed data needs if that saves at
+ * least one block over storing it raw (see FS_PTR_COMPRESSED). Raw
+ * clusters are stored as usual, except that all-zero blocks become
+ * holes. fs_compress is the zlib level (-compress-fast uses 1).
+ */
+#define CLUSTER_SIZE (FS_CLUSTER_BLKS * FS_BLOCK_SIZE)
+#define COMPRESS_LEVEL 6
+
+int compress_level(struct fs_inode *inode) {
+    if (fs->opts.compress > 0) return fs->opts.compress;
+    return (inode->flags & FS_COMPR_FL) ? COMPRESS_LEVEL : 0;
+}
+
+int is_compressed(struct fs_inode *inode, int idx) {
+    return (inode->ptrs[idx - idx % FS_CLUSTER_BLKS] & FS_PTR_COMPRESSED) != 0;
+}
+
+int is_zero_blk(char *buf) {
+    for (int i = 0; i < FS_BLOCK_SIZE; i++) {
+        if (buf[i] != 0) return 0;
+    }
+    return 1;
+}
+
+/* cluster_load - read the logical contents of cluster 'c' into 'data'
+ */
+int cluster_load(struct fs_inode *inode, int c, char *data) {
+    uint32_t *p = &inode->ptrs[c * FS_CLUSTER_BLKS];
+    if (!(p[0] & FS_PTR_COMPRESSED)) {
+        for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+            if (p[i] == 0 || (p[i] & FS_PTR_UNWRITTEN)) {
+                memset(data + i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            } else {
+                block_read(data + i * FS_BLOCK_SIZE, p[i], 1);
+            }
+        }
+        return 0;
+    }
+
+    char zbuf[CLUSTER_SIZE];
+    int k = 0;
+    for (int i = 0; i < FS_CLUSTER_BLKS && p[i] != 0; i++) {
+        block_read(zbuf + k++ * FS_BLOCK_SIZE, FS_PTR_BLK(p[i]), 1);
+    }
+    uint32_t zlen = *(uint32_t*)zbuf;
+    uLongf dlen = CLUSTER_SIZE;
+    if (zlen > k * FS_BLOCK_SIZE - sizeof(zlen) ||
+        uncompress((Bytef*)data, &dlen, (Bytef*)zbuf + sizeof(zlen), zlen) != Z_OK) {
+        return -EIO;
+    }
+    memset(data + dlen, 0, CLUSTER_SIZE - dlen);
+    return 0;
+}
+
+/* cluster_store - write cluster 'c' of a file from 'data', compressed
+ * at 'level' if that pays, reusing the cluster's old blocks where it
+ * can. Only blocks before EOF (inode->size) are kept. All the blocks
+ * needed are allocated before anything is written, so ENOSPC leaves
+ * the cluster as it was. Updates inode->ptrs; the caller writes the
+ * inode and the bitmap.
+ */
+int cluster_store(int inum, struct fs_inode *inode, int c, char *data, int level) {
+    uint32_t *p = &inode->ptrs[c * FS_CLUSTER_BLKS];
+    int first = c * FS_CLUSTER_BLKS;
+    int n = MIN(FS_CLUSTER_BLKS, DIV_ROUND_UP(inode->size, FS_BLOCK_SIZE) - first);
+
+    // which blocks does the new layout need written?
+    char *src[FS_CLUSTER_BLKS] = {0};
+    int need = 0;
+    for (int i = 0; i < n; i++) {
+        if (!is_zero_blk(data + i * FS_BLOCK_SIZE)) {
+            src[i] = data + i * FS_BLOCK_SIZE;
+            need++;
+        }
+    }
+    char zbuf[CLUSTER_SIZE];
+    int zipped = 0;
+    uLongf zlen = CLUSTER_SIZE - sizeof(uint32_t);
+    if (level > 0 && need > 1 &&
+        compress2((Bytef*)zbuf + sizeof(uint32_t), &zlen, (Bytef*)data,
+                  n * FS_BLOCK_SIZE, level) == Z_OK) {
+        int k = DIV_ROUND_UP(zlen + sizeof(uint32_t), FS_BLOCK_SIZE);
+        if (k < need) {
+            zipped = 1;
+            need = k;
+            *(uint32_t*)zbuf = zlen;
+            memset(zbuf + sizeof(uint32_t) + zlen, 0,
+                   k * FS_BLOCK_SIZE - sizeof(uint32_t) - zlen);
+            for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+                src[i] = i < k ? zbuf + i * FS_BLOCK_SIZE : NULL;
+            }
+        }
+    }
+
+    // old blocks get reused first (unless shared), then new ones
+    // allocated; shared ones are only let go of once that's worked
+    int blks[FS_CLUSTER_BLKS], nblks = 0;
+    int shared[FS_CLUSTER_BLKS], nshared = 0;
+    for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+        if (p[i] != 0 && is_shared(FS_PTR_BLK(p[i]))) {
+            shared[nshared++] = FS_PTR_BLK(p[i]);
+        } else if (p[i] != 0) {
+            blks[nblks++] = FS_PTR_BLK(p[i]);
+        }
+    }
+    for (int i = nblks; i < need; i++) {
+        int blk = alloc_file_blk(inum, inode, first + i);
+        if (blk < 0) {
+            while (--i >= nblks) {
+                free_blk(blks[i]);
+            }
+            return blk;
+        }
+        blks[i] = blk;
+    }
+    for (int i = 0; i < nshared; i++) {
+        put_blk(shared[i]);
+    }
+    for (int i = need; i < nblks; i++) {
+        put_blk(blks[i]);
+    }
+
+    for (int i = 0, k = 0; i < FS_CLUSTER_BLKS; i++) {
+        p[i] = 0;
+        if (src[i] != NULL) {
+            block_write(src[i], blks[k], 1);
+            p[i] = blks[k++];
+        }
+    }
+    if (zipped) {
+        p[0] |= FS_PTR_COMPRESSED;
+    }
+    return 0;
+}
+
+/* cluster_write - fs_write for files that are compressed, or have
+ * compressed clusters in the range being written: read-modify-write
+ * of each cluster touched.
+ */
+int cluster_write(int inum, struct fs_inode *inode, const char *buf, int len, off_t offset) {
+    char data[CLUSTER_SIZE];
+    int level = compress_level(inode);
+    int old_size = inode->size;
+    int done = 0, rv = 0;
+    while (done < len) {
+        int c = (offset + done) / CLUSTER_SIZE;
+        int c_off = (offset + done) % CLUSTER_SIZE;
+        int n = MIN(len - done, CLUSTER_SIZE - c_off);
+        if ((rv = cluster_load(inode, c, data)) < 0) break;
+        memcpy(data + c_off, buf + done, n);
+        if (offset + done + n > inode->size) {
+            inode->size = offset + done + n;
+        }
+        if ((rv = cluster_store(inum, inode, c, data, level)) < 0) {
+            inode->size = MAX(old_size, offset + done);
+            break;
+        }
+        done += n;
+    }
+    block_write(fs->bitmap, 1, 1);
+    block_write(inode, inum, 1);
+    discard_flush();
+    return done > 0 ? done : rv;
+}
+
+int get_free_dirent(struct fs_dirent *entries) {
+    for (int j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
+        if (!entries[j].valid) {
+            return j;
+        }
+    }
+    return -ENOSPC;
+}
+
+int create_inode(mode_t mode, int inum, int size) {
+    struct fs_inode _inode, *inode = &_inode;
+    memset(inode, 0, sizeof(*inode));
+    uint16_t uid = getuid(), gid = getgid();
+    if (fs->fuse) {             // the caller's, not ours
+        struct fuse_context *ctx = fuse_get_context();
+        uid = ctx->uid;
+        gid = ctx->gid;
+    }
+    inode->uid = uid;
+    inode->gid = gid;
+    inode->mode = mode;
+    inode->mtime = inode->ctime = time(NULL);
+    inode->size = size;
+    block_write(inode, inum, 1);
+
+    return 0;
+}
+
+int create_empty_entries(struct fs_dirent *entries) {
+    for (int j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
+        entries[j].valid = 0;
+    }
+    return 0;
+}
+/* create - create a new file with specified permissions
+ *
+ * success - return 0
+ * errors - path resolution, EEXIST
+ *          in particular, for create("/a/b/c") to succeed,
+ *          "/a/b" must exist, and "/a/b/c" must not.
+ *
+ * Note that 'mode' will already have the S_IFREG bit set, so you can
+ * just use it directly. Ignore the third parameter.
+ *
+ * If a file or directory of this name already exists, return -EEXIST.
+ * If there are already 128 entries in the directory (i.e. it's filled an
+ * entire block), you are free to return -ENOSPC instead of expanding it.
+ */
+int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    char *pathv[MAX_NAME_LEN];
+    int pathc = parse(_path, pathv);
+    int parent_inum = translate(pathc-1, pathv);
+    int inum = translate(pathc, pathv);
+    char name[MAX_NAME_LEN];
+    strcpy(name, pathv[pathc-1]);
+
+    if (inum > 0) return -EEXIST;
+    if (parent_inum < 0 ) return parent_inum;
+    if (parent_inum == SNAP_DIR_INUM) return -EROFS;
+    
+    struct fs_inode _parent_inode, *parent_inode = &_parent_inode;
+    block_read(parent_inode, parent_inum, 1);
+    if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+    
+    // find a free entry on parent dir
+    // find a free blk to store file inode
+    struct fs_dirent parent_entries[DIRECTORY_ENTS_PER_BLK];
+    block_read(parent_entries, parent_inode->ptrs[0], 1);
+    int free_dirent = get_free_dirent(parent_entries);
+    if (free_dirent < 0) {
+        return -ENOSPC;
+    }
+    // only now that it will succeed, copy the parent out of any snapshot
+    if ((parent_inum = translate_w(pathc-1, pathv)) < 0) return parent_inum;
+    block_read(parent_inode, parent_inum, 1);
+    block_read(parent_entries, parent_inode->ptrs[0], 1);
+    // the inode goes right after the directory's entries
+    int free_block = alloc_near(parent_inode->ptrs[0] + 1);
+    if (free_block < 0) {
+        return -ENOSPC;
+    }
+    block_write(fs->bitmap, 1, 1);
+
+    // create file inode - empty, all holes, so no data block yet
+    if (create_inode(mode, free_block, 0) != 0) {         
+        return -ENOSPC;
+    }
+    // push new inode onto parent dir's entry
+    parent_entries[free_dirent].valid = 1;
+    strcpy(parent_entries[free_dirent].name, name);
+    parent_entries[free_dirent].inode = free_block;
+    block_write(parent_entries, parent_inode->ptrs[0], 1);
+
+    return 0;
+}
+
+/* mkdir - create a directory with the given mode.
+ *
+ * WARNING: unlike fs_create, @mode only has the permission bits. You
+ * have to OR it with S_IFDIR before setting the inode 'mode' field.
+ *
+ * success - return 0
+ * Errors - path resolution, EEXIST
+ * Conditions for EEXIST are the same as for create. 
+ */ 
+int fs_mkdir(const char *path, mode_t mode)
+{
+    mode |= S_IFDIR;
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    char *pathv[MAX_NAME_LEN];
+    int pathc = parse(_path, pathv);
+    // mkdir /.snapshots/<name> takes a snapshot
+    if (pathc == 2 && is_snap_path(pathc, pathv)) {
+        int rv = snap_create(pathv[1]);
+        return rv;
+    }
+    int parent_inum = translate(pathc-1, pathv);
+    int inum = translate(pathc, pathv);
+    char name[MAX_NAME_LEN];
+    strcpy(name, pathv[pathc-1]);
+
+    if (inum > 0) return -EEXIST;
+    if (parent_inum < 0 ) return parent_inum;
+    if (parent_inum == SNAP_DIR_INUM) return -EROFS;
+    
+    struct fs_inode _parent_inode, *parent_inode = &_parent_inode;
+    block_read(parent_inode, parent_inum, 1);
+    if (!S_ISDIR(parent_inode->mode)) {
+        return -ENOTDIR;
+    }
+
+    // find a free entry on parent dir
+    // find a free blk to store dir inode
+    struct fs_dirent parent_entries[DIRECTORY_ENTS_PER_BLK];
+    block_read(parent_entries, parent_inode->ptrs[0], 1);
+    int free_dirent = get_free_dirent(parent_entries);
+    if (free_dirent < 0) {
+        return -ENOSPC;
+    }
+    // as in fs_create, copy the parent out of any snapshot only now
+    if ((parent_inum = translate_w(pathc-1, pathv)) < 0) return parent_inum;
+    block_read(parent_inode, parent_inum, 1);
+    block_read(parent_entries, parent_inode->ptrs[0], 1);
+    // new directories go to the emptiest group, their entries right
+    // after the inode
+    int free_block = alloc_near(emptiest_group() * GROUP_SIZE);
+    if (free_block < 0) {
+        return -ENOSPC;
+    }
+    int dirent_free_block = alloc_near(free_block + 1);
+    if (dirent_free_block < 0) {
+        free_blk(free_block);
+        return -ENOSPC;
+    }
+    block_write(fs->bitmap, 1, 1);
+
+    // create dir inode
+    if (create_inode(mode, free_block, FS_BLOCK_SIZE) != 0) {         
+        return -ENOSPC;
+    }
+
+    // push new inode onto parent dir's entry
+    parent_entries[free_dirent].valid = 1;
+    strcpy(parent_entries[free_dirent].name, name);
+    parent_entries[free_dirent].inode = free_block;
+    block_write(parent_entries, parent_inode->ptrs[0], 1);
+
+    struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
+    create_empty_entries(entries);
+    block_write(entries, dirent_free_block, 1);
+
+    // dir inode -> empty dir entries
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, free_block, 1);
+    inode->ptrs[0] = dirent_free_block;
+    block_write(inode, free_block, 1);
+
+    return 0;
+}
+
+/* clear_blks - free every block the inode points to, including blocks
+ * preallocated past EOF, and its packed tail
+ */
+int clear_blks(struct fs_inode *inode) {
+    for (int i = 0; i < PTRS_PER_INODE; i++) {
+        if (inode->ptrs[i] != 0) {
+            put_blk(FS_PTR_BLK(inode->ptrs[i]));
+        }
+    }
+    if (inode->tail_blk != 0) {
+        tail_release(inode->tail_blk, inode->tail_off, inode->tail_len);
+    }
+    return 0;
+}
+int clear_inode(int inum) {
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum, 1);
+    memset(inode, 0, sizeof(struct fs_inode));
+    free_blk(inum);
+    block_write(fs->bitmap, 1, 1);
+    return 0;
+}
+
+/* snapshots - a snapshot is a copy of the root inode, sharing the
+ * root directory's block; taking one costs a block and a reference,
+ * whatever the size of the tree. Anything reachable from a snapshot
+ * is read-only. Operations that change the live tree look their path
+ * up with translate_w(), which copies each shared inode and directory
+ * block on the way down and takes a reference to whatever the copy
+ * points to, so that the path ends up private to the live tree and
+ * the usual copy-on-write of shared data blocks does the rest.
+ * Deleting a snapshot drops its references from the top, freeing
+ * whatever nothing else uses.
+ */
+
+/* cow_dir_blk - give directory 'inum' a private copy of its entry
+ * block, if it's shared
+ */
+int cow_dir_blk(int inum, struct fs_inode *inode) {
+    int old = inode->ptrs[0];
+    if (old == 0 || !is_shared(old)) {
+        return 0;
+    }
+    struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
+    block_read(entries, old, 1);
+    int blk = alloc_near(inum + 1);
+    if (blk < 0) {
+        return blk;
+    }
+    int j, rv = 0;
+    for (j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
+        if (entries[j].valid && (rv = ref_inc(entries[j].inode)) < 0) {
+            break;
+        }
+    }
+    if (rv < 0) {
+        while (--j >= 0) {
+            if (entries[j].valid) {
+                (*ref_ptr(entries[j].inode))--;
+            }
+        }
+        free_blk(blk);
+        return rv;
+    }
+    ref_flush();
+    block_write(entries, blk, 1);
+    block_write(fs->bitmap, 1, 1);
+    inode->ptrs[0] = blk;
+    block_write(inode, inum, 1);
+    put_blk(old);
+    ref_flush();
+    return 0;
+}
+
+/* cow_inode - make a private copy of shared inode 'inum', with a
+ * reference to each of its blocks and its own copy of a packed tail.
+ * Returns the new inode number; the caller points the directory entry
+ * at it and puts the old one.
+ */
+int cow_inode(int inum) {
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum, 1);
+    int blk = alloc_near(inum + 1);
+    int rv = blk < 0 ? blk : ref_inc_ptrs(inode);
+    if (rv == 0 && inode->tail_blk != 0) {
+        char old[FS_BLOCK_SIZE], buf[FS_BLOCK_SIZE];
+        int off;
+        block_read(old, inode->tail_blk, 1);
+        int tblk = tail_alloc(blk, inode->size, buf, &off);
+        if (tblk < 0) {
+            rv = tblk;
+        } else {
+            memcpy(buf + off, old + inode->tail_off, inode->size);
+            block_write(buf, tblk, 1);
+            inode->tail_blk = tblk;
+            inode->tail_off = off;
+            inode->tail_len = DIV_ROUND_UP(inode->size, FS_TAIL_UNIT) * FS_TAIL_UNIT;
+        }
+    }
+    if (rv < 0) {
+        if (blk >= 0) {
+            free_blk(blk);
+        }
+        return rv;
+    }
+    ref_flush();
+    block_write(inode, blk, 1);
+    block_write(fs->bitmap, 1, 1);
+    return blk;
+}
+
+/* translate_w - like translate, for operations that change the file
+ * or directory: the path is made private to the live tree, including
+ * the entry block if it's a directory.
+ * errors -EROFS: the path is in a snapshot
+ *        others as for translate, and -ENOSPC
+ */
+int translate_w(int pathc, char **pathv) {
+    if (is_snap_path(pathc, pathv)) {
+        return -EROFS;
+    }
+    int inum = 2, rv = 0;
+    struct fs_inode _inode, *inode = &_inode;
+    struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
+    for (int i = 0; i < pathc; i++) {
+        block_read(inode, inum, 1);
+        if (!S_ISDIR(inode->mode)) {
+            rv = -ENOTDIR;
+            break;
+        }
+        if ((rv = cow_dir_blk(inum, inode)) < 0) {
+            break;
+        }
+        block_read(entries, inode->ptrs[0], 1);
+        int j;
+        for (j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
+            if (entries[j].valid && strcmp(entries[j].name, pathv[i]) == 0) {
+                break;
+            }
+        }
+        if (j == DIRECTORY_ENTS_PER_BLK) {
+            rv = -ENOENT;
+            break;
+        }
+        int child = entries[j].inode;
+        if (is_shared(child)) {
+            if ((rv = cow_inode(child)) < 0) {
+                break;
+            }
+            entries[j].inode = rv;
+            block_write(entries, inode->ptrs[0], 1);
+            put_blk(child);
+            ref_flush();
+            child = rv;
+            rv = 0;
+        }
+        inum = child;
+    }
+    if (rv == 0) {
+        block_read(inode, inum, 1);
+        if (S_ISDIR(inode->mode)) {
+            rv = cow_dir_blk(inum, inode);
+        }
+    }
+    return rv < 0 ? rv : inum;
+}
+
+/* put_inode - drop a directory entry's reference to inode 'inum'; the
+ * last one frees it and drops its references in turn
+ */
+void put_inode(int inum) {
+    if (is_shared(inum)) {
+        put_blk(inum);
+        return;
+    }
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum, 1);
+    if (S_ISDIR(inode->mode) && !is_shared(inode->ptrs[0])) {
+        struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
+        block_read(entries, inode->ptrs[0], 1);
+        for (int j = 0; j < DIRECTORY_ENTS_PER_BLK; j++) {
+            if (entries[j].valid) {
+                put_inode(entries[j].inode);
+            }
+        }
+    }
+    resv_drop(inum);
+    clear_blks(inode);
+    free_blk(inum);
+}
+
+/* snap_create - mkdir /.snapshots/<name>
+ */
+int snap_create(const char *name) {
+    if (snap_find(name) >= 0) {
+        return -EEXIST;
+    }
+    int s;
+    for (s = 0; s < FS_MAX_SNAPS && fs->super.snaps[s].root != 0; s++)
+        ;
+    if (s == FS_MAX_SNAPS) {
+        return -ENOSPC;
+    }
+    struct fs_inode _root, *root = &_root;
+    block_read(root, 2, 1);
+    int blk = alloc_near(3);
+    int rv = blk < 0 ? blk : ref_inc_ptrs(root);
+    if (rv < 0) {
+        if (blk >= 0) {
+            free_blk(blk);
+        }
+        return rv;
+    }
+    ref_flush();
+    block_write(root, blk, 1);
+    block_write(fs->bitmap, 1, 1);
+    fs->super.snaps[s].root = blk;
+    strcpy(fs->super.snaps[s].name, name);
+    write_super();
+    return 0;
+}
+
+/* snap_delete - rmdir /.snapshots/<name>
+ */
+int snap_delete(const char *name) {
+    int s = snap_find(name);
+    if (s < 0) {
+        return -ENOENT;
+    }
+    int root = fs->super.snaps[s].root;
+    memset(&fs->super.snaps[s], 0, sizeof(fs->super.snaps[s]));
+    write_super();
+    put_inode(root);
+    block_write(fs->bitmap, 1, 1);
+    discard_flush();
+    return 0;
+}
+/* orphans - unlinking a big file just takes its directory entry away
+ * and puts the inode on the orphan list in the superblock; the reaper
+ * thread frees its blocks afterwards, REAP_BATCH at a time, so unlink
+ * takes the same time for any file size. Files with fewer than
+ * REAP_THRESHOLD blocks (or a full orphan list) are freed right away.
+ */
+#define REAP_THRESHOLD 32
+#define REAP_BATCH 64
+
+void write_super(void) {
+    block_write_super(&fs->super);
+}
+
+int count_blks(struct fs_inode *inode) {
+    int n = 0;
+    for (int i = 0; i < PTRS_PER_INODE; i++) {
+        if (inode->ptrs[i] != 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+int orphan_add(int inum) {
+    if (fs->super.n_orphans == FS_MAX_ORPHANS) return -ENOSPC;
+    fs->super.orphans[fs->super.n_orphans++] = inum;
+    write_super();
+    pthread_cond_signal(&fs->reap_cond);
+    return 0;
+}
+
+void orphan_remove(int inum) {
+    for (int i = 0; i < fs->super.n_orphans; i++) {
+        if (fs->super.orphans[i] == inum) {
+            fs->super.orphans[i] = fs->super.orphans[--fs->super.n_orphans];
+            break;
+        }
+    }
+    write_super();
+}
+
+/* reap_batch - free up to REAP_BATCH blocks of orphan 'inum', or the
+ * inode itself once it has none left. The inode is written before the
+ * bitmap, and the orphan list before the inode is freed: a crash in
+ * between leaks blocks, but never leaves an orphan pointing at blocks
+ * that may since have been given to another file.
+ */
+void reap_batch(int inum) {
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum, 1);
+    int n = 0;
+    for (int i = PTRS_PER_INODE - 1; i >= 0 && n < REAP_BATCH; i--) {
+        if (inode->ptrs[i] != 0) {
+            put_blk(FS_PTR_BLK(inode->ptrs[i]));
+            inode->ptrs[i] = 0;
+            n++;
+        }
+    }
+    if (n > 0) {
+        block_write(inode, inum, 1);
+        block_write(fs->bitmap, 1, 1);
+    } else {
+        orphan_remove(inum);
+        clear_inode(inum);
+    }
+    discard_flush();
+}
 
-    if (inum > 0) return -EEXIST;
-    if (parent_inum < 0 ) return parent_inum;
-    
-    struct fs_inode *parent_inode = malloc(sizeof(*parent_inode));
-    block_read(parent_inode, parent_inum, 1);
-    if (!S_ISDIR(parent_inode->mode)) {
-        free(parent_inode);
-        return -ENOTDIR;
+void *reaper(void *arg) {
+    fs_enter(arg);
+    block_io_class(IO_MAINT);
+    fs_lock();
+    groups_check();             // after an unclean unmount
+    while (!fs->stop) {
+        if (fs->super.n_orphans == 0) {
+            pthread_cond_wait(&fs->reap_cond, &fs->mutex);
+            continue;
+        }
+        reap_batch(fs->super.orphans[fs->super.n_orphans - 1]);
+        // let waiting requests in between batches
+        fs_unlock();
+        sched_yield();
+        fs_lock();
     }
+    fs_unlock();
+    return NULL;
+}
 
-    // find a free entry on parent dir
-    // find a free blk to store dir inode
-    struct fs_dirent parent_entries[DIRECTORY_ENTS_PER_BLK];
-    block_read(parent_entries, parent_inode->ptrs[0], 1);
-    int free_block = get_free_blk();
-    int free_dirent = get_free_dirent(parent_entries);
-    if (free_block < 0 || free_dirent < 0) {
-        free(parent_inode);
-        return -ENOSPC;
+/* defrag - files written a block at a time over a long period end up
+ * scattered over the disk. defrag_file copies a file into a single
+ * free run and switches the inode over to it; the background pass
+ * (hwfuse -defrag <blocks/sec>) walks the whole tree every
+ * DEFRAG_INTERVAL seconds, and FS_IOC_DEFRAG does one file on demand.
+ * Copying is done DEFRAG_CHUNK blocks at a time, dropping the mutex and
+ * sleeping between chunks to stay under defrag_rate.
+ */
+#define DEFRAG_CHUNK 32
+#define DEFRAG_INTERVAL 60
+
+int has_shared_blks(struct fs_inode *inode) {
+    for (int i = 0; i < PTRS_PER_INODE; i++) {
+        if (inode->ptrs[i] != 0 && is_shared(FS_PTR_BLK(inode->ptrs[i]))) {
+            return 1;
+        }
     }
-    bit_set(bitmap, free_block);
-    block_write(bitmap, 1, 1);
+    return 0;
+}
 
-    // create dir inode
-    if (create_inode(mode, free_block) != 0) {         
-        free(parent_inode);
-        return -ENOSPC;
+int count_fragments(struct fs_inode *inode) {
+    int n = 0;
+    uint32_t prev = 0;
+    for (int i = 0; i < PTRS_PER_INODE; i++) {
+        if (inode->ptrs[i] == 0) continue;
+        if (prev == 0 || FS_PTR_BLK(inode->ptrs[i]) != FS_PTR_BLK(prev) + 1) {
+            n++;
+        }
+        prev = inode->ptrs[i];
     }
+    return n;
+}
 
-    // push new inode onto parent dir's entry
-    parent_entries[free_dirent].valid = 1;
-    strcpy(parent_entries[free_dirent].name, name);
-    parent_entries[free_dirent].inode = free_block;
-    block_write(parent_entries, parent_inode->ptrs[0], 1);
+/* defrag_throttle - let other operations in, and wait long enough to
+ * stay under defrag_rate; unmount cuts the wait short
+ */
+void defrag_throttle(int nblks) {
+    if (fs->opts.defrag_rate <= 0) {
+        fs_unlock();
+        fs_lock();
+        return;
+    }
+    long long ns = (long long)nblks * 1000000000 / fs->opts.defrag_rate;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    csum_flush();               // as fs_unlock would
+    while (!fs->stop &&
+           pthread_cond_timedwait(&fs->defrag_cond, &fs->mutex, &ts) != ETIMEDOUT)
+        ;
+}
 
-    // find another free block to store empty dir entries
-    int dirent_free_block = get_free_blk();
-    if (dirent_free_block < 0) {
-        free(parent_inode);
-        return -ENOSPC;
+/* defrag_file - move the blocks of file or directory 'inum' into one
+ * contiguous run (directories: right after the inode). Called with
+ * the mutex held, but drops it between chunks; if the inode or any of
+ * its blocks is written meanwhile (an in-place write, a new directory
+ * entry) the copy is abandoned, as it is at unmount. The switch itself
+ * is one inode write, after the bitmap claiming the new blocks is on
+ * disk.
+ * Returns 1 if the file was moved, 0 if it was fine already, <0 on error
+ */
+int defrag_file(int inum) {
+    struct fs_inode _inode, *inode = &_inode;
+    struct fs_inode _old, *old = &_old;
+    block_read(inode, inum, 1);
+    int n = count_blks(inode);
+    int isdir = S_ISDIR(inode->mode);
+    // moving a shared block would unshare it, so those files stay put
+    if (!bit_test(fs->bitmap, inum) || (!isdir && !S_ISREG(inode->mode)) || n == 0 ||
+        is_shared(inum) || has_shared_blks(inode) ||
+        (count_fragments(inode) <= 1 &&
+         (!isdir || FS_PTR_BLK(inode->ptrs[0]) == inum + 1))) {
+        return 0;
     }
-    bit_set(bitmap, dirent_free_block);
-    block_write(bitmap, 1, 1);
 
-    struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
-    create_empty_entries(entries);
-    block_write(entries, dirent_free_block, 1);
+    resv_drop(inum);
+    int got;
+    int start = find_free_run(inum + 1, n, &got);
+    if (start < 0 || got < n || (isdir && start != inum + 1)) {
+        return start < 0 || got < n ? -ENOSPC : 0;
+    }
+    for (int k = 0; k < n; k++) {
+        use_blk(start + k);
+    }
 
-    // dir inode -> empty dir entries
-    struct fs_inode *inode = malloc(sizeof(*parent_inode));
-    block_read(inode, free_block, 1);
-    inode->ptrs[0] = dirent_free_block;
-    block_write(inode, free_block, 1);
+    struct defrag_watch *w = calloc(1, sizeof(*w));
+    bit_set(w->map, inum);
+    for (int j = 0; j < PTRS_PER_INODE; j++) {
+        if (inode->ptrs[j] != 0) bit_set(w->map, FS_PTR_BLK(inode->ptrs[j]));
+    }
+    w->next = fs->defrags;
+    fs->defrags = w;
+
+    char *buf = malloc(DEFRAG_CHUNK * FS_BLOCK_SIZE);
+    int i = 0, k = 0, rv = 1;
+    while (k < n) {
+        int cnt = 0;
+        for (; cnt < DEFRAG_CHUNK && k + cnt < n; i++) {
+            if (inode->ptrs[i] == 0) continue;
+            if (inode->ptrs[i] & FS_PTR_UNWRITTEN) {
+                memset(buf + cnt * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            } else {
+                block_read(buf + cnt * FS_BLOCK_SIZE, FS_PTR_BLK(inode->ptrs[i]), 1);
+            }
+            cnt++;
+        }
+        block_write(buf, start + k, cnt);
+        k += cnt;
 
-    free(inode);
-    return 0;
+        defrag_throttle(cnt);
+        if (w->changed || fs->stop) {
+            rv = -EAGAIN;       // changed under us - try again next time
+            break;
+        }
+    }
+    struct defrag_watch **pp = &fs->defrags;
+    while (*pp != w) pp = &(*pp)->next;
+    *pp = w->next;
+    free(w);
+
+    if (rv < 0) {
+        for (k = 0; k < n; k++) {
+            free_blk(start + k);
+        }
+        block_write(fs->bitmap, 1, 1);  // others may have written it with them in use
+    } else {
+        block_write(fs->bitmap, 1, 1);
+        memcpy(old, inode, sizeof(*inode));
+        for (i = 0, k = 0; i < PTRS_PER_INODE; i++) {
+            if (inode->ptrs[i] != 0) {
+                inode->ptrs[i] = (start + k++) | (inode->ptrs[i] & FS_PTR_FLAGS);
+            }
+        }
+        block_write(inode, inum, 1);
+        clear_blks(old);
+        block_write(fs->bitmap, 1, 1);
+    }
+    discard_flush();
+
+    free(buf);
+    return rv;
 }
 
-int clear_blks(struct fs_inode *inode) {
-    int xblks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-    for (int i = 0; i < xblks; i++) {
-        int dblk = inode->ptrs[i];
-        bit_clear(bitmap, dblk);  
+/* defrag_tree - defragment directory 'inum' and everything below it.
+ * Each entry is looked up again before it's used, since the lock is
+ * dropped while files are being copied.
+ */
+void defrag_tree(int inum) {
+    struct fs_inode _inode, *inode = &_inode;
+    struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
+    defrag_file(inum);
+    for (int j = 0; j < DIRECTORY_ENTS_PER_BLK && !fs->stop; j++) {
+        block_read(inode, inum, 1);
+        // entries in a block shared with a snapshot belong to it too
+        if (!S_ISDIR(inode->mode) || is_shared(inode->ptrs[0])) break;
+        block_read(entries, inode->ptrs[0], 1);
+        if (!entries[j].valid || is_shared(entries[j].inode)) continue;
+        int child = entries[j].inode;
+        block_read(inode, child, 1);
+        if (S_ISDIR(inode->mode)) {
+            defrag_tree(child);
+        } else {
+            defrag_file(child);
+        }
     }
-    return 0;
 }
-int clear_inode(int inum) {
-    struct fs_inode *inode = malloc(sizeof(*inode));
-    block_read(inode, inum, 1);
-    memset(inode, 0, sizeof(struct fs_inode));
-    bit_clear(bitmap, inum);
-    block_write(bitmap, 1, 1);
-    free(inode);
-    return 0;
+
+void *defragger(void *arg) {
+    struct timespec ts;
+    fs_enter(arg);
+    block_io_class(IO_MAINT);
+    fs_lock();
+    while (!fs->stop) {
+        defrag_tree(2);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += DEFRAG_INTERVAL;
+        pthread_cond_timedwait(&fs->defrag_cond, &fs->mutex, &ts);
+    }
+    fs_unlock();
+    return NULL;
 }
+
 /* unlink - delete a file
  *  success - return 0
  *  errors - path resolution, ENOENT, EISDIR
  */
 int fs_unlink(const char *path)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
     int parent_inum = translate(pathc-1, pathv);
+    int inum = translate(pathc, pathv);
     char name[MAX_NAME_LEN];
     strcpy(name, pathv[pathc-1]);
-    free(_path);
+    if (parent_inum < 0) return parent_inum;
     if (inum < 0) return inum;
+    if (inum == SNAP_DIR_INUM) return -EISDIR;
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
     if (S_ISDIR(inode->mode)) return -EISDIR;
 
+    // copy the parent out of any snapshot; the entry still names inum
+    if ((parent_inum = translate_w(pathc-1, pathv)) < 0) return parent_inum;
+
     // remove entry from parent dir
-    struct fs_inode *parent_inode = malloc(sizeof(*inode));
+    struct fs_inode _parent_inode, *parent_inode = &_parent_inode;
     block_read(parent_inode, parent_inum, 1);
     struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
     block_read(entries, parent_inode->ptrs[0], 1);
@@ -498,11 +2448,17 @@ int fs_unlink(const char *path)
     }
     block_write(entries, parent_inode->ptrs[0], 1);
     
-    clear_blks(inode);
-    clear_inode(inum);
+    resv_drop(inum);
+    if (is_shared(inum)) {
+        // the inode is still in a snapshot - just drop this reference
+        put_blk(inum);
+        ref_flush();
+    } else if (count_blks(inode) < REAP_THRESHOLD || orphan_add(inum) != 0) {
+        clear_blks(inode);
+        clear_inode(inum);
+        discard_flush();
+    }
 
-    free(inode);
-    free(parent_inode);
     return 0;
 }
 /* 1 is empty, 0 is not empty
@@ -525,24 +2481,28 @@ int fs_rmdir(const char *path)
 
     if (strcmp(path, "/") == 0) return -ENOTDIR;
 
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
+    // rmdir /.snapshots/<name> deletes the snapshot
+    if (pathc == 2 && is_snap_path(pathc, pathv)) {
+        int rv = snap_delete(pathv[1]);
+        return rv;
+    }
     int parent_inum = translate(pathc-1, pathv);
+    int inum = translate(pathc, pathv);
     char name[MAX_NAME_LEN];
     strcpy(name, pathv[pathc-1]);
-    free(_path);
     
-    if (inum < 0) return inum;
     if (parent_inum < 0) return parent_inum;
-    struct fs_inode *inode = malloc(sizeof(*inode));
-    struct fs_inode *parent_inode = malloc(sizeof(*parent_inode));
+    if (inum < 0) return inum;
+    if (inum == SNAP_DIR_INUM) return -EROFS;
+    struct fs_inode _inode, *inode = &_inode;
+    struct fs_inode _parent_inode, *parent_inode = &_parent_inode;
     block_read(inode, inum, 1);
     block_read(parent_inode, parent_inum, 1);
     if (!S_ISDIR(inode->mode) || !S_ISDIR(parent_inode->mode)) {
-        free(inode);
-        free(parent_inode);
         return -ENOTDIR;
     }
 
@@ -550,11 +2510,13 @@ int fs_rmdir(const char *path)
     struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
     block_read(entries, inode->ptrs[0], 1);
     if (!is_empty_dir(entries)) {
-        free(inode);
-        free(parent_inode);
         return -ENOTEMPTY;
     }
 
+    // copy the parent out of any snapshot; the entry still names inum
+    if ((parent_inum = translate_w(pathc-1, pathv)) < 0) return parent_inum;
+    block_read(parent_inode, parent_inum, 1);
+
     // remove entry from parent dir
     struct fs_dirent parent_entries[DIRECTORY_ENTS_PER_BLK];
     block_read(parent_entries, parent_inode->ptrs[0], 1);
@@ -565,12 +2527,15 @@ int fs_rmdir(const char *path)
     }
     block_write(parent_entries, parent_inode->ptrs[0], 1);
 
-    // clear blks and inode
-    clear_blks(inode);
-    clear_inode(inum);
+    // clear blks and inode, unless a snapshot still has it
+    if (is_shared(inum)) {
+        put_blk(inum);
+    } else {
+        clear_blks(inode);
+        clear_inode(inum);
+    }
+    discard_flush();
     
-    free(inode);
-    free(parent_inode);
     
     return 0;
 }
@@ -591,17 +2556,22 @@ int fs_rmdir(const char *path)
 int fs_rename(const char *src_path, const char *dst_path)
 {
     // parse path
-    char *_src_path = strdup(src_path);
+    char _src_path[strlen(src_path) + 1];
+    strcpy(_src_path, src_path);
     char *src_pathv[MAX_NAME_LEN];
     int src_pathc = parse(_src_path, src_pathv);
-    char *_dst_path = strdup(dst_path);
+    char _dst_path[strlen(dst_path) + 1];
+    strcpy(_dst_path, dst_path);
     char *dst_pathv[MAX_NAME_LEN];
     int dst_pathc = parse(_dst_path, dst_pathv);
     // translate path
-    int src_inum = translate(src_pathc, src_pathv);
-    int dst_inum = translate(dst_pathc, dst_pathv);
+    if (is_snap_path(src_pathc, src_pathv) || is_snap_path(dst_pathc, dst_pathv)) {
+        return -EROFS;
+    }
     int parent_src_inum = translate(src_pathc-1, src_pathv);
     int parent_dst_inum = translate(dst_pathc-1, dst_pathv);
+    int src_inum = translate(src_pathc, src_pathv);
+    int dst_inum = translate(dst_pathc, dst_pathv);
     // if src does not exist
     if (src_inum < 0) return src_inum;
     if (parent_src_inum < 0) return parent_src_inum;
@@ -614,13 +2584,14 @@ int fs_rename(const char *src_path, const char *dst_path)
     char dst_name[MAX_NAME_LEN];
     strcpy(src_name, src_pathv[src_pathc-1]);
     strcpy(dst_name, dst_pathv[dst_pathc-1]);
-    free(_src_path);
-    free(_dst_path);
     //read parent src inode
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, parent_src_inum, 1);
     if (!S_ISDIR(inode->mode)) return -ENOTDIR;
 
+    // as in fs_create, copy the directory out of any snapshot only now
+    if ((parent_src_inum = translate_w(src_pathc-1, src_pathv)) < 0) return parent_src_inum;
+    block_read(inode, parent_src_inum, 1);
     struct fs_dirent entries[DIRECTORY_ENTS_PER_BLK];
     block_read(entries, inode->ptrs[0], 1);
 
@@ -643,18 +2614,17 @@ int fs_rename(const char *src_path, const char *dst_path)
  */
 int fs_chmod(const char *path, mode_t mode)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
-    free(_path);
+    int inum = translate_w(pathc, pathv);
     if (inum < 0) return inum;
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
     inode->mode = mode;
     block_write(inode, inum, 1);
-    free(inode);
     return 0;
 }
 
@@ -666,66 +2636,164 @@ int fs_chmod(const char *path, mode_t mode)
  */
 int fs_utime(const char *path, struct utimbuf *ut)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
-    free(_path);
+    int inum = translate_w(pathc, pathv);
 
     if (inum < 0) return inum;
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
     inode->mtime = ut->modtime;
     block_write(inode, inum, 1);
-    free(inode);
+
+    return 0;
+}
+
+/* truncate_inode - set the size of file 'inum' to 'len'.
+ * Shrinking frees every block past the new EOF (preallocated ones
+ * included) with a single bitmap write, and zeroes the rest of the
+ * new last block so that growing the file again reads zeros there;
+ * no other data is touched. Growing just moves EOF - the new part of
+ * the file is a hole. A packed file stays packed unless it grows past
+ * its slot; a compressed cluster holding the new EOF is recompressed.
+ */
+int truncate_inode(int inum, struct fs_inode *inode, off_t len)
+{
+    if (len < 0) return -EINVAL;
+    if (len > (off_t)PTRS_PER_INODE * FS_BLOCK_SIZE) return -EFBIG;
+
+    resv_drop(inum);
+    if (inode->tail_blk != 0) {
+        if (len <= inode->tail_len) {
+            return tail_truncate(inum, inode, len);
+        }
+        int rv = tail_unpack(inum, inode);
+        if (rv < 0) return rv;
+    }
+    if (len < inode->size) {
+        int nblks = (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+        int tail = len % FS_BLOCK_SIZE;
+        int freed = 0;
+
+        // a compressed cluster cut in two is rewritten as a whole
+        if (len % CLUSTER_SIZE != 0 && is_compressed(inode, nblks - 1)) {
+            char data[CLUSTER_SIZE];
+            int c = len / CLUSTER_SIZE;
+            int rv = cluster_load(inode, c, data);
+            if (rv < 0) return rv;
+            memset(data + len % CLUSTER_SIZE, 0, CLUSTER_SIZE - len % CLUSTER_SIZE);
+            inode->size = len;
+            rv = cluster_store(inum, inode, c, data, compress_level(inode));
+            if (rv < 0) return rv;
+            nblks = (c + 1) * FS_CLUSTER_BLKS;
+            tail = 0;
+            freed = 1;
+        }
+
+        // zero the tail of a partial last block (a copy, if it's shared)
+        uint32_t ptr = nblks > 0 ? inode->ptrs[nblks-1] : 0;
+        if (tail != 0 && ptr != 0 && !(ptr & FS_PTR_UNWRITTEN)) {
+            char buf[FS_BLOCK_SIZE];
+            block_read(buf, ptr, 1);
+            memset(buf + tail, 0, FS_BLOCK_SIZE - tail);
+            if (is_shared(ptr)) {
+                int blk = alloc_file_blk(inum, inode, nblks - 1);
+                if (blk < 0) return blk;
+                put_blk(ptr);
+                inode->ptrs[nblks-1] = ptr = blk;
+                freed = 1;
+            }
+            block_write(buf, ptr, 1);
+        }
+
+        for (int i = nblks; i < PTRS_PER_INODE; i++) {
+            if (inode->ptrs[i] != 0) {
+                put_blk(FS_PTR_BLK(inode->ptrs[i]));
+                inode->ptrs[i] = 0;
+                freed = 1;
+            }
+        }
+        if (freed) {
+            block_write(fs->bitmap, 1, 1);
+        }
+    }
+    inode->size = len;
+    block_write(inode, inum, 1);
+    discard_flush();
 
     return 0;
 }
 
 /* truncate - truncate file to exactly 'len' bytes
  * success - return 0
- * Errors - path resolution, ENOENT, EISDIR, EINVAL
- *    return EINVAL if len > 0.
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL, EFBIG
+ *    return EINVAL if len < 0.
  */
 int fs_truncate(const char *path, off_t len)
 {
-    /* you can cheat by only implementing this for the case of len==0,
-     * and an error otherwise.
-     */
-    if (len != 0) return -EINVAL;  /* invalid argument */
-
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
-    free(_path);
+    int inum = translate_w(pathc, pathv);
     if (inum < 0) return inum;
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
     if (S_ISDIR(inode->mode)) {
-        free(inode);
         return -EISDIR;
     }
+    int rv = truncate_inode(inum, inode, len);
 
-    // truncate clear 
-    int xblks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
-    char *buf = malloc(FS_BLOCK_SIZE);
-    for (int i = 0; i < xblks; i++) {
-        block_read(buf, inode->ptrs[i], 1);
-        memset(buf, 0, FS_BLOCK_SIZE);
-        block_write(buf, inode->ptrs[i], 1);
-        if (i != 0) {
-            bit_clear(bitmap, inode->ptrs[i]);
-            block_write(bitmap, 1, 1);
-        }
-    }
-    free(buf);
-    free(inode);
+    return rv;
+}
+
+/* ftruncate - truncate an open file; same as truncate.
+ */
+int fs_ftruncate(const char *path, off_t len, struct fuse_file_info *fi)
+{
+    return fs_truncate(path, len);
+}
 
+/* clone_file - make file 'dst' a copy of 'src' that shares all of
+ * src's blocks (a packed tail is copied); a block is only copied when
+ * one of the two files writes to it. Whatever dst held before is
+ * dropped. Costs the refcount table and dst's inode, however big the
+ * file is.
+ */
+int clone_file(int src, int dst)
+{
+    struct fs_inode _s, *s = &_s;
+    struct fs_inode _d, *d = &_d;
+    block_read(s, src, 1);
+    block_read(d, dst, 1);
+    int rv = 0;
+    if (S_ISDIR(s->mode) || S_ISDIR(d->mode)) {
+        rv = -EISDIR;
+    } else if (src == dst) {
+        rv = -EINVAL;
+    } else {
+        rv = truncate_inode(dst, d, 0);
+    }
 
-    return 0;
+    if (rv == 0 && s->tail_blk != 0) {
+        char buf[FS_BLOCK_SIZE];
+        block_read(buf, s->tail_blk, 1);
+        rv = tail_write(dst, d, buf + s->tail_off, s->size, 0);
+    } else if (rv == 0) {
+        rv = ref_inc_ptrs(s);
+        ref_flush();
+        if (rv == 0) {
+            memcpy(d->ptrs, s->ptrs, sizeof(d->ptrs));
+            d->size = s->size;
+            d->mtime = time(NULL);
+            block_write(d, dst, 1);
+        }
+    }
+    return rv < 0 ? rv : 0;
 }
 
 
@@ -736,22 +2804,23 @@ int fs_truncate(const char *path, off_t len)
  *   - on error, return <0
  * Errors - path resolution, ENOENT, EISDIR
  */
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
 int fs_read(const char *path, char *buf, size_t len, off_t offset,
 	    struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
     int inum = translate(pathc, pathv);
-    free(_path);
     if (inum < 0) return inum;
+    if (inum == SNAP_DIR_INUM) return -EISDIR;
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
     if (S_ISDIR(inode->mode)) return -EISDIR;
-    if (offset >= inode->size) return -EINVAL;
+    if (offset >= inode->size) {
+        return 0;
+    }
 
 
     int len_to_read = len;
@@ -760,19 +2829,40 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
     if (offset + len > inode->size) {
         len_to_read = inode->size - offset;
     }
+    if (inode->tail_blk != 0) {
+        char temp[FS_BLOCK_SIZE];
+        int rv = block_read(temp, inode->tail_blk, 1);
+        memcpy(buf, temp + inode->tail_off + offset, len_to_read);
+        return rv < 0 ? rv : len_to_read;
+    }
     // find start blk number and offset
     int idx = offset / FS_BLOCK_SIZE;
     int blk_offset = offset % FS_BLOCK_SIZE;
 
     // read one blk at a time
     char temp[FS_BLOCK_SIZE];
+    char cluster[CLUSTER_SIZE];
+    int cluster_loaded = -1;
     memset(temp, 0, FS_BLOCK_SIZE);
     int cur_read = 0;
     int total_read = 0;
     while (len_to_read > 0) {
-        block_read(temp, inode->ptrs[idx], 1);
+        char *src = temp;
+        // holes and never-written blocks read as zeros
+        if (is_compressed(inode, idx)) {
+            int c = idx / FS_CLUSTER_BLKS;
+            if (c != cluster_loaded && cluster_load(inode, c, cluster) < 0) {
+                return -EIO;
+            }
+            cluster_loaded = c;
+            src = cluster + (idx % FS_CLUSTER_BLKS) * FS_BLOCK_SIZE;
+        } else if (inode->ptrs[idx] == 0 || (inode->ptrs[idx] & FS_PTR_UNWRITTEN)) {
+            memset(temp, 0, FS_BLOCK_SIZE);
+        } else if (block_read(temp, inode->ptrs[idx], 1) < 0) {
+            return -EIO;
+        }
         cur_read = MIN(len_to_read, FS_BLOCK_SIZE - blk_offset);
-        memcpy(buf + total_read, temp + blk_offset, cur_read);
+        memcpy(buf + total_read, src + blk_offset, cur_read);
         total_read += cur_read;
         len_to_read -= cur_read;
         blk_offset = 0;
@@ -785,76 +2875,271 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
 /* write - write data to a file
  * success - return number of bytes written. (this will be the same as
  *           the number requested, or else it's an error)
- * Errors - path resolution, ENOENT, EISDIR
- *  return EINVAL if 'offset' is greater than current file length.
- *  (POSIX semantics support the creation of files with "holes" in them, 
- *   but we don't)
+ * Errors - path resolution, ENOENT, EISDIR, EFBIG, ENOSPC
+ *  writing past the current file length leaves a hole between the old
+ *  EOF and 'offset'; holes have no blocks allocated and read as zeros.
+ *  Files of up to TAIL_MAX bytes are packed into shared tail blocks;
+ *  compressed files go through cluster_write. Blocks shared with other
+ *  files are copied before they are written, and with -dedup a block
+ *  that matches one already on disk is shared instead of written.
  */
 int fs_write(const char *path, const char *buf, size_t len,
 	     off_t offset, struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
     char *pathv[MAX_NAME_LEN];
     int pathc = parse(_path, pathv);
-    int inum = translate(pathc, pathv);
-    free(_path);
+    int inum = translate_w(pathc, pathv);
     if (inum < 0) return inum;
 
-    struct fs_inode *inode = malloc(sizeof(*inode));
+    struct fs_inode _inode, *inode = &_inode;
     block_read(inode, inum, 1);
-    if (S_ISDIR(inode->mode)) return -EISDIR;
-    if (offset > inode->size) return -EINVAL;
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+
+    if (offset + len > (off_t)PTRS_PER_INODE * FS_BLOCK_SIZE) {
+        return -EFBIG;
+    }
+
+    // small files live in a shared tail block until they outgrow it
+    int packed = inode->tail_blk != 0;
+    if (packed || (inode->size == 0 && count_blks(inode) == 0)) {
+        int rv = 0;
+        if (offset + len <= TAIL_MAX) {
+            if (len > 0) {
+                rv = tail_write(inum, inode, buf, len, offset);
+            }
+            return rv;
+        }
+        if (packed && (rv = tail_unpack(inum, inode)) < 0) {
+            return rv;
+        }
+    }
+
+    // compressed files, and compressed clusters, are written a cluster at a time
+    int first = offset / FS_BLOCK_SIZE, last = (offset + len - 1) / FS_BLOCK_SIZE;
+    int zipped = compress_level(inode) > 0;
+    for (int c = first / FS_CLUSTER_BLKS; !zipped && len > 0 && c <= last / FS_CLUSTER_BLKS; c++) {
+        zipped = is_compressed(inode, c * FS_CLUSTER_BLKS);
+    }
+    if (zipped && len > 0) {
+        int rv = cluster_write(inum, inode, buf, len, offset);
+        return rv;
+    }
 
     int len_to_write = len;
-    int file_size = inode->size;
-    int xblks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
     // find start blk number and offset
     int idx = offset / FS_BLOCK_SIZE;
     int blk_offset = offset % FS_BLOCK_SIZE;
     // write one blk at a time
     char temp[FS_BLOCK_SIZE];
-    memset(temp, 0, FS_BLOCK_SIZE);
     int cur_write = 0;
     int total_write = 0;
-    // write within allocated blks
-    while (len_to_write > 0 && idx < xblks) {
-        block_read(temp, inode->ptrs[idx], 1);
+    int inode_dirty = 0, bitmap_dirty = 0;
+    while (len_to_write > 0) {
+        uint32_t ptr = inode->ptrs[idx];
+        int blk = FS_PTR_BLK(ptr);
         cur_write = MIN(len_to_write, FS_BLOCK_SIZE - blk_offset);
+        // partial block - merge with what's there already
+        if (cur_write < FS_BLOCK_SIZE) {
+            // holes and fresh blocks have no valid contents, same as preallocated ones
+            if (ptr == 0 || (ptr & FS_PTR_UNWRITTEN)) {
+                memset(temp, 0, FS_BLOCK_SIZE);
+            } else {
+                block_read(temp, blk, 1);
+            }
+        }
         memcpy(temp + blk_offset, buf + total_write, cur_write);
-        block_write(temp, inode->ptrs[idx], 1);
+
+        int dup = fs->opts.dedup ? dedup_find(temp) : -1;
+        if (dup >= 0 && dup == blk) {
+            // already there
+        } else if (dup >= 0 && ref_get(dup) == 0) {
+            if (ptr != 0) {
+                put_blk(blk);
+                bitmap_dirty = 1;
+            }
+            blk = dup;
+        } else {
+            // shared blocks are never written in place
+            if (ptr == 0 || is_shared(blk)) {
+                int free_block = alloc_file_blk(inum, inode, idx);
+                if (free_block < 0) break;
+                bitmap_dirty = 1;
+                if (ptr != 0) {
+                    put_blk(blk);
+                }
+                blk = free_block;
+            }
+            block_write(temp, blk, 1);
+            if (fs->opts.dedup) {
+                dedup_add(blk, temp);
+            }
+        }
+        if (inode->ptrs[idx] != blk) {
+            inode->ptrs[idx] = blk;
+            inode_dirty = 1;
+        }
         total_write += cur_write;
         len_to_write -= cur_write;
         blk_offset = 0;
         idx += 1;
     }
-    // allocate more blks to write
-    while (len_to_write > 0 && get_free_blk() > 0) {
-        int free_block = get_free_blk();
-        bit_set(bitmap, free_block);
-        block_write(bitmap, 1, 1);
-        inode->ptrs[idx] = free_block;
-
-        cur_write = MIN(len_to_write, FS_BLOCK_SIZE);
-        memcpy(temp + blk_offset, buf + total_write, cur_write);
-        block_write(temp, free_block, 1);
-        total_write += cur_write;
-        len_to_write -= cur_write;
-        
+    if (bitmap_dirty) {
+        block_write(fs->bitmap, 1, 1);
     }
     // update file size
-    if (offset + total_write > inode->size) 
+    if (offset + total_write > inode->size) {
         inode->size = offset + total_write;
+        inode_dirty = 1;
+    }
+    if (inode_dirty) {
         block_write(inode, inum, 1);
+    }
+    discard_flush();
 
+    if (total_write == 0 && len > 0) return -ENOSPC;
     return total_write;
 }
 
+/* fallocate - preallocate space for a file
+ *  mode 0 also extends the file to offset+len; FALLOC_FL_KEEP_SIZE
+ *  leaves the size alone, so the blocks sit past EOF until written.
+ *  Missing blocks are taken as a single contiguous run if there is
+ *  one; they read as zeros until they are written.
+ * success - return 0
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL, EFBIG, ENOSPC
+ *  return EOPNOTSUPP for any other mode (e.g. hole punching)
+ */
+int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                 struct fuse_file_info *fi)
+{
+    if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0) return -EINVAL;
+    if (offset + len > (off_t)PTRS_PER_INODE * FS_BLOCK_SIZE) return -EFBIG;
+
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    char *pathv[MAX_NAME_LEN];
+    int pathc = parse(_path, pathv);
+    int inum = translate_w(pathc, pathv);
+    if (inum < 0) return inum;
+
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum, 1);
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+
+    if (inode->tail_blk != 0) {
+        int rv = tail_unpack(inum, inode);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+
+    // the file's own window is fair game for its preallocation
+    resv_drop(inum);
+
+    int first = offset / FS_BLOCK_SIZE;
+    int last = (offset + len - 1) / FS_BLOCK_SIZE;
+    int rv = 0;
+    int i = first;
+    while (i <= last) {
+        // the empty slots of a compressed cluster aren't holes
+        if (inode->ptrs[i] != 0 || is_compressed(inode, i)) {
+            i++;
+            continue;
+        }
+        // fill the whole gap [i, i+n) with as few runs as possible
+        int n = 0;
+        while (i + n <= last && inode->ptrs[i+n] == 0 && !is_compressed(inode, i+n)) n++;
+        int goal = inum + 1;
+        if (i > 0 && inode->ptrs[i-1] != 0) {
+            goal = FS_PTR_BLK(inode->ptrs[i-1]) + 1;
+        }
+        int got;
+        int start = find_free_run(goal, n, &got);
+        if (start < 0) {
+            resv_drop_all();
+            start = find_free_run(goal, n, &got);
+        }
+        if (start < 0) {
+            rv = -ENOSPC;
+            break;
+        }
+        got = MIN(got, n);
+        for (int k = 0; k < got; k++) {
+            use_blk(start + k);
+            inode->ptrs[i + k] = (start + k) | FS_PTR_UNWRITTEN;
+        }
+        i += got;
+    }
+    block_write(fs->bitmap, 1, 1);
+    if (rv == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->size) {
+        inode->size = offset + len;
+    }
+    block_write(inode, inum, 1);
+
+    return rv;
+}
+
+/* bmap - map a file block to a disk block (0 for a hole, or for data
+ * in a compressed cluster, which has no block of its own)
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL
+ */
+int fs_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+    if (blocksize != FS_BLOCK_SIZE || *idx >= PTRS_PER_INODE) return -EINVAL;
+
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    char *pathv[MAX_NAME_LEN];
+    int pathc = parse(_path, pathv);
+    int inum = translate(pathc, pathv);
+    if (inum < 0) return inum;
+    if (inum == SNAP_DIR_INUM) return -EISDIR;
+
+    struct fs_inode _inode, *inode = &_inode;
+    block_read(inode, inum, 1);
+    int isdir = S_ISDIR(inode->mode);
+    *idx = is_compressed(inode, *idx) ? 0 : FS_PTR_BLK(inode->ptrs[*idx]);
+
+    return isdir ? -EISDIR : 0;
+}
+
+/* fsync - with -writeback, wait until everything written so far (not
+ * just this file) is on disk. Doesn't take the mutex, so other
+ * operations carry on while it waits.
+ */
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return block_flush();
+}
+
+/* release - last close of an open file. Hands back whatever is left of
+ * the file's block reservation.
+ */
+int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    char *pathv[MAX_NAME_LEN];
+    int pathc = parse(_path, pathv);
+    int inum = translate(pathc, pathv);
+    if (inum > 0) {
+        resv_drop(inum);
+    }
+    return 0;
+}
+
 int count_free_blks(void) {
     int cnt = 0;
-    for (int i=0; i < super.disk_size; i++) {
-        if (!bit_test(bitmap, i)) {
-            cnt++;
-        }
+    groups_check();
+    for (int g = 0; g < fs->n_groups; g++) {
+        cnt += fs->group_free[g];
     }
     return cnt;
 }
@@ -877,7 +3162,7 @@ int fs_statfs(const char *path, struct statvfs *st)
     /* your code here */
     memset(st, 0, sizeof(*st));
     st->f_bsize = FS_BLOCK_SIZE;
-    st->f_blocks = (fsblkcnt_t) super.disk_size - 2;
+    st->f_blocks = (fsblkcnt_t) fs->super.disk_size - 2;
     int free_blks_num = count_free_blks();
     st->f_bfree = (fsblkcnt_t) free_blks_num;
     st->f_bavail = st->f_bfree;
@@ -885,23 +3170,253 @@ int fs_statfs(const char *path, struct statvfs *st)
     return 0;
 }
 
+/* ioctl - FITRIM (as issued by fstrim(8) on the mount point) discards
+ * all free blocks in the image. range->len is set to the number of
+ * bytes discarded.
+ * FS_IOC_DEFRAG makes 'path' contiguous, if there is room.
+ * FS_IOC_GETFLAGS/SETFLAGS (lsattr/chattr) get and set FS_COMPR_FL;
+ * setting it only affects data written from then on.
+ * FS_IOC_CLONE_FROM turns 'path' into a clone of arg->src.
+ * FS_IOC_CHECKPOINT starts a new generation and returns its number.
+ * Errors - ENOTTY for any other command, EOPNOTSUPP for other flags
+ */
+int fs_ioctl(const char *path, int cmd, void *arg,
+             struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    if ((unsigned int)cmd == FS_IOC_GETFLAGS || (unsigned int)cmd == FS_IOC_SETFLAGS) {
+        char _path[strlen(path) + 1];
+        strcpy(_path, path);
+        char *pathv[MAX_NAME_LEN];
+        int pathc = parse(_path, pathv);
+        if ((unsigned int)cmd == FS_IOC_SETFLAGS && (*(int*)data & ~FS_COMPR_FL)) {
+            return -EOPNOTSUPP;     // before translate_w copies anything
+        }
+        int inum = (unsigned int)cmd == FS_IOC_GETFLAGS ? translate(pathc, pathv) :
+            translate_w(pathc, pathv);
+        if (inum < 0) return inum;
+        if (inum == SNAP_DIR_INUM) return -ENOTTY;
+        struct fs_inode _inode, *inode = &_inode;
+        block_read(inode, inum, 1);
+        int rv = 0;
+        if ((unsigned int)cmd == FS_IOC_GETFLAGS) {
+            *(int*)data = inode->flags;
+        } else if (inode->flags != *(int*)data) {
+            inode->flags = *(int*)data;
+            block_write(inode, inum, 1);
+        }
+        return rv;
+    }
+    if (cmd == FS_IOC_DEFRAG) {
+        char _path[strlen(path) + 1];
+        strcpy(_path, path);
+        char *pathv[MAX_NAME_LEN];
+        int pathc = parse(_path, pathv);
+        int inum = translate_w(pathc, pathv);
+        if (inum < 0) return inum;
+        int rv = defrag_file(inum);
+        return rv < 0 ? rv : 0;
+    }
+    if ((unsigned int)cmd == FS_IOC_CLONE_FROM) {
+        struct fs_clone_arg *ca = data;
+        ca->src[sizeof(ca->src) - 1] = 0;
+        char _path[strlen(path) + 1];
+        strcpy(_path, path);
+        char *pathv[MAX_NAME_LEN];
+        int pathc = parse(_path, pathv);
+        char *srcv[MAX_NAME_LEN];
+        char _src[sizeof(ca->src)];
+        strcpy(_src, ca->src);
+        int srcc = parse(_src, srcv);
+        int src = translate(srcc, srcv);
+        int inum = translate(pathc, pathv);
+        if (inum < 0) return inum;
+        if (src < 0) return src;
+        if (src == SNAP_DIR_INUM || inum == SNAP_DIR_INUM) return -EISDIR;
+        struct fs_inode _s, *s = &_s, _d, *d = &_d;
+        block_read(s, src, 1);
+        block_read(d, inum, 1);
+        if (S_ISDIR(s->mode) || S_ISDIR(d->mode)) return -EISDIR;
+        if (src == inum) return -EINVAL;
+        // the source is fine: copy the destination out of any snapshot
+        if ((inum = translate_w(pathc, pathv)) < 0) return inum;
+        return clone_file(src, inum);
+    }
+    if ((unsigned int)cmd == FS_IOC_CHECKPOINT) {
+        *(uint32_t*)data = checkpoint();
+        return 0;
+    }
+    if ((unsigned int)cmd == FITRIM) {
+        struct fstrim_range *range = data;
+        int minlen = (range->minlen + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+        range->len = (uint64_t)fs_trim(minlen) * FS_BLOCK_SIZE;
+        return 0;
+    }
+    return -ENOTTY;
+}
+
+/* locked wrappers - run each operation on the FUSE instance, with its
+ * mutex held
+ */
+#define LOCKED(op, params, args)                \
+    static int locked_##op params               \
+    {                                           \
+        fs_enter(fs_default);                   \
+        fs_lock();                              \
+        fuse_opts();                            \
+        int rv = fs_##op args;                  \
+        fs_unlock();                            \
+        return rv;                              \
+    }
+
+LOCKED(getattr, (const char *path, struct stat *sb), (path, sb))
+LOCKED(readdir, (const char *path, void *ptr, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi),
+       (path, ptr, filler, offset, fi))
+LOCKED(rename, (const char *src_path, const char *dst_path),
+       (src_path, dst_path))
+LOCKED(chmod, (const char *path, mode_t mode), (path, mode))
+LOCKED(read, (const char *path, char *buf, size_t len, off_t offset,
+              struct fuse_file_info *fi),
+       (path, buf, len, offset, fi))
+LOCKED(statfs, (const char *path, struct statvfs *st), (path, st))
+LOCKED(create, (const char *path, mode_t mode, struct fuse_file_info *fi),
+       (path, mode, fi))
+LOCKED(mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED(unlink, (const char *path), (path))
+LOCKED(rmdir, (const char *path), (path))
+LOCKED(utime, (const char *path, struct utimbuf *ut), (path, ut))
+LOCKED(truncate, (const char *path, off_t len), (path, len))
+LOCKED(ftruncate, (const char *path, off_t len, struct fuse_file_info *fi),
+       (path, len, fi))
+LOCKED(write, (const char *path, const char *buf, size_t len,
+               off_t offset, struct fuse_file_info *fi),
+       (path, buf, len, offset, fi))
+LOCKED(fallocate, (const char *path, int mode, off_t offset, off_t len,
+                   struct fuse_file_info *fi),
+       (path, mode, offset, len, fi))
+LOCKED(bmap, (const char *path, size_t blocksize, uint64_t *idx),
+       (path, blocksize, idx))
+LOCKED(release, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(ioctl, (const char *path, int cmd, void *arg,
+               struct fuse_file_info *fi, unsigned int flags, void *data),
+       (path, cmd, arg, fi, flags, data))
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    fs_enter(fs_default);
+    return fs_fsync(path, datasync, fi);
+}
+
 /* operations vector. Please don't rename it, or else you'll break things
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,            /* read-mostly operations */
-    .getattr = fs_getattr,
-    .readdir = fs_readdir,
-    .rename = fs_rename,
-    .chmod = fs_chmod,
-    .read = fs_read,
-    .statfs = fs_statfs,
-
-    .create = fs_create,        /* write operations */
-    .mkdir = fs_mkdir,
-    .unlink = fs_unlink,
-    .rmdir = fs_rmdir,
-    .utime = fs_utime,
-    .truncate = fs_truncate,
-    .write = fs_write,
+    .destroy = fs_destroy,
+    .getattr = locked_getattr,
+    .readdir = locked_readdir,
+    .rename = locked_rename,
+    .chmod = locked_chmod,
+    .read = locked_read,
+    .statfs = locked_statfs,
+
+    .create = locked_create,    /* write operations */
+    .mkdir = locked_mkdir,
+    .unlink = locked_unlink,
+    .rmdir = locked_rmdir,
+    .utime = locked_utime,
+    .truncate = locked_truncate,
+    .ftruncate = locked_ftruncate,
+    .write = locked_write,
+    .fallocate = locked_fallocate,
+    .bmap = locked_bmap,
+    .release = locked_release,
+    .fsync = fuse_fsync,
+    .ioctl = locked_ioctl,
 };
 
+
+/* library API (libfs5600.h) - the same operations on an instance
+ * opened by fs5600_open, with its mutex held
+ */
+struct fs5600 *fs5600_open(const char *image, const struct fs5600_opts *opts)
+{
+    struct blkdev *dev = block_open(image);
+    if (dev == NULL) {
+        return NULL;
+    }
+    struct fs5600 *inst = calloc(1, sizeof(*inst));
+    inst->dev = dev;
+    if (opts != NULL) {
+        inst->opts = *opts;
+    }
+    fs_enter(inst);
+    if (block_read(&fs->super, 0, 1) < 0 || fs->super.magic != FS_MAGIC ||
+        FS_SUPER_BLOCK_SIZE(&fs->super) != FS_BLOCK_SIZE ||
+        fs_format_check(&fs->super) < 0) {
+        block_close(dev);
+        free(inst);
+        errno = EINVAL;
+        return NULL;
+    }
+    fs_mount();
+    return inst;
+}
+
+int fs5600_close(struct fs5600 *inst)
+{
+    fs_enter(inst);
+    int rv = fs_unmount();
+    block_close(inst->dev);
+    free(inst);
+    fs = NULL;
+    return rv;
+}
+
+#define API(op, params, call)                   \
+    int fs5600_##op params                      \
+    {                                           \
+        fs_enter(inst);                         \
+        fs_lock();                              \
+        int rv = call;                          \
+        fs_unlock();                            \
+        return rv;                              \
+    }
+
+API(getattr, (struct fs5600 *inst, const char *path, struct stat *sb),
+    fs_getattr(path, sb))
+API(readdir, (struct fs5600 *inst, const char *path, void *ptr,
+              fs5600_filler_t filler),
+    fs_readdir(path, ptr, filler, 0, NULL))
+API(read, (struct fs5600 *inst, const char *path, char *buf, size_t len,
+           off_t offset),
+    fs_read(path, buf, len, offset, NULL))
+API(write, (struct fs5600 *inst, const char *path, const char *buf,
+            size_t len, off_t offset),
+    fs_write(path, buf, len, offset, NULL))
+API(create, (struct fs5600 *inst, const char *path, mode_t mode),
+    fs_create(path, mode, NULL))
+API(mkdir, (struct fs5600 *inst, const char *path, mode_t mode),
+    fs_mkdir(path, mode))
+API(unlink, (struct fs5600 *inst, const char *path), fs_unlink(path))
+API(rmdir, (struct fs5600 *inst, const char *path), fs_rmdir(path))
+API(rename, (struct fs5600 *inst, const char *src_path, const char *dst_path),
+    fs_rename(src_path, dst_path))
+API(chmod, (struct fs5600 *inst, const char *path, mode_t mode),
+    fs_chmod(path, mode))
+API(utime, (struct fs5600 *inst, const char *path, struct utimbuf *ut),
+    fs_utime(path, ut))
+API(truncate, (struct fs5600 *inst, const char *path, off_t len),
+    fs_truncate(path, len))
+API(statfs, (struct fs5600 *inst, struct statvfs *st), fs_statfs("/", st))
+API(fallocate, (struct fs5600 *inst, const char *path, int mode,
+                off_t offset, off_t len),
+    fs_fallocate(path, mode, offset, len, NULL))
+API(release, (struct fs5600 *inst, const char *path), fs_release(path, NULL))
+API(ioctl, (struct fs5600 *inst, const char *path, int cmd, void *data),
+    fs_ioctl(path, cmd, NULL, NULL, 0, data))
+
+int fs5600_fsync(struct fs5600 *inst)
+{
+    fs_enter(inst);
+    return fs_fsync(NULL, 0, NULL);
+}
@@ -13,6 +13,15 @@
 #include "fs5600.h"
 
 extern void block_init(char *file);
+extern int block_read(void *buf, int lba, int nblks);
+extern int fs_format_check(struct fs_super *super);
+extern int fs_discard;
+extern int defrag_rate;
+extern int fs_compress;
+extern int fs_dedup;
+extern int fs_checksum;
+extern int fs_writeback;
+extern int fs_warm;
 
 /* All homework functions are accessed through the operations
  * structure.  
@@ -23,6 +32,13 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   discard;
+    int   defrag_rate;
+    int   compress;
+    int   dedup;
+    int   checksum;
+    int   writeback;
+    int   warm;
 } _data;
 
 /**************/
@@ -31,12 +47,33 @@ struct data {
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
+ *  usage: ./homework -image disk.img [-discard] [-defrag N]
+ *                    [-compress | -compress-fast] [-dedup] [-checksum]
+ *                    [-writeback] [-warm] directory
  *              disk.img  - name of the image file to mount
+ *              -discard  - punch freed blocks out of the image file
+ *              -defrag N - defragment in the background, N blocks/sec
+ *              -compress - compress all files written (zlib level 6);
+ *                          -compress-fast uses level 1
+ *              -dedup    - share blocks with identical contents
+ *              -checksum - keep a checksum of every block, adding a
+ *                          checksum table if the image has none
+ *              -writeback - cache writes and flush them in the
+ *                          background (faster; less safe in a crash)
+ *              -warm     - keep a list of the most-read blocks in
+ *                          disk.img.hot, and read them in at mount
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-discard", offsetof(struct data, discard), 1},
+    {"-defrag %d", offsetof(struct data, defrag_rate), 0},
+    {"-compress", offsetof(struct data, compress), 6},
+    {"-compress-fast", offsetof(struct data, compress), 1},
+    {"-dedup", offsetof(struct data, dedup), 1},
+    {"-checksum", offsetof(struct data, checksum), 1},
+    {"-writeback", offsetof(struct data, writeback), 1},
+    {"-warm", offsetof(struct data, warm), 1},
     FUSE_OPT_END
 };
 
@@ -49,6 +86,29 @@ int main(int argc, char **argv)
 	exit(1);
 
     block_init(_data.image_name);
+    struct fs_super super;
+    if (block_read(&super, 0, 1) < 0 || super.magic != FS_MAGIC) {
+        printf("%s: not a file system image\n", _data.image_name);
+        exit(1);
+    }
+    if (FS_SUPER_BLOCK_SIZE(&super) != FS_BLOCK_SIZE) {
+        printf("%s: block size is %d, this build uses %d (make BLOCK_SIZE=%d)\n",
+               _data.image_name, FS_SUPER_BLOCK_SIZE(&super), FS_BLOCK_SIZE,
+               FS_SUPER_BLOCK_SIZE(&super));
+        exit(1);
+    }
+    if (fs_format_check(&super) < 0) {
+        printf("%s: made before packed tails, with a file too big for this version\n",
+               _data.image_name);
+        exit(1);
+    }
+    fs_discard = _data.discard;
+    defrag_rate = _data.defrag_rate;
+    fs_compress = _data.compress;
+    fs_dedup = _data.dedup;
+    fs_checksum = _data.checksum;
+    fs_writeback = _data.writeback;
+    fs_warm = _data.warm;
 
     return fuse_main(args.argc, args.argv, &fs_ops, NULL);
 }
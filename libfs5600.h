@@ -0,0 +1,73 @@
+/*
+ * file:        libfs5600.h
+ * description: the file system as a library, for programs that work on
+ *              images directly rather than through a FUSE mount
+ *
+ * Each image is opened with fs5600_open and gets its own handle, with
+ * its own caches, allocator and background threads, so one process can
+ * have any number of images open and use them from any number of
+ * threads. The operations are the FUSE ones without the FUSE types:
+ * they take the handle first, return 0 (or a byte count) on success
+ * and a negative errno on failure. Link with libfs5600.a.
+ */
+#ifndef __LIBFS5600_H__
+#define __LIBFS5600_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <utime.h>
+
+struct fs5600;
+
+/* the hwfuse command line options; all 0 is a plain mount
+ */
+struct fs5600_opts {
+    int discard;                /* punch freed blocks out of the image */
+    int defrag_rate;            /* blocks/sec for background defrag, 0 = off */
+    int compress;               /* zlib level for all files, 0 = per file */
+    int dedup;                  /* share blocks with identical contents */
+    int checksum;               /* add a checksum table if there isn't one */
+    int writeback;              /* cache writes, flush in the background */
+    int warm;                   /* save hot blocks, prefetch them at mount */
+};
+
+/* same as fuse_fill_dir_t; return non-zero to stop
+ */
+typedef int (*fs5600_filler_t)(void *ptr, const char *name,
+                               const struct stat *sb, off_t off);
+
+/* fs5600_open - mount an image, or return NULL with errno set (EINVAL
+ * if it isn't a file system image with this build's block size or is
+ * an old one this version can't read, EBUSY if it's already mounted,
+ * here or by another process). opts may be NULL. fs5600_close
+ * unmounts it, as FUSE would, and returns -EIO if data cached by
+ * opts->writeback couldn't be written.
+ */
+struct fs5600 *fs5600_open(const char *image, const struct fs5600_opts *opts);
+int fs5600_close(struct fs5600 *fs);
+
+int fs5600_getattr(struct fs5600 *fs, const char *path, struct stat *sb);
+int fs5600_readdir(struct fs5600 *fs, const char *path, void *ptr,
+                   fs5600_filler_t filler);
+int fs5600_read(struct fs5600 *fs, const char *path, char *buf, size_t len,
+                off_t offset);
+int fs5600_write(struct fs5600 *fs, const char *path, const char *buf,
+                 size_t len, off_t offset);
+int fs5600_create(struct fs5600 *fs, const char *path, mode_t mode);
+int fs5600_mkdir(struct fs5600 *fs, const char *path, mode_t mode);
+int fs5600_unlink(struct fs5600 *fs, const char *path);
+int fs5600_rmdir(struct fs5600 *fs, const char *path);
+int fs5600_rename(struct fs5600 *fs, const char *src_path, const char *dst_path);
+int fs5600_chmod(struct fs5600 *fs, const char *path, mode_t mode);
+int fs5600_utime(struct fs5600 *fs, const char *path, struct utimbuf *ut);
+int fs5600_truncate(struct fs5600 *fs, const char *path, off_t len);
+int fs5600_statfs(struct fs5600 *fs, struct statvfs *st);
+int fs5600_fallocate(struct fs5600 *fs, const char *path, int mode,
+                     off_t offset, off_t len);
+int fs5600_release(struct fs5600 *fs, const char *path);
+int fs5600_ioctl(struct fs5600 *fs, const char *path, int cmd, void *data);
+int fs5600_fsync(struct fs5600 *fs);
+
+#endif
@@ -7,7 +7,7 @@
  * Peter Desnoyers, Fall 2020
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
@@ -18,56 +18,1280 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <aio.h>
+#include <linux/falloc.h>
 
 #include "fs5600.h"		/* only for FS_BLOCK_SIZE */
 
-/*********** DO NOT MODIFY THIS FILE *************/
-
 /* All disk I/O is accessed through these functions
  */
-static int disk_fd;
 
-/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+/* write-back cache and hot block limits - see below */
+#define WB_BUCKETS 4096
+#define WB_DIRTY_BG 1024
+#define WB_DIRTY_MAX 4096
+#define WB_MAX_AGE 5
+
+#define HOT_MAX 8192
+#define HOT_SAVE_INTERVAL 60
+#define HOT_THREADS 2           /* = io_depth[IO_MAINT] */
+#define HOT_RUN 64
+#define HOT_GAP 4
+#define HOT_MAGIC "5600HOT1"
+
+#define TIER_INTERVAL 1         /* seconds between migration passes */
+#define TIER_BATCH 32           /* most blocks moved up per pass */
+#define TIER_MIN_HEAT 2         /* accesses before a block is worth moving up */
+#define TIER_SPARE 16           /* keep 1/TIER_SPARE of the slots free */
+
+struct wb_entry {
+    int lba;
+    unsigned int seq;           /* of the last write, to spot rewrites during a flush */
+    struct wb_entry *next;
+    char data[FS_BLOCK_SIZE];
+};
+
+/* one open image. block_init opens the default one; a process serving
+ * several images opens each with block_open, and each thread works on
+ * the one it last passed to block_use (the default if none).
  */
-int block_read(char *buf, int lba, int nblks)
+struct blkdev {
+    int fd;                     /* = fds[0] */
+    char *file;
+
+    /* members of a striped image (see below); 1 if not striped */
+    int nmembers, stripe_unit;
+    int fds[FS_MAX_MEMBERS];
+
+    /* the fast tier (see below); tier_fd is -1 if there isn't one */
+    int tier_fd;
+    int tier_nslots, tier_base; /* slot s is at block tier_base + s */
+    int tier_nblks;             /* = disk size */
+    uint32_t *tier_map;         /* slot -> block, as on disk */
+    int *tier_slot;             /* block -> slot, -1 if on the slow tier */
+    unsigned char *tier_heat;   /* per block, saturating */
+    unsigned char *tier_pin;    /* per block: metadata, keep it fast */
+    int tier_on, tier_stop;
+    pthread_rwlock_t tier_lock; /* read for I/O, write to move blocks */
+    pthread_t tier_thread;
+    pthread_mutex_t tier_mutex;
+    pthread_cond_t tier_cond;
+
+    /* if set, called before any blocks but the superblock are written
+     * or discarded (buf = NULL); the file system uses it to track
+     * which blocks changed, and to keep their checksums
+     */
+    void (*write_hook)(const char *buf, int lba, int nblks);
+
+    /* if set, called on the data from every block_read; a non-zero
+     * return (i.e. a bad checksum) is returned from block_read
+     */
+    int (*read_hook)(const char *buf, int lba, int nblks);
+
+    /* write-back cache */
+    int wb_on, wb_stop, wb_waiting;
+    struct wb_entry *wb_hash[WB_BUCKETS];
+    int wb_dirty;
+    unsigned int wb_seq;
+    unsigned int wb_gen;        /* bumped when written blocks leave the cache */
+    int wb_error;               /* a failed write, for the next block_flush */
+    int wb_failing;             /* the last pass had a write fail */
+    time_t wb_oldest;
+    pthread_mutex_t wb_mutex;
+    pthread_cond_t wb_kick;     /* to the flusher */
+    pthread_cond_t wb_done;     /* from it */
+    pthread_t wb_thread;
+
+    /* hot blocks */
+    unsigned char *hot_count;   /* per block, saturating */
+    int hot_nblks;
+    uint32_t *hot_list;         /* being prefetched */
+    int hot_n, hot_next;
+    int hot_stop;
+    pthread_t hot_saver, hot_loader[HOT_THREADS];
+    pthread_mutex_t hot_mutex;
+    pthread_cond_t hot_cond;
+};
+
+static struct blkdev *default_dev;
+static __thread struct blkdev *dev;
+
+static void use_default(void)
+{
+    if (dev == NULL)
+        dev = default_dev;
+}
+
+void block_use(struct blkdev *d)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    dev = d;
+}
 
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
-        return -EIO;
-    if (read(disk_fd, buf, len) != len)
+struct blkdev *block_default(void)
+{
+    return default_dev;
+}
+
+void block_set_hooks(void (*write_hook)(const char *buf, int lba, int nblks),
+                     int (*read_hook)(const char *buf, int lba, int nblks))
+{
+    use_default();
+    dev->write_hook = write_hook;
+    dev->read_hook = read_hook;
+}
+
+/* I/O scheduler - every request to the image file is in one of the
+ * IO_* classes (fs5600.h), set per thread with block_io_class(); by
+ * default reads are IO_READ, writes IO_META and discards IO_MAINT.
+ * At most IO_MAX_INFLIGHT requests are at the disk at once, and at
+ * most io_depth[c] of class c. Each class is served in FIFO order.
+ * Between the two foreground classes the earlier deadline (arrival +
+ * io_deadline[c]) goes first, so reads usually win but metadata
+ * writes can't be starved. A background request only starts when no
+ * foreground request could, except that each background class may
+ * always have one request in flight - so it keeps moving - as long as
+ * no foreground request has passed its deadline.
+ */
+#define IO_MAX_INFLIGHT 8
+
+static const int io_depth[IO_NCLASSES] = {8, 4, 4, 2};
+static const long long io_deadline[IO_NCLASSES] = {
+    5000000, 20000000, 0, 0     /* ns; none for background */
+};
+
+struct io_waiter {
+    long long deadline;
+    struct io_waiter *next;
+};
+
+static struct io_waiter *io_queue[IO_NCLASSES];
+static int io_inflight, io_class_inflight[IO_NCLASSES];
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static __thread int io_class = -1;
+
+void block_io_class(int cls)
+{
+    io_class = cls;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* could the request at the head of class c's queue go to the disk?
+ */
+static int io_ready(int c)
+{
+    return io_queue[c] != NULL && io_inflight < IO_MAX_INFLIGHT &&
+        io_class_inflight[c] < io_depth[c];
+}
+
+static int io_may_start(struct io_waiter *w, int c)
+{
+    if (io_queue[c] != w || !io_ready(c))
+        return 0;
+    if (c == IO_READ || c == IO_META) {
+        int other = c == IO_READ ? IO_META : IO_READ;
+        return !io_ready(other) || io_queue[other]->deadline >= w->deadline;
+    }
+    int fg_ready = io_ready(IO_READ) || io_ready(IO_META);
+    if (!fg_ready)
+        return c == IO_WRITEBACK || !io_ready(IO_WRITEBACK);
+    long long now = now_ns();
+    for (int f = IO_READ; f <= IO_META; f++)
+        if (io_queue[f] != NULL && io_queue[f]->deadline < now)
+            return 0;
+    return io_class_inflight[c] == 0;
+}
+
+static void io_begin(int c)
+{
+    struct io_waiter w = {.deadline = now_ns() + io_deadline[c], .next = NULL};
+    pthread_mutex_lock(&io_mutex);
+    struct io_waiter **pp = &io_queue[c];
+    while (*pp != NULL)
+        pp = &(*pp)->next;
+    *pp = &w;
+    while (!io_may_start(&w, c))
+        pthread_cond_wait(&io_cond, &io_mutex);
+    io_queue[c] = w.next;
+    io_inflight++;
+    io_class_inflight[c]++;
+    pthread_cond_broadcast(&io_cond);   /* new head of queue */
+    pthread_mutex_unlock(&io_mutex);
+}
+
+static void io_end(int c)
+{
+    pthread_mutex_lock(&io_mutex);
+    io_inflight--;
+    io_class_inflight[c]--;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+}
+
+/* striping - if the superblock lists members, the image is spread
+ * over that many files, stripe_unit blocks at a time, round-robin:
+ * block b is in stripe b / stripe_unit, which is on member (stripe %
+ * nmembers) in row (stripe / nmembers). Block 0 is the first block of
+ * member 0, so the superblock can be read before the layout is known.
+ * The stripes of a request that land on one member are next to each
+ * other there, so it becomes one contiguous transfer per member, and
+ * those are issued together with lio_listio - which runs requests on
+ * different files in parallel - so a large read or write keeps every
+ * member busy at once.
+ */
+static off_t stripe_off(int lba, int *m)
+{
+    int s = lba / dev->stripe_unit;
+    *m = s % dev->nmembers;
+    return ((off_t)(s / dev->nmembers) * dev->stripe_unit +
+            lba % dev->stripe_unit) * FS_BLOCK_SIZE;
+}
+
+/* the length of the piece of [lba, lba+nblks) that's in lba's stripe */
+static int stripe_len(int lba, int nblks)
+{
+    int n = dev->stripe_unit - lba % dev->stripe_unit;
+    return n < nblks ? n : nblks;
+}
+
+/* copy between a request's buffer and its members' buffers */
+static void stripe_copy(int in, char *buf, int lba, int nblks, struct aiocb *cb, int *slot)
+{
+    int fill[FS_MAX_MEMBERS] = {0};
+    for (int b = lba, m; b < lba + nblks; ) {
+        int n = stripe_len(b, lba + nblks - b);
+        stripe_off(b, &m);
+        char *q = (char *)cb[slot[m]].aio_buf + (size_t)fill[m] * FS_BLOCK_SIZE;
+        if (in)
+            memcpy(q, buf, (size_t)n * FS_BLOCK_SIZE);
+        else
+            memcpy(buf, q, (size_t)n * FS_BLOCK_SIZE);
+        fill[m] += n;
+        buf += (size_t)n * FS_BLOCK_SIZE;
+        b += n;
+    }
+}
+
+static int dev_rw(int write, char *buf, int lba, int nblks)
+{
+    size_t len = (size_t)nblks * FS_BLOCK_SIZE;
+    if (dev->nmembers == 1 || stripe_len(lba, nblks) == nblks) {
+        int m = 0;
+        off_t off = dev->nmembers == 1 ? (off_t)lba * FS_BLOCK_SIZE : stripe_off(lba, &m);
+        ssize_t n = write ? pwrite(dev->fds[m], buf, len, off) :
+            pread(dev->fds[m], buf, len, off);
+        return n == len ? 0 : -EIO;
+    }
+
+    // a buffer for each member, filled from (or copied out to) buf
+    struct aiocb cb[FS_MAX_MEMBERS], *list[FS_MAX_MEMBERS];
+    int count[FS_MAX_MEMBERS] = {0}, slot[FS_MAX_MEMBERS];
+    off_t start[FS_MAX_MEMBERS];
+    for (int b = lba, m; b < lba + nblks; b += stripe_len(b, lba + nblks - b)) {
+        off_t off = stripe_off(b, &m);
+        if (count[m] == 0)
+            start[m] = off;
+        count[m] += stripe_len(b, lba + nblks - b);
+    }
+    int k = 0;
+    for (int m = 0; m < dev->nmembers; m++) {
+        if (count[m] == 0)
+            continue;
+        memset(&cb[k], 0, sizeof(cb[k]));
+        cb[k].aio_fildes = dev->fds[m];
+        cb[k].aio_buf = malloc((size_t)count[m] * FS_BLOCK_SIZE);
+        cb[k].aio_nbytes = (size_t)count[m] * FS_BLOCK_SIZE;
+        cb[k].aio_offset = start[m];
+        cb[k].aio_lio_opcode = write ? LIO_WRITE : LIO_READ;
+        list[k] = &cb[k];
+        slot[m] = k++;
+    }
+    if (write)
+        stripe_copy(1, buf, lba, nblks, cb, slot);
+
+    // if it fails, some may not have been started, or (EINTR) finished
+    int rv = 0;
+    lio_listio(LIO_WAIT, list, k, NULL);
+    for (int i = 0; i < k; i++) {
+        while (aio_error(list[i]) == EINPROGRESS)
+            aio_suspend((const struct aiocb **)&list[i], 1, NULL);
+        if (aio_error(list[i]) != 0 || aio_return(list[i]) != list[i]->aio_nbytes)
+            rv = -EIO;
+    }
+    if (!write && rv == 0)
+        stripe_copy(0, buf, lba, nblks, cb, slot);
+    for (int i = 0; i < k; i++)
+        free((void *)cb[i].aio_buf);
+    return rv;
+}
+
+static int dev_sync(void)
+{
+    int rv = 0;
+    for (int m = 0; m < dev->nmembers; m++)
+        if (fdatasync(dev->fds[m]) < 0)
+            rv = -EIO;
+    if (dev->tier_fd >= 0 && fdatasync(dev->tier_fd) < 0)
+        rv = -EIO;
+    return rv;
+}
+
+/* tiering - if the superblock names a fast image, a block can live
+ * there, in one of its slots, rather than in the image itself (the
+ * slow tier). The fast tier is for file system metadata, which the
+ * file system marks with block_pin(), and for the blocks used most:
+ * every read or write of a block adds to its heat, and once every
+ * TIER_INTERVAL seconds the migration thread moves up pinned blocks
+ * and blocks with a heat of at least TIER_MIN_HEAT, pushing out
+ * blocks less than half as hot when there's no free slot, moves cold
+ * blocks down so that 1/TIER_SPARE of the slots stay free, and halves
+ * every block's heat. A move copies and syncs the data before the map
+ * on disk changes, so after a crash every block is where the map says.
+ * Block 0 is pinned in slot 0 but written to both tiers, so the image
+ * itself always has a superblock saying where its fast tier is.
+ *
+ * I/O holds tier_lock for reading while it looks blocks up and
+ * transfers them; a pass holds it for writing while it moves blocks,
+ * after taking its scheduler slot like any other request.
+ */
+static int tier_slot_of(int lba)
+{
+    return lba < dev->tier_nblks ? dev->tier_slot[lba] : -1;
+}
+
+static int fast_rw(int write, char *buf, int slot, int nblks)
+{
+    size_t len = (size_t)nblks * FS_BLOCK_SIZE;
+    off_t off = (off_t)(dev->tier_base + slot) * FS_BLOCK_SIZE;
+    ssize_t n = write ? pwrite(dev->tier_fd, buf, len, off) :
+        pread(dev->tier_fd, buf, len, off);
+    return n == len ? 0 : -EIO;
+}
+
+/* tier_rw - each run of blocks that are all on the slow tier, or in
+ * consecutive slots, is one transfer
+ */
+static int tier_rw(int write, char *buf, int lba, int nblks)
+{
+    if (dev->tier_fd < 0)
+        return dev_rw(write, buf, lba, nblks);
+    pthread_rwlock_rdlock(&dev->tier_lock);
+    int rv = 0;
+    if (write && lba == 0)
+        rv = dev_rw(1, buf, 0, 1);      // the image's own copy of the superblock
+    for (int i = 0, j; i < nblks && rv == 0; i = j) {
+        int s = tier_slot_of(lba + i);
+        for (j = i + 1; j < nblks; j++) {
+            int t = tier_slot_of(lba + j);
+            if (s < 0 ? t >= 0 : t != s + j - i)
+                break;
+        }
+        char *p = buf + (size_t)i * FS_BLOCK_SIZE;
+        rv = s < 0 ? dev_rw(write, p, lba + i, j - i) : fast_rw(write, p, s, j - i);
+    }
+    pthread_rwlock_unlock(&dev->tier_lock);
+    return rv;
+}
+
+static void tier_note(int lba, int nblks)
+{
+    for (int i = lba; i < lba + nblks && i < dev->tier_nblks; i++) {
+        unsigned char c = __atomic_load_n(&dev->tier_heat[i], __ATOMIC_RELAXED);
+        if (c < 255)
+            __atomic_store_n(&dev->tier_heat[i], c + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* block_pin - block lba holds file system metadata, and belongs on the
+ * fast tier; block_unpin - it has been freed, so it's neither metadata
+ * nor hot any more. No-ops if the image isn't tiered.
+ */
+void block_pin(int lba)
+{
+    use_default();
+    if (dev->tier_fd >= 0 && lba < dev->tier_nblks)
+        __atomic_store_n(&dev->tier_pin[lba], 1, __ATOMIC_RELAXED);
+}
+
+void block_unpin(int lba)
+{
+    use_default();
+    if (dev->tier_fd >= 0 && lba < dev->tier_nblks) {
+        __atomic_store_n(&dev->tier_pin[lba], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&dev->tier_heat[lba], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* pinned blocks outrank any heat */
+static int tier_score(int b)
+{
+    if (__atomic_load_n(&dev->tier_pin[b], __ATOMIC_RELAXED))
+        return 256;
+    return __atomic_load_n(&dev->tier_heat[b], __ATOMIC_RELAXED);
+}
+
+/* write the map, with the current pins, and sync it
+ */
+static int tier_write_map(void)
+{
+    for (int s = 1; s < dev->tier_nslots; s++) {
+        uint32_t b = FS_TIER_BLK(dev->tier_map[s]);
+        if (b != 0)
+            dev->tier_map[s] = b | (tier_score(b) == 256 ? FS_TIER_PINNED : 0);
+    }
+    size_t len = (size_t)dev->tier_nslots * sizeof(uint32_t);
+    if (pwrite(dev->tier_fd, dev->tier_map, len, FS_BLOCK_SIZE) != len ||
+        fdatasync(dev->tier_fd) < 0)
         return -EIO;
     return 0;
 }
 
+struct tier_cand {
+    int score;
+    int n;                      /* block or slot */
+};
+
+static int cmp_score(const void *a, const void *b)
+{
+    return ((struct tier_cand *)a)->score - ((struct tier_cand *)b)->score;
+}
+
+/* tier_move - move the blocks in slots down[0..ndown) (the free ones
+ * stay free) to the slow tier, then blocks up[i] into slots down[i]
+ * for i < nup
+ */
+static void tier_move(struct tier_cand *up, int nup, struct tier_cand *down, int ndown)
+{
+    char buf[FS_BLOCK_SIZE];
+    int rv = 0, n = 0;
+    io_begin(IO_MAINT);
+    pthread_rwlock_wrlock(&dev->tier_lock);
+    for (int i = 0; i < ndown && rv == 0; i++) {
+        int s = down[i].n, b = FS_TIER_BLK(dev->tier_map[s]);
+        if (b != 0 && (rv = fast_rw(0, buf, s, 1)) == 0) {
+            rv = dev_rw(1, buf, b, 1);
+            n++;
+        }
+    }
+    if (n > 0 && rv == 0 && (rv = dev_sync()) == 0) {
+        for (int i = 0; i < ndown; i++) {
+            int s = down[i].n, b = FS_TIER_BLK(dev->tier_map[s]);
+            if (b != 0) {
+                dev->tier_slot[b] = -1;
+                dev->tier_map[s] = 0;
+            }
+        }
+        rv = tier_write_map();
+    }
+    for (int i = 0; i < nup && rv == 0; i++)
+        if ((rv = dev_rw(0, buf, up[i].n, 1)) == 0)
+            rv = fast_rw(1, buf, down[i].n, 1);
+    if (nup > 0 && rv == 0 && (rv = dev_sync()) == 0) {
+        for (int i = 0; i < nup; i++) {
+            dev->tier_map[down[i].n] = up[i].n;
+            dev->tier_slot[up[i].n] = down[i].n;
+        }
+        rv = tier_write_map();
+    }
+    pthread_rwlock_unlock(&dev->tier_lock);
+    io_end(IO_MAINT);
+    if (rv < 0)
+        fprintf(stderr, "moving blocks between tiers failed\n");
+}
+
+static void tier_pass(void)
+{
+    int nblks = dev->tier_nblks, nslots = dev->tier_nslots;
+    struct tier_cand *up = malloc(nblks * sizeof(*up));
+    struct tier_cand *down = malloc(nslots * sizeof(*down));
+    int nup = 0, ndown = 0, nfree = 0;
+    for (int b = 1; b < nblks; b++) {
+        int score = tier_score(b);
+        if (dev->tier_slot[b] < 0 && score >= TIER_MIN_HEAT)
+            up[nup++] = (struct tier_cand){-score, b};  // hottest first
+    }
+    for (int s = 1; s < nslots; s++) {
+        int b = FS_TIER_BLK(dev->tier_map[s]);
+        down[ndown++] = (struct tier_cand){b ? tier_score(b) : -1, s};  // free, then coldest
+        nfree += b == 0;
+    }
+    qsort(up, nup, sizeof(*up), cmp_score);
+    qsort(down, ndown, sizeof(*down), cmp_score);
+
+    // up[i] goes into down[i]'s slot if it's free or much colder, and
+    // after those, cold blocks go down until enough slots are free
+    int n = 0;
+    while (n < nup && n < ndown && n < TIER_BATCH &&
+           (down[n].score < 0 || 2 * down[n].score < -up[n].score))
+        n++;
+    int k = n > nfree ? n : nfree, left = nfree > n ? nfree - n : 0;
+    while (k < ndown && left < nslots / TIER_SPARE && down[k].score == 0 &&
+           k - n < TIER_BATCH) {
+        k++;
+        left++;
+    }
+    if (k > nfree || n > 0)
+        tier_move(up, n, down, k);
+
+    for (int b = 0; b < nblks; b++) {
+        unsigned char c = __atomic_load_n(&dev->tier_heat[b], __ATOMIC_RELAXED);
+        __atomic_store_n(&dev->tier_heat[b], c / 2, __ATOMIC_RELAXED);
+    }
+    free(up);
+    free(down);
+}
+
+static void *tier_thread(void *arg)
+{
+    dev = arg;
+    block_io_class(IO_MAINT);
+    pthread_mutex_lock(&dev->tier_mutex);
+    while (!dev->tier_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += TIER_INTERVAL;
+        if (pthread_cond_timedwait(&dev->tier_cond, &dev->tier_mutex, &ts) == ETIMEDOUT)
+            tier_pass();
+    }
+    pthread_mutex_unlock(&dev->tier_mutex);
+    return NULL;
+}
+
+/* block_tier_start - start moving blocks between the tiers, if there
+ * are two
+ */
+void block_tier_start(void)
+{
+    use_default();
+    if (dev->tier_fd < 0)
+        return;
+    dev->tier_stop = 0;
+    dev->tier_on = 1;
+    pthread_create(&dev->tier_thread, NULL, tier_thread, dev);
+}
+
+/* block_tier_stop - and save the pins
+ */
+void block_tier_stop(void)
+{
+    use_default();
+    if (!dev->tier_on)
+        return;
+    pthread_mutex_lock(&dev->tier_mutex);
+    dev->tier_stop = 1;
+    pthread_cond_signal(&dev->tier_cond);
+    pthread_mutex_unlock(&dev->tier_mutex);
+    pthread_join(dev->tier_thread, NULL);
+    dev->tier_on = 0;
+    tier_write_map();
+}
+
+/* I/O through the scheduler; every request is whole blocks
+ */
+static int io_pread(void *buf, size_t len, off_t start)
+{
+    int c = io_class >= 0 ? io_class : IO_READ;
+    io_begin(c);
+    int rv = tier_rw(0, buf, start / FS_BLOCK_SIZE, len / FS_BLOCK_SIZE);
+    io_end(c);
+    return rv;
+}
+
+static int io_pwrite(const void *buf, size_t len, off_t start)
+{
+    int c = io_class >= 0 ? io_class : IO_META;
+    io_begin(c);
+    int rv = tier_rw(1, (char *)buf, start / FS_BLOCK_SIZE, len / FS_BLOCK_SIZE);
+    io_end(c);
+    return rv;
+}
+
+/* write-back cache - after block_writeback_start() (hwfuse -writeback)
+ * block_write only copies the data into a cache of dirty blocks, and
+ * a flusher thread writes them out sorted by LBA, each run of
+ * neighbouring blocks in one write, with the superblock last. It runs
+ * when WB_DIRTY_BG blocks are dirty, when the oldest has been dirty
+ * for WB_MAX_AGE seconds, and for block_flush() (fsync, unmount); a
+ * writer that finds WB_DIRTY_MAX blocks dirty waits for it. Reads see
+ * the cached data. Since blocks reach the disk in LBA order rather
+ * than the order they were written in, a crash can leave the image
+ * inconsistent - the same trade as an async mount.
+ *
+ * Blocks whose write fails stay dirty, to be tried again by a later
+ * pass, and the error is returned by the next block_flush (so fsync
+ * reports it), as the kernel does for a failed async write. While
+ * writes are failing the cache can't drain, so a writer that finds it
+ * full doesn't wait: blocks not already in it are written through,
+ * and block_write returns the error if that fails too.
+ */
+static struct wb_entry **wb_find(int lba)
+{
+    struct wb_entry **pp = &dev->wb_hash[lba % WB_BUCKETS];
+    while (*pp != NULL && (*pp)->lba != lba)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+static int wb_put(const char *buf, int lba, int nblks)
+{
+    int rv = 0;
+    pthread_mutex_lock(&dev->wb_mutex);
+    while (dev->wb_dirty >= WB_DIRTY_MAX && !dev->wb_failing) {
+        pthread_cond_signal(&dev->wb_kick);
+        pthread_cond_wait(&dev->wb_done, &dev->wb_mutex);
+    }
+    for (int i = 0; i < nblks; i++) {
+        struct wb_entry **pp = wb_find(lba + i), *e = *pp;
+        if (e == NULL && dev->wb_dirty >= WB_DIRTY_MAX) {
+            // not cached, so no older copy of it is on its way out
+            if (io_pwrite(buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE,
+                          (off_t)(lba + i) * FS_BLOCK_SIZE) < 0)
+                rv = -EIO;
+            continue;
+        }
+        if (e == NULL) {
+            e = *pp = malloc(sizeof(*e));
+            e->lba = lba + i;
+            e->next = NULL;
+            if (dev->wb_dirty++ == 0)
+                dev->wb_oldest = time(NULL);
+        }
+        memcpy(e->data, buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        e->seq = ++dev->wb_seq;
+    }
+    if (dev->wb_dirty >= WB_DIRTY_BG)
+        pthread_cond_signal(&dev->wb_kick);
+    pthread_mutex_unlock(&dev->wb_mutex);
+    return rv;
+}
+
+static void wb_drop(int lba, int nblks)
+{
+    pthread_mutex_lock(&dev->wb_mutex);
+    for (int i = 0; i < nblks; i++) {
+        struct wb_entry **pp = wb_find(lba + i), *e = *pp;
+        if (e != NULL) {
+            *pp = e->next;
+            free(e);
+            dev->wb_dirty--;
+        }
+    }
+    pthread_mutex_unlock(&dev->wb_mutex);
+}
+
+static int cmp_lba(const void *a, const void *b)
+{
+    int x = (*(struct wb_entry **)a)->lba, y = (*(struct wb_entry **)b)->lba;
+    if (x == 0 || y == 0)       /* superblock last */
+        return (x == 0) - (y == 0);
+    return x - y;
+}
+
+/* wb_pass - write out everything dirty; called with wb_mutex held,
+ * which is dropped during the I/O
+ */
+static void wb_pass(void)
+{
+    int n = dev->wb_dirty;
+    if (n == 0)
+        return;
+    struct wb_entry **list = malloc(n * sizeof(*list));
+    int k = 0;
+    for (int b = 0; b < WB_BUCKETS; b++)
+        for (struct wb_entry *e = dev->wb_hash[b]; e != NULL; e = e->next)
+            list[k++] = e;
+    qsort(list, n, sizeof(*list), cmp_lba);
+    char *buf = malloc((size_t)n * FS_BLOCK_SIZE);
+    int *lba = malloc(n * sizeof(int));
+    unsigned int *seq = malloc(n * sizeof(unsigned int));
+    for (int i = 0; i < n; i++) {
+        memcpy(buf + (size_t)i * FS_BLOCK_SIZE, list[i]->data, FS_BLOCK_SIZE);
+        lba[i] = list[i]->lba;
+        seq[i] = list[i]->seq;
+    }
+    pthread_mutex_unlock(&dev->wb_mutex);
+
+    int err = 0;
+    for (int i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && lba[j] == lba[j-1] + 1; j++)
+            ;
+        if (io_pwrite(buf + (size_t)i * FS_BLOCK_SIZE, (size_t)(j - i) * FS_BLOCK_SIZE,
+                      (off_t)lba[i] * FS_BLOCK_SIZE) < 0) {
+            err = -EIO;
+            for (int k = i; k < j; k++)
+                seq[k] = 0;     // no entry has seq 0, so these stay
+        }
+    }
+
+    pthread_mutex_lock(&dev->wb_mutex);
+    for (int i = 0; i < n; i++) {
+        struct wb_entry **pp = wb_find(lba[i]), *e = *pp;
+        if (e != NULL && e->seq == seq[i]) {
+            *pp = e->next;
+            free(e);
+            dev->wb_dirty--;
+        }
+    }
+    dev->wb_gen++;
+    if (err < 0)
+        dev->wb_error = err;
+    dev->wb_failing = err < 0;
+    dev->wb_oldest = time(NULL);
+    pthread_cond_broadcast(&dev->wb_done);
+    free(list);
+    free(buf);
+    free(lba);
+    free(seq);
+}
+
+static void *wb_flusher(void *arg)
+{
+    dev = arg;
+    block_io_class(IO_WRITEBACK);
+    pthread_mutex_lock(&dev->wb_mutex);
+    while (!dev->wb_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&dev->wb_kick, &dev->wb_mutex, &ts);
+        // (while writes are failing, only as blocks age or for block_flush)
+        if ((dev->wb_dirty >= WB_DIRTY_BG && !dev->wb_failing) || dev->wb_waiting > 0 ||
+            (dev->wb_dirty > 0 && time(NULL) - dev->wb_oldest >= WB_MAX_AGE))
+            wb_pass();
+    }
+    wb_pass();
+    pthread_mutex_unlock(&dev->wb_mutex);
+    return NULL;
+}
+
+void block_writeback_start(void)
+{
+    use_default();
+    dev->wb_stop = 0;
+    dev->wb_on = 1;
+    pthread_create(&dev->wb_thread, NULL, wb_flusher, dev);
+}
+
+/* block_flush - returns once everything written so far is on disk, or
+ * -EIO if some of it couldn't be written since the last block_flush
+ */
+int block_flush(void)
+{
+    use_default();
+    int rv = 0;
+    if (dev->wb_on) {
+        pthread_mutex_lock(&dev->wb_mutex);
+        dev->wb_waiting++;
+        while (dev->wb_dirty > 0 && dev->wb_error == 0) {
+            pthread_cond_signal(&dev->wb_kick);
+            pthread_cond_wait(&dev->wb_done, &dev->wb_mutex);
+        }
+        dev->wb_waiting--;
+        rv = dev->wb_error;
+        dev->wb_error = 0;
+        pthread_mutex_unlock(&dev->wb_mutex);
+    }
+    int rv2 = dev_sync();
+    return rv < 0 ? rv : rv2;
+}
+
+/* block_writeback_stop - flush the cache and stop the flusher; -EIO
+ * if some blocks couldn't be written and were thrown away
+ */
+int block_writeback_stop(void)
+{
+    use_default();
+    if (!dev->wb_on)
+        return 0;
+    pthread_mutex_lock(&dev->wb_mutex);
+    dev->wb_stop = 1;
+    pthread_cond_signal(&dev->wb_kick);
+    pthread_mutex_unlock(&dev->wb_mutex);
+    pthread_join(dev->wb_thread, NULL);
+    dev->wb_on = 0;
+    dev_sync();
+    // anything left couldn't be written
+    int rv = dev->wb_dirty > 0 || dev->wb_error < 0 ? -EIO : 0;
+    for (int b = 0; b < WB_BUCKETS; b++) {
+        while (dev->wb_hash[b] != NULL) {
+            struct wb_entry *e = dev->wb_hash[b];
+            dev->wb_hash[b] = e->next;
+            free(e);
+        }
+    }
+    dev->wb_dirty = 0;
+    dev->wb_error = 0;
+    dev->wb_failing = 0;
+    return rv;
+}
+
+/* hot blocks - after block_hot_start() (hwfuse -warm) every block
+ * read is counted, and every HOT_SAVE_INTERVAL seconds and at
+ * block_hot_stop() the HOT_MAX most-read blocks are saved, in LBA
+ * order, to a sidecar file next to the image ("disk.img.hot"). The
+ * counts are halved at each save, so the list follows the working set.
+ * At the next start the blocks in the list are read back in, so the
+ * host's page cache has them before the file system asks: HOT_THREADS
+ * threads take runs of up to HOT_RUN blocks (neighbours up to HOT_GAP
+ * apart are merged into one read) in LBA order. They run as IO_MAINT,
+ * so requests that arrive meanwhile are served first.
+ *
+ * Sidecar format: HOT_MAGIC, a uint32_t count, then that many uint32_t
+ * block numbers in increasing order.
+ */
+static void hot_note(int lba, int nblks)
+{
+    for (int i = lba; i < lba + nblks && i < dev->hot_nblks; i++) {
+        unsigned char c = __atomic_load_n(&dev->hot_count[i], __ATOMIC_RELAXED);
+        if (c < 255)
+            __atomic_store_n(&dev->hot_count[i], c + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static char *hot_file(void)
+{
+    char *name = malloc(strlen(dev->file) + 5);
+    sprintf(name, "%s.hot", dev->file);
+    return name;
+}
+
+/* write the list to a temporary file and rename it over the old one,
+ * so a crash leaves one list or the other
+ */
+static void hot_save(void)
+{
+    int hist[256] = {0}, n = 0, min;
+    for (int i = 0; i < dev->hot_nblks; i++)
+        hist[__atomic_load_n(&dev->hot_count[i], __ATOMIC_RELAXED)]++;
+    for (min = 255; min > 0 && n + hist[min] <= HOT_MAX; min--)
+        n += hist[min];
+    min++;                      /* blocks read at least 'min' times */
+
+    uint32_t *list = malloc(HOT_MAX * sizeof(uint32_t));
+    n = 0;
+    for (int i = 0; i < dev->hot_nblks; i++) {
+        unsigned char c = __atomic_load_n(&dev->hot_count[i], __ATOMIC_RELAXED);
+        if (c >= min && n < HOT_MAX)
+            list[n++] = i;
+        __atomic_store_n(&dev->hot_count[i], c / 2, __ATOMIC_RELAXED);
+    }
+
+    char *name = hot_file(), *tmp = malloc(strlen(name) + 5);
+    sprintf(tmp, "%s.tmp", name);
+    FILE *fp = fopen(tmp, "w");
+    uint32_t count = n;
+    if (fp != NULL && fwrite(HOT_MAGIC, 8, 1, fp) == 1 &&
+        fwrite(&count, sizeof(count), 1, fp) == 1 &&
+        fwrite(list, sizeof(uint32_t), n, fp) == n && fclose(fp) == 0)
+        rename(tmp, name);
+    else {
+        if (fp != NULL)
+            fclose(fp);
+        unlink(tmp);
+    }
+    free(list);
+    free(name);
+    free(tmp);
+}
+
+static void *hot_saver_thread(void *arg)
+{
+    dev = arg;
+    pthread_mutex_lock(&dev->hot_mutex);
+    while (!dev->hot_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += HOT_SAVE_INTERVAL;
+        if (pthread_cond_timedwait(&dev->hot_cond, &dev->hot_mutex, &ts) == ETIMEDOUT)
+            hot_save();
+    }
+    pthread_mutex_unlock(&dev->hot_mutex);
+    return NULL;
+}
+
+static void *hot_loader_thread(void *arg)
+{
+    dev = arg;
+    char *buf = malloc(HOT_RUN * FS_BLOCK_SIZE);
+    block_io_class(IO_MAINT);
+    for (;;) {
+        // take the next run: a block and its close neighbours
+        pthread_mutex_lock(&dev->hot_mutex);
+        int i = dev->hot_next, j = i + 1;
+        if (dev->hot_stop)
+            i = dev->hot_n;
+        while (j < dev->hot_n && dev->hot_list[j] - dev->hot_list[j-1] <= HOT_GAP &&
+               dev->hot_list[j] - dev->hot_list[i] < HOT_RUN)
+            j++;
+        dev->hot_next = j;
+        pthread_mutex_unlock(&dev->hot_mutex);
+        if (i >= dev->hot_n)
+            break;
+        int n = dev->hot_list[j-1] - dev->hot_list[i] + 1;
+        io_pread(buf, (size_t)n * FS_BLOCK_SIZE, (off_t)dev->hot_list[i] * FS_BLOCK_SIZE);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* block_hot_start - prefetch the saved list, if any, in the background
+ * and start counting
+ */
+void block_hot_start(void)
+{
+    use_default();
+    struct stat sb;
+    dev->hot_nblks = 0;
+    for (int m = 0; m < dev->nmembers; m++) {
+        fstat(dev->fds[m], &sb);
+        dev->hot_nblks += sb.st_size / FS_BLOCK_SIZE;
+    }
+    dev->hot_count = calloc(dev->hot_nblks, 1);
+    dev->hot_stop = 0;
+
+    char *name = hot_file(), magic[8];
+    FILE *fp = fopen(name, "r");
+    uint32_t count;
+    dev->hot_n = dev->hot_next = 0;
+    if (fp != NULL && fread(magic, 8, 1, fp) == 1 && memcmp(magic, HOT_MAGIC, 8) == 0 &&
+        fread(&count, sizeof(count), 1, fp) == 1 && count <= HOT_MAX) {
+        dev->hot_list = malloc(count * sizeof(uint32_t));
+        dev->hot_n = fread(dev->hot_list, sizeof(uint32_t), count, fp);
+        // drop anything out of order or past the end (a different image?)
+        while (dev->hot_n > 0 && dev->hot_list[dev->hot_n-1] >= dev->hot_nblks)
+            dev->hot_n--;
+        for (int i = 1; i < dev->hot_n; i++)
+            if (dev->hot_list[i] <= dev->hot_list[i-1])
+                dev->hot_n = 0;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    free(name);
+
+    for (int i = 0; i < HOT_THREADS; i++)
+        pthread_create(&dev->hot_loader[i], NULL, hot_loader_thread, dev);
+    pthread_create(&dev->hot_saver, NULL, hot_saver_thread, dev);
+}
+
+void block_hot_stop(void)
+{
+    use_default();
+    if (dev->hot_count == NULL)
+        return;
+    pthread_mutex_lock(&dev->hot_mutex);
+    dev->hot_stop = 1;
+    pthread_cond_signal(&dev->hot_cond);
+    pthread_mutex_unlock(&dev->hot_mutex);
+    pthread_join(dev->hot_saver, NULL);
+    for (int i = 0; i < HOT_THREADS; i++)
+        pthread_join(dev->hot_loader[i], NULL);
+    hot_save();
+    free(dev->hot_list);
+    dev->hot_list = NULL;
+    free(dev->hot_count);
+    dev->hot_count = NULL;
+}
+
+/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_read(char *buf, int lba, int nblks)
+{
+    use_default();
+    // with write-back on, the cache is looked up after the read. If the
+    // flusher took written blocks out of it meanwhile (wb_gen changed)
+    // the read may have missed one on its way to the disk, so go again
+    int rv;
+    for (;;) {
+        unsigned int gen = 0;
+        if (dev->wb_on) {
+            pthread_mutex_lock(&dev->wb_mutex);
+            gen = dev->wb_gen;
+            pthread_mutex_unlock(&dev->wb_mutex);
+        }
+        rv = io_pread(buf, (size_t)nblks * FS_BLOCK_SIZE, (off_t)lba * FS_BLOCK_SIZE);
+        if (!dev->wb_on)
+            break;
+        pthread_mutex_lock(&dev->wb_mutex);
+        int ok = dev->wb_gen == gen;
+        for (int i = 0; i < nblks && ok; i++) {
+            struct wb_entry *e = *wb_find(lba + i);
+            if (e != NULL)
+                memcpy(buf + i * FS_BLOCK_SIZE, e->data, FS_BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&dev->wb_mutex);
+        if (ok)
+            break;
+    }
+    if (dev->hot_count != NULL)
+        hot_note(lba, nblks);
+    if (dev->tier_fd >= 0)
+        tier_note(lba, nblks);
+    if (rv == 0 && dev->read_hook)
+        return dev->read_hook(buf, lba, nblks);
+    return rv;
+}
+
+static int do_write(char *buf, int lba, int nblks)
+{
+    return io_pwrite(buf, (size_t)nblks * FS_BLOCK_SIZE, (off_t)lba * FS_BLOCK_SIZE);
+}
+
 /* write blocks from disk image. Returns -EIO if error, 0 otherwise
  */
 int block_write(char *buf, int lba, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
-
     assert(lba > 0);		/* write to 0 is *always* an error */
-    
-    /* Seek to the *end* of the region being written, to make sure it
-     * all fits on the disk image. Then seek to write location.
-     */
-    if (lseek(disk_fd, start + len, SEEK_SET) < 0)
-        return -EIO;
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
-        return -EIO;
-    if (write(disk_fd, buf, len) != len)
-        return -EIO;
+    use_default();
+    if (dev->write_hook)
+        dev->write_hook(buf, lba, nblks);
+    if (dev->tier_fd >= 0)
+        tier_note(lba, nblks);
+    if (dev->wb_on)
+        return wb_put(buf, lba, nblks);
+    return do_write(buf, lba, nblks);
+}
+
+/* write the superblock. block_write() refuses block 0 so that a stray
+ * null block pointer can't clobber it; this is the only way in.
+ */
+int block_write_super(char *buf)
+{
+    use_default();
+    if (dev->wb_on)
+        return wb_put(buf, 0, 1);
+    return do_write(buf, 0, 1);
+}
+
+/* discard blocks - the file system no longer needs their contents, so
+ * punch them out of the image file and let the host reclaim the
+ * space. They read back as zeros. Returns -EIO if error, 0 otherwise
+ */
+int block_discard(int lba, int nblks)
+{
+    off_t len = (off_t)nblks * FS_BLOCK_SIZE, start = (off_t)lba * FS_BLOCK_SIZE;
+
+    assert(lba > 0);
+    use_default();
+    if (dev->write_hook)
+        dev->write_hook(NULL, lba, nblks);
+    if (dev->wb_on)
+        wb_drop(lba, nblks);
+    int c = io_class >= 0 ? io_class : IO_MAINT, rv = 0;
+    io_begin(c);
+    if (dev->nmembers == 1)
+        rv = fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len);
+    for (int b = lba, m; dev->nmembers > 1 && b < lba + nblks; ) {
+        int n = stripe_len(b, lba + nblks - b);
+        off_t off = stripe_off(b, &m);
+        if (fallocate(dev->fds[m], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                      (off_t)n * FS_BLOCK_SIZE) < 0)
+            rv = -1;
+        b += n;
+    }
+    if (dev->tier_fd >= 0) {
+        pthread_rwlock_rdlock(&dev->tier_lock);
+        for (int b = lba; b < lba + nblks; b++) {
+            int s = tier_slot_of(b);
+            if (s >= 0 && fallocate(dev->tier_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                    (off_t)(dev->tier_base + s) * FS_BLOCK_SIZE,
+                                    FS_BLOCK_SIZE) < 0)
+                rv = -1;
+        }
+        pthread_rwlock_unlock(&dev->tier_lock);
+    }
+    io_end(c);
+    return rv < 0 ? -EIO : 0;
+}
+
+static int open_locked(const char *file)
+{
+    int fd = open(file, O_RDWR);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        int err = errno == EWOULDBLOCK ? EBUSY : errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/* the file 'name' from the superblock (a member or the fast tier),
+ * relative to the image's directory unless it starts with '/'
+ */
+static char *sibling(const char *file, const char *name)
+{
+    const char *slash = strrchr(file, '/');
+    int dirlen = slash && name[0] != '/' ? slash - file + 1 : 0;
+    char *path = malloc(dirlen + FS_MEMBER_NAME_LEN + 1);
+    sprintf(path, "%.*s%.*s", dirlen, file, FS_MEMBER_NAME_LEN, name);
+    return path;
+}
+
+/* open_members - if the superblock says the image is striped, open the
+ * other members
+ */
+static int open_members(struct blkdev *d, const struct fs_super *super)
+{
+    d->nmembers = 1;
+    d->fds[0] = d->fd;
+    if (super->n_members <= 1)
+        return 0;
+    if (super->n_members > FS_MAX_MEMBERS || super->stripe_unit == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    d->stripe_unit = super->stripe_unit;
+    for (int m = 1; m < super->n_members; m++) {
+        char *name = sibling(d->file, super->members[m-1]);
+        d->fds[m] = open_locked(name);
+        free(name);
+        if (d->fds[m] < 0)
+            return -1;
+        d->nmembers++;
+    }
     return 0;
 }
 
+/* open_tier - if the superblock names a fast tier, open it and load
+ * its map, which must have block 0 in slot 0 and no block twice
+ */
+static int open_tier(struct blkdev *d, const struct fs_super *super)
+{
+    d->tier_fd = -1;
+    if (super->tier_slots == 0)
+        return 0;
+    char *name = sibling(d->file, super->tier_file);
+    int fd = open_locked(name);
+    free(name);
+    if (fd < 0)
+        return -1;
+
+    int nslots = super->tier_slots, nblks = super->disk_size;
+    size_t len = (size_t)nslots * sizeof(uint32_t);
+    struct fs_tier_hdr hdr;
+    uint32_t *map = malloc(len);
+    int *slot = malloc(nblks * sizeof(int));
+    int ok = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        memcmp(hdr.magic, FS_TIER_MAGIC, 8) == 0 && hdr.n_slots == nslots &&
+        pread(fd, map, len, FS_BLOCK_SIZE) == len && map[0] == FS_TIER_PINNED;
+    for (int b = 0; b < nblks; b++)
+        slot[b] = -1;
+    for (int s = 0; ok && s < nslots; s++) {
+        uint32_t b = FS_TIER_BLK(map[s]);
+        if (b >= nblks || (b != 0 && slot[b] >= 0))
+            ok = 0;
+        else if (s == 0 || b != 0)
+            slot[b] = s;
+    }
+    if (!ok) {
+        close(fd);
+        free(map);
+        free(slot);
+        errno = EINVAL;
+        return -1;
+    }
+
+    d->tier_fd = fd;
+    d->tier_nslots = nslots;
+    d->tier_base = 1 + (len + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    d->tier_nblks = nblks;
+    d->tier_map = map;
+    d->tier_slot = slot;
+    d->tier_heat = calloc(nblks, 1);
+    d->tier_pin = calloc(nblks, 1);
+    for (int s = 0; s < nslots; s++)
+        if (map[s] & FS_TIER_PINNED)
+            d->tier_pin[FS_TIER_BLK(map[s])] = 1;
+    return 0;
+}
+
+/* block_open - open an image file, its members if it's striped and its
+ * fast tier if it has one, returning NULL (with errno set) if it can't be opened. Each mount
+ * keeps its own copy of the bitmap and superblock, so only one may have
+ * an image at a time: it's locked, and EBUSY returned if something else
+ * (hwfuse, or a program using the library or the LD_PRELOAD client)
+ * already has it. The lock is a flock so that it stays with the file
+ * across hwfuse's fork into the background.
+ */
+struct blkdev *block_open(const char *file)
+{
+    int fd = open_locked(file);
+    if (fd < 0)
+        return NULL;
+    struct blkdev *d = calloc(1, sizeof(*d));
+    d->fd = fd;
+    d->file = strdup(file);
+    // an image that isn't a file system is left for the caller to reject
+    struct fs_super super;
+    if (pread(fd, &super, sizeof(super), 0) != sizeof(super) || super.magic != FS_MAGIC)
+        memset(&super, 0, sizeof(super));
+    if (open_members(d, &super) < 0 || open_tier(d, &super) < 0) {
+        int err = errno;
+        for (int m = 0; m < d->nmembers; m++)
+            close(d->fds[m]);
+        free(d->file);
+        free(d);
+        errno = err;
+        return NULL;
+    }
+    pthread_mutex_init(&d->wb_mutex, NULL);
+    pthread_cond_init(&d->wb_kick, NULL);
+    pthread_cond_init(&d->wb_done, NULL);
+    pthread_mutex_init(&d->hot_mutex, NULL);
+    pthread_cond_init(&d->hot_cond, NULL);
+    pthread_rwlock_init(&d->tier_lock, NULL);
+    pthread_mutex_init(&d->tier_mutex, NULL);
+    pthread_cond_init(&d->tier_cond, NULL);
+    return d;
+}
+
+/* block_close - the caller has already stopped write-back, hot
+ * block tracking and tiering on it
+ */
+void block_close(struct blkdev *d)
+{
+    if (dev == d)
+        dev = NULL;
+    for (int m = 0; m < d->nmembers; m++)
+        close(d->fds[m]);
+    if (d->tier_fd >= 0) {
+        close(d->tier_fd);
+        free(d->tier_map);
+        free(d->tier_slot);
+        free(d->tier_heat);
+        free(d->tier_pin);
+    }
+    pthread_mutex_destroy(&d->wb_mutex);
+    pthread_cond_destroy(&d->wb_kick);
+    pthread_cond_destroy(&d->wb_done);
+    pthread_mutex_destroy(&d->hot_mutex);
+    pthread_cond_destroy(&d->hot_cond);
+    pthread_rwlock_destroy(&d->tier_lock);
+    pthread_mutex_destroy(&d->tier_mutex);
+    pthread_cond_destroy(&d->tier_cond);
+    free(d->file);
+    free(d);
+}
+
 void block_init(char *file)
 {
     if (strlen(file) < 4 || strcmp(file+strlen(file)-4, ".img") != 0) {
         printf("bad image file (must end in .img): %s\n", file);
         exit(1);
     }
-    if ((disk_fd = open(file, O_RDWR)) < 0) {
+    if ((default_dev = block_open(file)) == NULL) {
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         exit(1);
     }
+    dev = default_dev;
 }
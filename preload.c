@@ -0,0 +1,677 @@
+/*
+ * file:        preload.c
+ * description: LD_PRELOAD client - runs file calls under a mount point
+ *              directly against the image, without going through FUSE
+ *
+ * usage: FS5600_IMAGE=disk.img FS5600_PREFIX=/mnt/fs \
+ *            LD_PRELOAD=./libfs5600-preload.so command...
+ *
+ * open/openat/close/dup/read/write/pread/pwrite/lseek/fsync, the stat calls
+ * (stat/lstat/fstat/fstatat/statx), opendir/readdir/closedir and
+ * unlink/unlinkat/mkdir/rmdir on absolute paths under FS5600_PREFIX
+ * (the *at calls only with an absolute path) are handled here through the library API
+ * (libfs5600.h), and everything else goes to the real libc. The image
+ * is mounted the first time a path under the prefix is used, and
+ * unmounted when the program exits.
+ *
+ * Only one mount may have an image at a time (see block_open), so if
+ * hwfuse - or another program using this - already has it, the image
+ * can't be opened here and every call is passed through to the kernel,
+ * i.e. to the FUSE mount on the prefix if there is one. A child
+ * process does the same, since it can't share its parent's mount.
+ *
+ * The descriptors handed out are real ones, reserved by opening
+ * /dev/null, so they never clash with the program's own; calls not
+ * listed above (mmap, fcntl, ...) see /dev/null, as does a program
+ * exec'ed with one open. Calls made from inside libc, e.g. by fopen,
+ * aren't seen at all. Built for 64-bit Linux,
+ * where the *64 calls and structures are the same as the plain ones.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libfs5600.h"
+
+_Static_assert(sizeof(off_t) == sizeof(off64_t) &&
+               sizeof(struct stat) == sizeof(struct stat64) &&
+               sizeof(struct dirent) == sizeof(struct dirent64), "64-bit only");
+
+#define PL_MAX_FD 4096
+
+/* the real libc functions, looked up on first use
+ */
+#define REAL(fn) ((__typeof__(real_##fn))real((void **)&real_##fn, #fn))
+
+static void *real(void **fp, const char *name)
+{
+    if (*fp == NULL)
+        *fp = dlsym(RTLD_NEXT, name);
+    return *fp;
+}
+
+static int (*real_open)(const char *path, int flags, ...);
+static int (*real_openat)(int dirfd, const char *path, int flags, ...);
+static int (*real_close)(int fd);
+static int (*real_dup)(int fd);
+static int (*real_dup2)(int fd, int fd2);
+static int (*real_dup3)(int fd, int fd2, int flags);
+static ssize_t (*real_read)(int fd, void *buf, size_t len);
+static ssize_t (*real_write)(int fd, const void *buf, size_t len);
+static ssize_t (*real_pread)(int fd, void *buf, size_t len, off_t offset);
+static ssize_t (*real_pwrite)(int fd, const void *buf, size_t len, off_t offset);
+static off_t (*real_lseek)(int fd, off_t offset, int whence);
+static int (*real_fsync)(int fd);
+static int (*real_stat)(const char *path, struct stat *sb);
+static int (*real_lstat)(const char *path, struct stat *sb);
+static int (*real_fstat)(int fd, struct stat *sb);
+static int (*real___xstat)(int ver, const char *path, struct stat *sb);
+static int (*real___lxstat)(int ver, const char *path, struct stat *sb);
+static int (*real___fxstat)(int ver, int fd, struct stat *sb);
+static int (*real_fstatat)(int dirfd, const char *path, struct stat *sb, int flags);
+static int (*real___fxstatat)(int ver, int dirfd, const char *path, struct stat *sb,
+                              int flags);
+static int (*real_statx)(int dirfd, const char *path, int flags, unsigned int mask,
+                         struct statx *stx);
+static DIR *(*real_opendir)(const char *path);
+static struct dirent *(*real_readdir)(DIR *d);
+static int (*real_closedir)(DIR *d);
+static int (*real_unlink)(const char *path);
+static int (*real_mkdir)(const char *path, mode_t mode);
+static int (*real_rmdir)(const char *path);
+static int (*real_unlinkat)(int dirfd, const char *path, int flags);
+
+static char *prefix;
+static size_t prefix_len;
+
+enum {PL_UNUSED, PL_IMAGE, PL_KERNEL};
+static int state = PL_UNUSED;
+static struct fs5600 *fs;
+
+/* an open file: its path in the image, and the file offset, shared
+ * by the descriptors dup'ed from it
+ */
+struct pl_file {
+    char *path;
+    int flags;
+    off_t pos;
+    int refs;
+};
+static struct pl_file *files[PL_MAX_FD];
+
+/* an open directory - read in full by opendir
+ */
+struct pl_dir {
+    struct dirent *ents;
+    int n, next;
+    struct pl_dir *link;
+};
+static struct pl_dir *dirs;
+
+static pthread_mutex_t pl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* fork - a child can't use its parent's mount, so the descriptors it
+ * inherits become the plain /dev/null ones they were reserved on, and
+ * are closed, read etc. by the kernel. Open directories are kept:
+ * they were read in full by opendir and never go back to the image.
+ * The mutex is held across the fork so the child gets it unlocked.
+ */
+static void pl_prepare(void)
+{
+    pthread_mutex_lock(&pl_mutex);
+}
+
+static void pl_parent(void)
+{
+    pthread_mutex_unlock(&pl_mutex);
+}
+
+static void pl_child(void)
+{
+    if (state == PL_IMAGE)
+        state = PL_KERNEL;
+    fs = NULL;
+    for (int fd = 0; fd < PL_MAX_FD; fd++) {
+        struct pl_file *f = files[fd];
+        files[fd] = NULL;
+        if (f != NULL && --f->refs == 0) {
+            free(f->path);
+            free(f);
+        }
+    }
+    pthread_mutex_unlock(&pl_mutex);
+}
+
+__attribute__((constructor))
+static void pl_init(void)
+{
+    char *p = getenv("FS5600_PREFIX");
+    if (p == NULL || getenv("FS5600_IMAGE") == NULL)
+        return;
+    prefix = strdup(p);
+    prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len-1] == '/')
+        prefix[--prefix_len] = '\0';
+    pthread_atfork(pl_prepare, pl_parent, pl_child);
+}
+
+__attribute__((destructor))
+static void pl_fini(void)
+{
+    if (fs != NULL)
+        fs5600_close(fs);
+    fs = NULL;
+}
+
+/* fs_path - if 'path' is under the prefix and the image is ours, its
+ * path in the image; NULL to pass the call on
+ */
+static const char *fs_path(const char *path)
+{
+    if (prefix == NULL || path == NULL || strncmp(path, prefix, prefix_len) != 0)
+        return NULL;
+    const char *p = path + prefix_len;
+    if (*p != '\0' && *p != '/')
+        return NULL;
+    pthread_mutex_lock(&pl_mutex);
+    if (state == PL_UNUSED) {
+        int err = errno;
+        fs = fs5600_open(getenv("FS5600_IMAGE"), NULL);
+        if (fs == NULL)
+            fprintf(stderr, "%s: %s, using the kernel\n", getenv("FS5600_IMAGE"),
+                    strerror(errno));
+        state = fs != NULL ? PL_IMAGE : PL_KERNEL;
+        errno = err;
+    }
+    pthread_mutex_unlock(&pl_mutex);
+    if (state != PL_IMAGE)
+        return NULL;
+    return *p != '\0' ? p : "/";
+}
+
+/* the *at calls - only for absolute paths, where dirfd doesn't matter
+ */
+static const char *fs_path_at(const char *path)
+{
+    return path != NULL && path[0] == '/' ? fs_path(path) : NULL;
+}
+
+static struct pl_file *fs_file(int fd)
+{
+    if (fd < 0 || fd >= PL_MAX_FD)
+        return NULL;
+    return __atomic_load_n(&files[fd], __ATOMIC_ACQUIRE);
+}
+
+/* return a result from the library: a negative errno, or success
+ */
+static int fs_ret(int rv)
+{
+    if (rv < 0) {
+        errno = -rv;
+        return -1;
+    }
+    return rv;
+}
+
+static int pl_open(const char *path, int flags, mode_t mode)
+{
+    struct stat sb;
+    int rv = fs5600_getattr(fs, path, &sb);
+    if (rv == -ENOENT && (flags & O_CREAT)) {
+        rv = fs5600_create(fs, path, S_IFREG | (mode & 07777));
+        if (rv == -EEXIST && !(flags & O_EXCL))
+            rv = 0;             // lost a race with another thread
+    } else if (rv == 0 && (flags & O_CREAT) && (flags & O_EXCL)) {
+        rv = -EEXIST;
+    } else if (rv == 0 && S_ISDIR(sb.st_mode) && (flags & O_ACCMODE) != O_RDONLY) {
+        rv = -EISDIR;
+    }
+    if (rv == 0 && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+        rv = fs5600_truncate(fs, path, 0);
+    if (rv < 0)
+        return fs_ret(rv);
+
+    int fd = REAL(open)("/dev/null", O_RDONLY | (flags & O_CLOEXEC));
+    if (fd < 0)
+        return -1;
+    if (fd >= PL_MAX_FD) {
+        REAL(close)(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    struct pl_file *f = malloc(sizeof(*f));
+    f->path = strdup(path);
+    f->flags = flags;
+    f->pos = 0;
+    f->refs = 1;
+    __atomic_store_n(&files[fd], f, __ATOMIC_RELEASE);
+    return fd;
+}
+
+static int open_mode(int flags, va_list ap)
+{
+    return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE ? va_arg(ap, int) : 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    const char *p = fs_path(path);
+    return p ? pl_open(p, flags, mode) : REAL(open)(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    return open(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    const char *p = fs_path_at(path);
+    return p ? pl_open(p, flags, mode) : REAL(openat)(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    return openat(dirfd, path, flags, mode);
+}
+
+/* forget a descriptor, and the file once its last descriptor goes
+ */
+static void pl_drop(int fd)
+{
+    struct pl_file *f = fs_file(fd);
+    if (f == NULL)
+        return;
+    __atomic_store_n(&files[fd], NULL, __ATOMIC_RELEASE);
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        fs5600_release(fs, f->path);
+        free(f->path);
+        free(f);
+    }
+}
+
+int close(int fd)
+{
+    pl_drop(fd);
+    return REAL(close)(fd);
+}
+
+/* dup - 'newfd' is the real dup of oldfd; make it refer to the same file
+ */
+static int pl_dup(int oldfd, int newfd)
+{
+    struct pl_file *f = fs_file(oldfd);
+    if (f == NULL || newfd < 0)
+        return newfd;
+    if (newfd >= PL_MAX_FD) {
+        REAL(close)(newfd);
+        errno = EMFILE;
+        return -1;
+    }
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&files[newfd], f, __ATOMIC_RELEASE);
+    return newfd;
+}
+
+int dup(int fd)
+{
+    return pl_dup(fd, REAL(dup)(fd));
+}
+
+int dup2(int fd, int fd2)
+{
+    if (fd == fd2)
+        return REAL(dup2)(fd, fd2);
+    pl_drop(fd2);
+    return pl_dup(fd, REAL(dup2)(fd, fd2));
+}
+
+int dup3(int fd, int fd2, int flags)
+{
+    if (fd != fd2)
+        pl_drop(fd2);
+    return pl_dup(fd, REAL(dup3)(fd, fd2, flags));
+}
+
+ssize_t pread(int fd, void *buf, size_t len, off_t offset)
+{
+    struct pl_file *f = fs_file(fd);
+    if (f == NULL)
+        return REAL(pread)(fd, buf, len, offset);
+    if ((f->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    return fs_ret(fs5600_read(fs, f->path, buf, len, offset));
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    struct pl_file *f = fs_file(fd);
+    if (f == NULL)
+        return REAL(pwrite)(fd, buf, len, offset);
+    if ((f->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+    return fs_ret(fs5600_write(fs, f->path, buf, len, offset));
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+    struct pl_file *f = fs_file(fd);
+    if (f == NULL)
+        return REAL(read)(fd, buf, len);
+    ssize_t n = pread(fd, buf, len, f->pos);
+    if (n > 0)
+        f->pos += n;
+    return n;
+}
+
+ssize_t write(int fd, const void *buf, size_t len)
+{
+    struct pl_file *f = fs_file(fd);
+    if (f == NULL)
+        return REAL(write)(fd, buf, len);
+    if (f->flags & O_APPEND) {
+        struct stat sb;
+        int rv = fs5600_getattr(fs, f->path, &sb);
+        if (rv < 0)
+            return fs_ret(rv);
+        f->pos = sb.st_size;
+    }
+    ssize_t n = pwrite(fd, buf, len, f->pos);
+    if (n > 0)
+        f->pos += n;
+    return n;
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    struct pl_file *f = fs_file(fd);
+    if (f == NULL)
+        return REAL(lseek)(fd, offset, whence);
+    struct stat sb;
+    off_t base = 0;
+    if (whence == SEEK_CUR) {
+        base = f->pos;
+    } else if (whence == SEEK_END) {
+        int rv = fs5600_getattr(fs, f->path, &sb);
+        if (rv < 0)
+            return fs_ret(rv);
+        base = sb.st_size;
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return f->pos = base + offset;
+}
+
+int fsync(int fd)
+{
+    struct pl_file *f = fs_file(fd);
+    return f != NULL ? fs_ret(fs5600_fsync(fs)) : REAL(fsync)(fd);
+}
+
+ssize_t pread64(int fd, void *buf, size_t len, off64_t offset)
+{
+    return pread(fd, buf, len, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t len, off64_t offset)
+{
+    return pwrite(fd, buf, len, offset);
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence)
+{
+    return lseek(fd, offset, whence);
+}
+
+/* stat - there are no links, so lstat is the same. Older versions of
+ * glibc call the __xstat versions instead.
+ */
+int stat(const char *path, struct stat *sb)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_getattr(fs, p, sb)) : REAL(stat)(path, sb);
+}
+
+int lstat(const char *path, struct stat *sb)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_getattr(fs, p, sb)) : REAL(lstat)(path, sb);
+}
+
+int fstat(int fd, struct stat *sb)
+{
+    struct pl_file *f = fs_file(fd);
+    return f ? fs_ret(fs5600_getattr(fs, f->path, sb)) : REAL(fstat)(fd, sb);
+}
+
+int stat64(const char *path, struct stat64 *sb)
+{
+    return stat(path, (struct stat *)sb);
+}
+
+int lstat64(const char *path, struct stat64 *sb)
+{
+    return lstat(path, (struct stat *)sb);
+}
+
+int fstat64(int fd, struct stat64 *sb)
+{
+    return fstat(fd, (struct stat *)sb);
+}
+
+int __xstat(int ver, const char *path, struct stat *sb)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_getattr(fs, p, sb)) : REAL(__xstat)(ver, path, sb);
+}
+
+int __lxstat(int ver, const char *path, struct stat *sb)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_getattr(fs, p, sb)) : REAL(__lxstat)(ver, path, sb);
+}
+
+int __fxstat(int ver, int fd, struct stat *sb)
+{
+    struct pl_file *f = fs_file(fd);
+    return f ? fs_ret(fs5600_getattr(fs, f->path, sb)) : REAL(__fxstat)(ver, fd, sb);
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *sb)
+{
+    return __xstat(ver, path, (struct stat *)sb);
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *sb)
+{
+    return __lxstat(ver, path, (struct stat *)sb);
+}
+
+int __fxstat64(int ver, int fd, struct stat64 *sb)
+{
+    return __fxstat(ver, fd, (struct stat *)sb);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *sb, int flags)
+{
+    const char *p = fs_path_at(path);
+    return p ? fs_ret(fs5600_getattr(fs, p, sb)) : REAL(fstatat)(dirfd, path, sb, flags);
+}
+
+int fstatat64(int dirfd, const char *path, struct stat64 *sb, int flags)
+{
+    return fstatat(dirfd, path, (struct stat *)sb, flags);
+}
+
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *sb, int flags)
+{
+    const char *p = fs_path_at(path);
+    return p ? fs_ret(fs5600_getattr(fs, p, sb)) :
+        REAL(__fxstatat)(ver, dirfd, path, sb, flags);
+}
+
+int __fxstatat64(int ver, int dirfd, const char *path, struct stat64 *sb, int flags)
+{
+    return __fxstatat(ver, dirfd, path, (struct stat *)sb, flags);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *stx)
+{
+    const char *p = fs_path_at(path);
+    if (p == NULL)
+        return REAL(statx)(dirfd, path, flags, mask, stx);
+    struct stat sb;
+    int rv = fs5600_getattr(fs, p, &sb);
+    if (rv < 0)
+        return fs_ret(rv);
+    memset(stx, 0, sizeof(*stx));
+    stx->stx_mask = STATX_BASIC_STATS & ~STATX_INO;
+    stx->stx_blksize = sb.st_blksize;
+    stx->stx_nlink = sb.st_nlink;
+    stx->stx_uid = sb.st_uid;
+    stx->stx_gid = sb.st_gid;
+    stx->stx_mode = sb.st_mode;
+    stx->stx_size = sb.st_size;
+    stx->stx_blocks = sb.st_blocks;
+    stx->stx_atime.tv_sec = sb.st_atime;
+    stx->stx_mtime.tv_sec = sb.st_mtime;
+    stx->stx_ctime.tv_sec = sb.st_ctime;
+    return 0;
+}
+
+static int dir_filler(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+    struct pl_dir *d = ptr;
+    d->ents = realloc(d->ents, (d->n + 1) * sizeof(struct dirent));
+    struct dirent *de = &d->ents[d->n];
+    memset(de, 0, sizeof(*de));
+    de->d_ino = d->n + 1;       // no inode numbers in a struct stat from us
+    de->d_off = d->n + 1;
+    de->d_reclen = sizeof(*de);
+    de->d_type = S_ISDIR(sb->st_mode) ? DT_DIR : DT_REG;
+    snprintf(de->d_name, sizeof(de->d_name), "%s", name);
+    d->n++;
+    return 0;
+}
+
+static struct pl_dir *fs_dir(DIR *dir)
+{
+    pthread_mutex_lock(&pl_mutex);
+    struct pl_dir *d = dirs;
+    while (d != NULL && d != (struct pl_dir *)dir)
+        d = d->link;
+    pthread_mutex_unlock(&pl_mutex);
+    return d;
+}
+
+DIR *opendir(const char *path)
+{
+    const char *p = fs_path(path);
+    if (p == NULL)
+        return REAL(opendir)(path);
+    struct pl_dir *d = calloc(1, sizeof(*d));
+    int rv = fs5600_readdir(fs, p, d, dir_filler);
+    if (rv < 0) {
+        free(d->ents);
+        free(d);
+        errno = -rv;
+        return NULL;
+    }
+    pthread_mutex_lock(&pl_mutex);
+    d->link = dirs;
+    dirs = d;
+    pthread_mutex_unlock(&pl_mutex);
+    return (DIR *)d;
+}
+
+struct dirent *readdir(DIR *dir)
+{
+    struct pl_dir *d = fs_dir(dir);
+    if (d == NULL)
+        return REAL(readdir)(dir);
+    return d->next < d->n ? &d->ents[d->next++] : NULL;
+}
+
+struct dirent64 *readdir64(DIR *dir)
+{
+    return (struct dirent64 *)readdir(dir);
+}
+
+int closedir(DIR *dir)
+{
+    struct pl_dir *d = fs_dir(dir);
+    if (d == NULL)
+        return REAL(closedir)(dir);
+    pthread_mutex_lock(&pl_mutex);
+    struct pl_dir **pp = &dirs;
+    while (*pp != d)
+        pp = &(*pp)->link;
+    *pp = d->link;
+    pthread_mutex_unlock(&pl_mutex);
+    free(d->ents);
+    free(d);
+    return 0;
+}
+
+int unlink(const char *path)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_unlink(fs, p)) : REAL(unlink)(path);
+}
+
+int unlinkat(int dirfd, const char *path, int flags)
+{
+    const char *p = fs_path_at(path);
+    if (p == NULL)
+        return REAL(unlinkat)(dirfd, path, flags);
+    return fs_ret(flags & AT_REMOVEDIR ? fs5600_rmdir(fs, p) : fs5600_unlink(fs, p));
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_mkdir(fs, p, mode)) : REAL(mkdir)(path, mode);
+}
+
+int rmdir(const char *path)
+{
+    const char *p = fs_path(path);
+    return p ? fs_ret(fs5600_rmdir(fs, p)) : REAL(rmdir)(path);
+}
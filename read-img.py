@@ -5,20 +5,85 @@ import diskfmt as fs
 
 fd = os.open(sys.argv[1], os.O_RDONLY)
 nbytes = os.fstat(fd).st_size
-if nbytes % 4096 != 0:
+bs = fs.block_size(os.read(fd, 4096))
+fs.layout(bs)
+os.lseek(fd, 0, os.SEEK_SET)
+if nbytes % bs != 0:
     print 'BAD LENGTH: %d (0x%x)' % (nbytes, nbytes)
     sys.exit(1)
 
-nblks = nbytes // 4096
-blks = [bytes(os.read(fd, 4096)) for _ in range(nblks)]
+nblks = nbytes // bs
+blks = [bytes(os.read(fd, bs)) for _ in range(nblks)]
 sb = fs.super.from_buffer_copy(blks[0])
+
+# a striped image: put the blocks back together from the members
+if sb.n_members > 1:
+    members = [blks]
+    for i in range(1, sb.n_members):
+        name = os.path.join(os.path.dirname(sys.argv[1]), sb.members[i-1].value)
+        with open(name, 'rb') as fp:
+            data = fp.read()
+        members.append([data[j:j+bs] for j in range(0, len(data), bs)])
+    nblks = min(sb.disk_sz, sum([len(m) for m in members]))
+    blks = []
+    for b in range(nblks):
+        m, i = fs.stripe_map(sb, b)
+        blks.append(members[m][i])
+
+# a tiered one: the blocks in the fast tier replace their copies
+tier = None
+if sb.tier_slots:
+    with open(os.path.join(os.path.dirname(sys.argv[1]), sb.tier_file), 'rb') as fp:
+        data = fp.read()
+    tier = fs.tier_map(sb, data)
+    if tier is None:
+        print 'BAD FAST TIER: %s' % sb.tier_file
+        sys.exit(1)
+    base = fs.tier_base(sb.tier_slots)
+    for b, s in tier.items():
+        if b < len(blks):
+            blks[b] = data[(base + s) * bs:(base + s + 1) * bs]
 print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+if bs != 4096:
+    print ('            block size: %d' % bs)
+if sb.n_members > 1:
+    print ('            striped: %d-block unit, members %s' %
+               (sb.stripe_unit, ' '.join([sys.argv[1]] +
+                                         [sb.members[i].value for i in range(sb.n_members - 1)])))
+if tier is not None:
+    print ('            tiered: %s, %d of %d slots used' %
+               (sb.tier_file, len(tier), sb.tier_slots))
+if sb.n_orphans:
+    print ('            orphans: %s' %
+               ' '.join([str(sb.orphans[i]) for i in range(sb.n_orphans)]))
+if sb.ref_blks[0]:
+    print ('            refcount table: %s' %
+               ' '.join([str(b) for b in sb.ref_blks if b]))
+if sb.csum_blks[0]:
+    print ('            checksum table: %s' %
+               ' '.join([str(b) for b in sb.csum_blks if b]))
+for sn in sb.snaps:
+    if sn.root:
+        print ('            snapshot "%s": root inode %d' % (sn.name, sn.root))
+if sb.gen:
+    print ('            generation: %d, groups changed: %s' %
+               (sb.gen, ' '.join(['%d@%d' % (g, sb.group_gen[g])
+                                  for g in range((nblks + 255) // 256)])))
+    print ('            last mounted in generation %d' % sb.mount_gen)
+print ('            state: %s' % ('clean' if sb.state == fs.STATE_CLEAN else 'not clean'))
 print
 
 blkmap = fs.bitmap.from_buffer_copy(blks[1])
+if sb.state == fs.STATE_CLEAN:
+    for g in range((nblks + 255) // 256):
+        nfree = len([i for i in range(g * 256, min(nblks, (g + 1) * 256))
+                     if not blkmap.get(i)])
+        if sb.group_free[g] != nfree:
+            print ('group %d: *BAD* free count %d, bitmap has %d' %
+                       (g, sb.group_free[g], nfree))
 inodes = dict()
 
 print("blocks used:"),
@@ -48,8 +113,13 @@ def iter(name, inum, v):
         print '  "%s" (%d,%d) %03o %d %s' % (s, _in.uid, _in.gid, _in.mode,
                                                  _in.size, alloc)
     
-    xblks = (_in.size + 4095) // 4096
-    if fs.S_ISREG(_in.mode):
+    xblks = (_in.size + bs - 1) // bs
+    if fs.S_ISREG(_in.mode) and _in.tail_blk:
+        alloc = '' if blkmap.get(_in.tail_blk) else '(NOT ALLOCATED)'
+        if v:
+            print '  tail: block %d offset %d len %d %s' % (_in.tail_blk,
+                                  _in.tail_off, _in.tail_len, alloc)
+    elif fs.S_ISREG(_in.mode):
         if v:
             print '  blocks: ',
         for i in range(xblks):
@@ -66,7 +136,7 @@ def iter(name, inum, v):
                 print '  block', dblk, alloc
             _blk = blks[dblk]
             des = [fs.dirent.from_buffer_copy(_blk[j:j+32])
-                       for j in range(0, 4096, 32)]
+                       for j in range(0, bs, 32)]
             for j in range(128):
                 if des[j].valid:
                     if v:
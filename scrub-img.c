@@ -0,0 +1,136 @@
+/*
+ * file:        scrub-img.c
+ * description: check every block of an image against its checksum
+ *
+ * usage: ./scrub-img [-t threads] disk.img
+ *          -t N  - number of threads (default: one per CPU)
+ *
+ * Only works on images with a checksum table (see hwfuse -checksum).
+ * The image is split into chunks of SCRUB_CHUNK blocks, which the
+ * threads take in order, so the reads stay mostly sequential while
+ * the checksums are computed in parallel. Blocks with checksum 0
+ * (never written since the table was made, or discarded) are skipped.
+ * Exits with status 1 if any block is bad.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fs5600.h"
+
+#define SCRUB_CHUNK 256         /* blocks, i.e. 1MB */
+
+int fd;
+int nblks;
+struct fs_super super;
+uint32_t *csum;
+
+int next_chunk;                 /* taken with __sync_fetch_and_add */
+int n_checked, n_bad;
+pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void *scrub_thread(void *arg)
+{
+    char *buf = malloc(SCRUB_CHUNK * FS_BLOCK_SIZE);
+    int checked = 0, bad = 0;
+    for (;;) {
+        int start = __sync_fetch_and_add(&next_chunk, 1) * SCRUB_CHUNK;
+        if (start >= nblks)
+            break;
+        int n = nblks - start < SCRUB_CHUNK ? nblks - start : SCRUB_CHUNK;
+        ssize_t len = pread(fd, buf, (size_t)n * FS_BLOCK_SIZE, (off_t)start * FS_BLOCK_SIZE);
+        if (len < 0)
+            len = 0;
+        for (int i = 0; i < n; i++) {
+            uint32_t c = csum[start + i];
+            if (c == 0)
+                continue;
+            checked++;
+            if ((i + 1) * FS_BLOCK_SIZE > len ||
+                crc32c(0, buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE) != c) {
+                bad++;
+                pthread_mutex_lock(&print_mutex);
+                printf("block %d: bad checksum\n", start + i);
+                pthread_mutex_unlock(&print_mutex);
+            }
+        }
+    }
+    __sync_fetch_and_add(&n_checked, checked);
+    __sync_fetch_and_add(&n_bad, bad);
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        nthreads = atoi(argv[2]);
+        argv += 2, argc -= 2;
+    }
+    if (argc != 2 || nthreads < 1) {
+        fprintf(stderr, "usage: %s [-t threads] disk.img\n", argv[0]);
+        exit(1);
+    }
+    if ((fd = open(argv[1], O_RDONLY)) < 0) {
+        fprintf(stderr, "cannot open image file '%s': %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+    if (pread(fd, &super, sizeof(super), 0) != sizeof(super) || super.magic != FS_MAGIC) {
+        fprintf(stderr, "%s: not a file system image\n", argv[1]);
+        exit(1);
+    }
+    if (super.n_members > 1) {
+        fprintf(stderr, "%s: striped image, not supported\n", argv[1]);
+        exit(1);
+    }
+    if (super.tier_slots != 0) {
+        fprintf(stderr, "%s: tiered image, not supported\n", argv[1]);
+        exit(1);
+    }
+    if (FS_SUPER_BLOCK_SIZE(&super) != FS_BLOCK_SIZE) {
+        fprintf(stderr, "%s: block size is %d, not %d\n", argv[1],
+                FS_SUPER_BLOCK_SIZE(&super), FS_BLOCK_SIZE);
+        exit(1);
+    }
+    if (super.csum_blks[0] == 0) {
+        fprintf(stderr, "%s: no checksums (mount with -checksum to add them)\n", argv[1]);
+        exit(1);
+    }
+    nblks = super.disk_size;
+    csum = calloc(FS_MAX_CSUM_BLKS, FS_BLOCK_SIZE);
+    for (int i = 0; i < FS_MAX_CSUM_BLKS && super.csum_blks[i] != 0; i++) {
+        if (pread(fd, &csum[i * FS_CSUMS_PER_BLK], FS_BLOCK_SIZE,
+                  (off_t)super.csum_blks[i] * FS_BLOCK_SIZE) != FS_BLOCK_SIZE) {
+            fprintf(stderr, "%s: can't read checksum table\n", argv[1]);
+            exit(1);
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, scrub_thread, NULL);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d blocks checked, %d bad, %d threads, %.1f MB/s\n", n_checked, n_bad,
+           nthreads, secs > 0 ? (double)nblks * FS_BLOCK_SIZE / secs / 1e6 : 0.0);
+
+    free(threads);
+    free(csum);
+    close(fd);
+    return n_bad ? 1 : 0;
+}
@@ -14,12 +14,30 @@
 #include <fuse.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include "fs5600.h"
+#include "libfs5600.h"
 
 
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
-
-#define FS_BLOCK_SIZE 4096
+extern int block_read(void *buf, int lba, int nblks);
+extern int fs_discard;
+extern int fs_dedup;
+extern int fs_checksum;
+extern int fs_writeback;
+extern int fs_warm;
+extern void block_io_class(int cls);
 
 /* mockup for fuse_get_context. you can change ctx.uid, ctx.gid in 
  * tests if you want to test setting UIDs in mknod/mkdir
@@ -221,11 +239,11 @@ START_TEST(write_errors)
         int  len;
         unsigned cksum;  
     } table_1[] = {
-        {"/file.1k", 1000, 1786485602},     // offset > file size - EINVAL
         {"/dir3/subdir", 4095, 4220582896}, // a/b - b is not file - EISDIR
+        {"/dir3/subdir/not-a-file", 4095, 0}, // a/b/c - c doesn't exist - ENOENT
         {NULL}
     };
-    int errors[] = {EINVAL, EISDIR};
+    int errors[] = {EISDIR, ENOENT};
 
     int size = 4000;
     char *buf = malloc(sizeof(char) * size + 10);
@@ -481,16 +499,1487 @@ START_TEST(truncate_test)
     int nfree_blks_after = st->f_bfree;
     ck_assert(nfree_blks_before == nfree_blks_after);
 
-    // return EINVAL error if offset is not 0
-    rv = fs_ops.truncate(table_1[0].path, 1);
+    // return EINVAL error if length is negative
+    rv = fs_ops.truncate(table_1[0].path, -1);
+    ck_assert(rv == -EINVAL);
+
+    free(st);
+
+}
+END_TEST
+
+START_TEST(fallocate_test)
+{
+    char *path = "/dir3/subdir/prealloc";
+    int nblks = 8;
+    int base = FS_BLOCK_SIZE;   // block 0 stays a hole
+    int size = FS_BLOCK_SIZE * nblks;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    char *buf = malloc(size);
+    char *zeros = calloc(size, 1);
+
+    int rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+
+    // hole punching etc. isn't supported
+    rv = fs_ops.fallocate(path, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, base, size, NULL);
+    ck_assert(rv == -EOPNOTSUPP);
+
+    // mode 0 - blocks are contiguous, size grows, contents read as zero
+    rv = fs_ops.fallocate(path, 0, base, size, NULL);
+    ck_assert(rv == 0);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == base + size);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - nblks);
+    uint64_t first = base / FS_BLOCK_SIZE;
+    rv = fs_ops.bmap(path, FS_BLOCK_SIZE, &first);
+    ck_assert(rv == 0 && first != 0);
+    for (uint64_t i = 1; i < nblks; i++) {
+        uint64_t blk = base / FS_BLOCK_SIZE + i;
+        rv = fs_ops.bmap(path, FS_BLOCK_SIZE, &blk);
+        ck_assert(rv == 0);
+        ck_assert(blk == first + i);
+    }
+    memset(buf, 'R', size);
+    rv = fs_ops.read(path, buf, size, base, NULL);
+    ck_assert(rv == size);
+    ck_assert(memcmp(buf, zeros, size) == 0);
+
+    // writing into the preallocated range doesn't allocate anything
+    memset(buf, 'W', 100);
+    rv = fs_ops.write(path, buf, 100, base + 50, NULL);
+    ck_assert(rv == 100);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE, base, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE);
+    ck_assert(memcmp(buf, zeros, 50) == 0);
+    ck_assert(buf[50] == 'W' && buf[149] == 'W');
+    ck_assert(memcmp(buf + 150, zeros, FS_BLOCK_SIZE - 150) == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - nblks);
+
+    // KEEP_SIZE - blocks past EOF, size unchanged
+    rv = fs_ops.fallocate(path, FALLOC_FL_KEEP_SIZE, base + size, FS_BLOCK_SIZE * 2, NULL);
+    ck_assert(rv == 0);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == base + size);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - nblks - 2);
+
+    // unlink frees everything, including blocks past EOF
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+    fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree > nfree_blks_before);
+
+    free(st);
+    free(sb);
+    free(buf);
+    free(zeros);
+}
+END_TEST
+
+START_TEST(interleaved_append_test)
+{
+    char *paths[] = {"/dir2/stream-a", "/dir2/stream-b"};
+    int nblks = 6;
+    char *buf = malloc(FS_BLOCK_SIZE);
+    memset(buf, 'A', FS_BLOCK_SIZE);
+
+    for (int i = 0; i < 2; i++) {
+        int rv = fs_ops.create(paths[i], S_IFREG | 0777, NULL);
+        ck_assert(rv >= 0);
+    }
+    // two writers appending in lock-step each get a contiguous file
+    for (int k = 0; k < nblks; k++) {
+        for (int i = 0; i < 2; i++) {
+            int rv = fs_ops.write(paths[i], buf, FS_BLOCK_SIZE, k * FS_BLOCK_SIZE, NULL);
+            ck_assert(rv == FS_BLOCK_SIZE);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        uint64_t first = 0;
+        int rv = fs_ops.bmap(paths[i], FS_BLOCK_SIZE, &first);
+        ck_assert(rv == 0);
+        for (uint64_t k = 1; k < nblks; k++) {
+            uint64_t blk = k;
+            fs_ops.bmap(paths[i], FS_BLOCK_SIZE, &blk);
+            ck_assert(blk == first + k);
+        }
+        rv = fs_ops.release(paths[i], NULL);
+        ck_assert(rv == 0);
+        rv = fs_ops.unlink(paths[i]);
+        ck_assert(rv == 0);
+    }
+    free(buf);
+}
+END_TEST
+
+START_TEST(sparse_test)
+{
+    char *path = "/dir2/sparse";
+    int hole = FS_BLOCK_SIZE * 5 + 100;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    char *buf = malloc(hole + 10);
+    char *zeros = calloc(hole, 1);
+
+    // an empty file takes just its inode
+    int rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == 0 && sb->st_blocks == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 1);
+
+    // writing past EOF leaves a hole, which doesn't take any space
+    memset(buf, 'W', 10);
+    rv = fs_ops.write(path, buf, 10, hole, NULL);
+    ck_assert(rv == 10);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == hole + 10);
+    ck_assert(sb->st_blocks == FS_BLOCK_SIZE / 512);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 2);
+
+    memset(buf, 'R', hole + 10);
+    rv = fs_ops.read(path, buf, hole + 10, 0, NULL);
+    ck_assert(rv == hole + 10);
+    ck_assert(memcmp(buf, zeros, hole) == 0);
+    ck_assert(buf[hole] == 'W' && buf[hole + 9] == 'W');
+
+    // reading at or past EOF returns nothing
+    rv = fs_ops.read(path, buf, 10, hole + 10, NULL);
+    ck_assert(rv == 0);
+
+    // filling in part of the hole only allocates that block
+    rv = fs_ops.write(path, buf, 10, FS_BLOCK_SIZE * 2, NULL);
+    ck_assert(rv == 10);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 3);
+
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before);
+
+    free(st);
+    free(sb);
+    free(buf);
+    free(zeros);
+}
+END_TEST
+
+START_TEST(tail_pack_test)
+{
+    char path[32];
+    int nfiles = 10, len = 100;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    char *buf = malloc(FS_BLOCK_SIZE);
+    char *zeros = calloc(FS_BLOCK_SIZE, 1);
+
+    // small files share a single tail block
+    int rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/dir2/small.%d", i);
+        rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+        ck_assert(rv >= 0);
+        memset(buf, 'a' + i, len);
+        rv = fs_ops.write(path, buf, len, 0, NULL);
+        ck_assert(rv == len);
+    }
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - nfiles - 1);
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/dir2/small.%d", i);
+        rv = fs_ops.read(path, buf, FS_BLOCK_SIZE, 0, NULL);
+        ck_assert(rv == len);
+        ck_assert(buf[0] == 'a' + i && buf[len - 1] == 'a' + i);
+        rv = fs_ops.getattr(path, sb);
+        ck_assert(sb->st_size == len && sb->st_blocks == 1);
+    }
+
+    // appending moves the data to a bigger slot
+    memset(buf, 'Z', len);
+    rv = fs_ops.write("/dir2/small.0", buf, len, len * 5, NULL);
+    ck_assert(rv == len);
+    rv = fs_ops.read("/dir2/small.0", buf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert(rv == len * 6);
+    ck_assert(buf[0] == 'a' && buf[len - 1] == 'a');
+    ck_assert(memcmp(buf + len, zeros, len * 4) == 0);
+    ck_assert(buf[len * 5] == 'Z' && buf[len * 6 - 1] == 'Z');
+
+    // truncating down and up again reads zeros
+    rv = fs_ops.truncate("/dir2/small.1", 10);
+    ck_assert(rv == 0);
+    rv = fs_ops.truncate("/dir2/small.1", len);
+    ck_assert(rv == 0);
+    rv = fs_ops.read("/dir2/small.1", buf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert(rv == len);
+    ck_assert(buf[9] == 'b' && memcmp(buf + 10, zeros, len - 10) == 0);
+
+    // growing past the threshold unpacks into a block of its own
+    memset(buf, 'Y', FS_BLOCK_SIZE);
+    rv = fs_ops.write("/dir2/small.2", buf, FS_BLOCK_SIZE - len, len, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE - len);
+    rv = fs_ops.getattr("/dir2/small.2", sb);
+    ck_assert(sb->st_size == FS_BLOCK_SIZE && sb->st_blocks == FS_BLOCK_SIZE / 512);
+    rv = fs_ops.read("/dir2/small.2", buf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE);
+    ck_assert(buf[len - 1] == 'c' && buf[len] == 'Y' && buf[FS_BLOCK_SIZE - 1] == 'Y');
+
+    // the tail block goes away with its last file
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/dir2/small.%d", i);
+        rv = fs_ops.unlink(path);
+        ck_assert(rv == 0);
+    }
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before);
+
+    free(st);
+    free(sb);
+    free(buf);
+    free(zeros);
+}
+END_TEST
+
+START_TEST(compress_test)
+{
+    char *path = "/dir3/log";
+    int size = FS_BLOCK_SIZE * 16;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    char *data = malloc(size);
+    char *buf = malloc(size);
+
+    for (int i = 0, n = 0; n < size; i++) {
+        n += snprintf(data + n, size - n, "%06d: nothing to report\n", i);
+    }
+    int rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    int flags = FS_COMPR_FL;
+    rv = fs_ops.ioctl(path, FS_IOC_SETFLAGS, NULL, NULL, 0, &flags);
+    ck_assert(rv == 0);
+    flags = 0;
+    rv = fs_ops.ioctl(path, FS_IOC_GETFLAGS, NULL, NULL, 0, &flags);
+    ck_assert(rv == 0 && flags == FS_COMPR_FL);
+
+    // text takes a fraction of the blocks, and reads back the same
+    for (int off = 0; off < size; off += 1000) {
+        int n = size - off < 1000 ? size - off : 1000;
+        rv = fs_ops.write(path, data + off, n, off, NULL);
+        ck_assert(rv == n);
+    }
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == size);
+    ck_assert(sb->st_blocks <= size / 512 / 2);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+
+    // overwriting part of a compressed cluster
+    memset(data + FS_BLOCK_SIZE * 5 + 10, '#', 100);
+    rv = fs_ops.write(path, data + FS_BLOCK_SIZE * 5 + 10, 100,
+                      FS_BLOCK_SIZE * 5 + 10, NULL);
+    ck_assert(rv == 100);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+
+    // truncating in the middle of a cluster
+    int len = FS_BLOCK_SIZE * 6 + 7;
+    rv = fs_ops.truncate(path, len);
+    ck_assert(rv == 0);
+    rv = fs_ops.truncate(path, size);
+    ck_assert(rv == 0);
+    memset(data + len, 0, size - len);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+
+    // incompressible data is stored raw
+    rv = fs_ops.truncate(path, 0);
+    ck_assert(rv == 0);
+    srand(5600);
+    for (int i = 0; i < size; i++) {
+        data[i] = rand();
+    }
+    rv = fs_ops.write(path, data, size, 0, NULL);
+    ck_assert(rv == size);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_blocks == size / 512);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before);
+
+    free(st);
+    free(sb);
+    free(data);
+    free(buf);
+}
+END_TEST
+
+START_TEST(dedup_test)
+{
+    int size = FS_BLOCK_SIZE * 8;
+    struct statvfs *st = malloc(sizeof(*st));
+    char *data = malloc(size);
+    char *buf = malloc(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = 'A' + (i / 100) % 26;
+    }
+    fs_dedup = 1;
+
+    int rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    rv = fs_ops.create("/dir2/orig", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write("/dir2/orig", data, size, 0, NULL);
+    ck_assert(rv == size);
+    rv = fs_ops.statfs("/", st);
+    int nfree_blks_orig = st->f_bfree;
+    ck_assert(nfree_blks_orig == nfree_blks_before - 9);
+
+    // a copy costs an inode (and the refcount table, the first time)
+    rv = fs_ops.create("/dir2/copy", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write("/dir2/copy", data, size, 0, NULL);
+    ck_assert(rv == size);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree >= nfree_blks_orig - 2);
+    int nfree_blks_table = nfree_blks_orig - 1 - st->f_bfree;
+
+    // writing to the copy leaves the original alone
+    memset(buf, '*', 10);
+    rv = fs_ops.write("/dir2/copy", buf, 10, FS_BLOCK_SIZE * 3 + 5, NULL);
+    ck_assert(rv == 10);
+    rv = fs_ops.truncate("/dir2/copy", FS_BLOCK_SIZE * 6 + 1);
+    ck_assert(rv == 0);
+    rv = fs_ops.read("/dir2/orig", buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+    rv = fs_ops.read("/dir2/copy", buf, size, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE * 6 + 1);
+    ck_assert(buf[FS_BLOCK_SIZE * 3 + 5] == '*' && buf[FS_BLOCK_SIZE * 3 + 14] == '*');
+    ck_assert(memcmp(buf, data, FS_BLOCK_SIZE * 3 + 5) == 0);
+
+    // blocks are freed with their last reference
+    rv = fs_ops.unlink("/dir2/orig");
+    ck_assert(rv == 0);
+    rv = fs_ops.read("/dir2/copy", buf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE && memcmp(buf, data, FS_BLOCK_SIZE) == 0);
+    rv = fs_ops.unlink("/dir2/copy");
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - nfree_blks_table);
+
+    fs_dedup = 0;
+    free(st);
+    free(data);
+    free(buf);
+}
+END_TEST
+
+START_TEST(clone_test)
+{
+    int size = FS_BLOCK_SIZE * 20;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    struct fs_clone_arg *arg = calloc(1, sizeof(*arg));
+    char *data = malloc(size);
+    char *buf = malloc(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = 'a' + i % 23;
+    }
+
+    int rv = fs_ops.create("/dir3/src", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write("/dir3/src", data, size, 0, NULL);
+    ck_assert(rv == size);
+    rv = fs_ops.create("/dir3/clone", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+
+    // cloning doesn't copy any blocks
+    strcpy(arg->src, "/dir3/src");
+    rv = fs_ops.ioctl("/dir3/clone", FS_IOC_CLONE_FROM, NULL, NULL, 0, arg);
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree >= nfree_blks_before - 1);
+    nfree_blks_before = st->f_bfree;
+    rv = fs_ops.getattr("/dir3/clone", sb);
+    ck_assert(sb->st_size == size);
+    rv = fs_ops.read("/dir3/clone", buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+
+    // a write copies just the block written
+    memset(buf, '!', 10);
+    rv = fs_ops.write("/dir3/clone", buf, 10, FS_BLOCK_SIZE * 7, NULL);
+    ck_assert(rv == 10);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 1);
+    rv = fs_ops.read("/dir3/src", buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+    rv = fs_ops.read("/dir3/clone", buf, size, 0, NULL);
+    ck_assert(buf[FS_BLOCK_SIZE * 7] == '!' && buf[FS_BLOCK_SIZE * 7 + 10] == data[FS_BLOCK_SIZE * 7 + 10]);
+
+    // can't clone a directory, or a missing file
+    strcpy(arg->src, "/dir3");
+    rv = fs_ops.ioctl("/dir3/clone", FS_IOC_CLONE_FROM, NULL, NULL, 0, arg);
+    ck_assert(rv == -EISDIR);
+    strcpy(arg->src, "/dir3/nothing");
+    rv = fs_ops.ioctl("/dir3/clone", FS_IOC_CLONE_FROM, NULL, NULL, 0, arg);
+    ck_assert(rv == -ENOENT);
+
+    // the shared blocks go with the second file
+    rv = fs_ops.unlink("/dir3/src");
+    ck_assert(rv == 0);
+    rv = fs_ops.read("/dir3/clone", buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, FS_BLOCK_SIZE * 7) == 0);
+    rv = fs_ops.unlink("/dir3/clone");
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before + size / FS_BLOCK_SIZE + 2);
+
+    free(st);
+    free(sb);
+    free(arg);
+    free(data);
+    free(buf);
+}
+END_TEST
+
+START_TEST(snapshot_test)
+{
+    int size = FS_BLOCK_SIZE * 10;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    char *data = malloc(size);
+    char *buf = malloc(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = 'a' + i % 19;
+    }
+    int rv = fs_ops.statfs("/", st);
+    int nfree_blks_base = st->f_bfree;
+
+    rv = fs_ops.create("/dir3/snapped", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write("/dir3/snapped", data, size, 0, NULL);
+    ck_assert(rv == size);
+    rv = fs_ops.create("/dir3/small", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write("/dir3/small", data, 100, 0, NULL);
+    ck_assert(rv == 100);
+
+    // taking a snapshot costs one block
+    rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    rv = fs_ops.mkdir("/.snapshots/snap1", 0777);
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 1);
+    rv = fs_ops.mkdir("/.snapshots/snap1", 0777);
+    ck_assert(rv == -EEXIST);
+
+    rv = fs_ops.getattr("/.snapshots", sb);
+    ck_assert(rv == 0 && S_ISDIR(sb->st_mode));
+    struct dir_entry table[] = {{"snap1", 0}, {NULL}};
+    rv = fs_ops.readdir("/.snapshots", table, test_filler, 0, NULL);
+    ck_assert(rv == 0 && table[0].seen);
+
+    // changes to the live tree don't show in the snapshot
+    memset(buf, '!', 10);
+    rv = fs_ops.write("/dir3/snapped", buf, 10, FS_BLOCK_SIZE * 3, NULL);
+    ck_assert(rv == 10);
+    rv = fs_ops.unlink("/dir3/small");
+    ck_assert(rv == 0);
+    rv = fs_ops.read("/dir3/snapped", buf, size, 0, NULL);
+    ck_assert(rv == size && buf[FS_BLOCK_SIZE * 3] == '!');
+    rv = fs_ops.read("/.snapshots/snap1/dir3/snapped", buf, size, 0, NULL);
+    ck_assert(rv == size && memcmp(buf, data, size) == 0);
+    rv = fs_ops.read("/.snapshots/snap1/dir3/small", buf, size, 0, NULL);
+    ck_assert(rv == 100 && memcmp(buf, data, 100) == 0);
+    rv = fs_ops.getattr("/dir3/small", sb);
+    ck_assert(rv == -ENOENT);
+
+    // the snapshot is read-only
+    rv = fs_ops.write("/.snapshots/snap1/dir3/snapped", buf, 10, 0, NULL);
+    ck_assert(rv == -EROFS);
+    rv = fs_ops.unlink("/.snapshots/snap1/dir3/snapped");
+    ck_assert(rv == -EROFS);
+    rv = fs_ops.create("/.snapshots/snap1/dir3/new", S_IFREG | 0777, NULL);
+    ck_assert(rv == -EROFS);
+    rv = fs_ops.chmod("/.snapshots/snap1/dir3", 0700);
+    ck_assert(rv == -EROFS);
+
+    // operations that fail don't copy anything out of it
+    rv = fs_ops.statfs("/", st);
+    nfree_blks_before = st->f_bfree;
+    rv = fs_ops.create("/dir3/subdir/file.12k", S_IFREG | 0777, NULL);
+    ck_assert(rv == -EEXIST);
+    rv = fs_ops.mkdir("/dir3/subdir/file.12k", 0777);
+    ck_assert(rv == -EEXIST);
+    rv = fs_ops.unlink("/dir3/subdir/nothing");
+    ck_assert(rv == -ENOENT);
+    rv = fs_ops.rmdir("/dir3/subdir/file.12k");
+    ck_assert(rv == -ENOTDIR);
+    rv = fs_ops.rename("/dir3/subdir/nothing", "/dir3/subdir/new");
+    ck_assert(rv == -ENOENT);
+    rv = fs_ops.rename("/dir3/subdir/file.12k", "/dir3/new");
     ck_assert(rv == -EINVAL);
+    struct fs_clone_arg arg = {.src = "/dir3/nothing"};
+    rv = fs_ops.ioctl("/dir3/subdir/file.12k", FS_IOC_CLONE_FROM, NULL, NULL, 0, &arg);
+    ck_assert(rv == -ENOENT);
+    strcpy(arg.src, "/dir3");
+    rv = fs_ops.ioctl("/dir3/subdir/file.12k", FS_IOC_CLONE_FROM, NULL, NULL, 0, &arg);
+    ck_assert(rv == -EISDIR);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before);
+
+    // deleting it frees the blocks nothing else uses
+    rv = fs_ops.unlink("/dir3/snapped");
+    ck_assert(rv == 0);
+    rv = fs_ops.rmdir("/.snapshots/snap1");
+    ck_assert(rv == 0);
+    rv = fs_ops.getattr("/.snapshots/snap1", sb);
+    ck_assert(rv == -ENOENT);
+    rv = fs_ops.getattr("/dir3/subdir/file.12k", sb);
+    ck_assert(rv == 0 && sb->st_size == 12 * 1024);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_base);
+
+    free(st);
+    free(sb);
+    free(data);
+    free(buf);
+}
+END_TEST
+
+START_TEST(checkpoint_test)
+{
+    struct fs_super *sb = malloc(sizeof(*sb));
+    char *buf = malloc(FS_BLOCK_SIZE);
+    uint32_t gen1, gen2;
+    memset(buf, 'c', FS_BLOCK_SIZE);
+
+    int rv = fs_ops.ioctl("/", FS_IOC_CHECKPOINT, NULL, NULL, 0, &gen1);
+    ck_assert(rv == 0);
+    rv = fs_ops.ioctl("/", FS_IOC_CHECKPOINT, NULL, NULL, 0, &gen2);
+    ck_assert(rv == 0 && gen2 == gen1 + 1);
+    block_read(sb, 0, 1);
+    ck_assert(sb->gen == gen2);
+    for (int g = 0; g < DIV_ROUND_UP(sb->disk_size, FS_GROUP_SIZE); g++) {
+        ck_assert(sb->group_gen[g] < gen2);
+    }
+
+    // a write marks its group with the new generation
+    rv = fs_ops.create("/dir3/tracked", S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write("/dir3/tracked", buf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE);
+    uint64_t idx = 0;
+    rv = fs_ops.bmap("/dir3/tracked", FS_BLOCK_SIZE, &idx);
+    ck_assert(rv == 0 && idx != 0);
+    block_read(sb, 0, 1);
+    ck_assert(sb->group_gen[idx / FS_GROUP_SIZE] == gen2);
+
+    rv = fs_ops.unlink("/dir3/tracked");
+    ck_assert(rv == 0);
+    free(sb);
+    free(buf);
+}
+END_TEST
+
+START_TEST(truncate_len_test)
+{
+    char *path = "/dir3/trunc";
+    int size = FS_BLOCK_SIZE * 3;
+    int len = FS_BLOCK_SIZE + 100;
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+    char *buf = malloc(size);
+    char *read_buf = malloc(size);
+    char *zeros = calloc(size, 1);
+    memset(buf, 'W', size);
+
+    int rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    rv = fs_ops.write(path, buf, size, 0, NULL);
+    ck_assert(rv == size);
+
+    // shrink to the middle of block 1 - block 2 is freed
+    rv = fs_ops.truncate(path, len);
+    ck_assert(rv == 0);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == len);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 2);
+    rv = fs_ops.read(path, read_buf, size, 0, NULL);
+    ck_assert(rv == len);
+    ck_assert(memcmp(read_buf, buf, len) == 0);
+
+    // grow again - the old data past 'len' must not come back
+    rv = fs_ops.ftruncate(path, size, NULL);
+    ck_assert(rv == 0);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(sb->st_size == size);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before - 2);
+    rv = fs_ops.read(path, read_buf, size, 0, NULL);
+    ck_assert(rv == size);
+    ck_assert(memcmp(read_buf, buf, len) == 0);
+    ck_assert(memcmp(read_buf + len, zeros, size - len) == 0);
+
+    rv = fs_ops.truncate("/dir3", 0);
+    ck_assert(rv == -EISDIR);
+
+    rv = fs_ops.truncate(path, 0);
+    ck_assert(rv == 0);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before);
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+
+    free(st);
+    free(sb);
+    free(buf);
+    free(read_buf);
+    free(zeros);
+}
+END_TEST
+
+START_TEST(discard_test)
+{
+    char *path = "/dir2/discard";
+    int size = FS_BLOCK_SIZE * 16;     // small enough to be freed at once
+    char *buf = malloc(size);
+    memset(buf, 'D', size);
+    struct stat img;
+
+    fs_discard = 1;
+    int rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write(path, buf, size, 0, NULL);
+    ck_assert(rv == size);
+    stat("test2.img", &img);
+    blkcnt_t before = img.st_blocks;
+
+    // unlink punches the file's blocks out of the image
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+    stat("test2.img", &img);
+    ck_assert(img.st_blocks <= before - size / 512);
+
+    // FITRIM discards all the free space
+    struct fstrim_range range = {0, ~0ULL, 0};
+    rv = fs_ops.ioctl("/", FITRIM, NULL, NULL, 0, &range);
+    ck_assert(rv == 0);
+    ck_assert(range.len > 0);
+    struct statvfs *st = malloc(sizeof(*st));
+    fs_ops.statfs("/", st);
+    ck_assert(range.len == (uint64_t)st->f_bfree * FS_BLOCK_SIZE);
+    fs_discard = 0;
+
+    free(st);
+    free(buf);
+}
+END_TEST
+
+START_TEST(checksum_test)
+{
+    char *path = "/dir2/checked";
+    char *buf = malloc(FS_BLOCK_SIZE * 4);
+    memset(buf, 'K', FS_BLOCK_SIZE * 4);
+
+    // remount with checksums turned on
+    fs_ops.destroy(NULL);
+    fs_checksum = 1;
+    fs_ops.init(NULL);
+    fs_checksum = 0;
 
+    int rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write(path, buf, FS_BLOCK_SIZE * 4, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE * 4);
+    rv = fs_ops.read("/dir3/subdir/file.12k", buf, 12 * 1024, 0, NULL);
+    ck_assert(rv == 12 * 1024);
+
+    // the table is found again at the next mount
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE * 4, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE * 4 && buf[FS_BLOCK_SIZE * 3] == 'K');
+
+    // flip a byte behind the file system's back
+    uint64_t idx = 2;
+    rv = fs_ops.bmap(path, FS_BLOCK_SIZE, &idx);
+    ck_assert(rv == 0 && idx != 0);
+    int fd = open("test2.img", O_RDWR);
+    char c;
+    pread(fd, &c, 1, idx * FS_BLOCK_SIZE + 100);
+    c ^= 1;
+    pwrite(fd, &c, 1, idx * FS_BLOCK_SIZE + 100);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE * 4, 0, NULL);
+    ck_assert(rv == -EIO);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE);
+
+    // rewriting the block fixes it
+    memset(buf, 'K', FS_BLOCK_SIZE);
+    rv = fs_ops.write(path, buf, FS_BLOCK_SIZE, FS_BLOCK_SIZE * 2, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE * 4, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE * 4);
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+
+    close(fd);
+    free(buf);
+}
+END_TEST
+
+/* a crash between writing a block and its checksum leaves the table
+ * wrong; the next (unclean) mount recomputes it
+ */
+START_TEST(checksum_crash_test)
+{
+    char *path = "/dir2/crashed";
+    char *buf = malloc(FS_BLOCK_SIZE * 2);
+    struct fs_super *sb = malloc(sizeof(*sb));
+    memset(buf, 'C', FS_BLOCK_SIZE * 2);
+
+    fs_ops.destroy(NULL);
+    fs_checksum = 1;
+    fs_ops.init(NULL);
+    fs_checksum = 0;
+
+    int rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write(path, buf, FS_BLOCK_SIZE * 2, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE * 2);
+    uint64_t idx = 1;
+    rv = fs_ops.bmap(path, FS_BLOCK_SIZE, &idx);
+    ck_assert(rv == 0 && idx != 0);
+    fs_ops.destroy(NULL);
+
+    // as if the second block was rewritten but not its checksum, and
+    // the image never unmounted
+    int fd = open("test2.img", O_RDWR);
+    char c = 'D';
+    pwrite(fd, &c, 1, idx * FS_BLOCK_SIZE);
+    pread(fd, sb, FS_BLOCK_SIZE, 0);
+    sb->state = 0;
+    pwrite(fd, sb, FS_BLOCK_SIZE, 0);
+    close(fd);
+
+    fs_ops.init(NULL);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE * 2, 0, NULL);
+    ck_assert(rv == FS_BLOCK_SIZE * 2 && buf[0] == 'C' && buf[FS_BLOCK_SIZE] == 'D');
+
+    // a clean mount still catches the same change
+    fs_ops.destroy(NULL);
+    fd = open("test2.img", O_RDWR);
+    c = 'E';
+    pwrite(fd, &c, 1, idx * FS_BLOCK_SIZE);
+    close(fd);
+    fs_ops.init(NULL);
+    rv = fs_ops.read(path, buf, FS_BLOCK_SIZE * 2, 0, NULL);
+    ck_assert(rv == -EIO);
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+
+    free(sb);
+    free(buf);
+}
+END_TEST
+
+START_TEST(writeback_test)
+{
+    char *path = "/dir2/cached";
+    int size = FS_BLOCK_SIZE * 8;
+    char *buf = malloc(size), *disk = malloc(FS_BLOCK_SIZE);
+    memset(buf, 'W', size);
+
+    fs_ops.destroy(NULL);
+    fs_writeback = 1;
+    fs_ops.init(NULL);
+
+    int rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write(path, buf, size, 0, NULL);
+    ck_assert(rv == size);
+    memset(buf, 0, size);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size && buf[0] == 'W' && buf[size-1] == 'W');
+
+    // after fsync the data is in the image file itself
+    rv = fs_ops.fsync(path, 0, NULL);
+    ck_assert(rv == 0);
+    uint64_t idx = 7;
+    rv = fs_ops.bmap(path, FS_BLOCK_SIZE, &idx);
+    ck_assert(rv == 0 && idx != 0);
+    int fd = open("test2.img", O_RDONLY);
+    rv = pread(fd, disk, FS_BLOCK_SIZE, idx * FS_BLOCK_SIZE);
+    ck_assert(rv == FS_BLOCK_SIZE && disk[0] == 'W' && disk[FS_BLOCK_SIZE-1] == 'W');
+    close(fd);
+
+    // and everything else is there after unmount
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+    fs_ops.destroy(NULL);
+    fs_writeback = 0;
+    fs_ops.init(NULL);
+    struct stat sb;
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert(rv == -ENOENT);
+
+    free(buf);
+    free(disk);
+}
+END_TEST
+
+/* a write-back write that fails is kept and reported by fsync; the
+ * file size limit makes the flusher's pwrite past block 4 fail
+ */
+START_TEST(writeback_error_test)
+{
+    char *path = "/dir2/unwritten";
+    int size = FS_BLOCK_SIZE * 4;
+    char *buf = malloc(size);
+    memset(buf, 'E', size);
+
+    fs_ops.destroy(NULL);
+    fs_writeback = 1;
+    fs_ops.init(NULL);
+
+    struct rlimit old, lim;
+    getrlimit(RLIMIT_FSIZE, &old);
+    lim = old;
+    lim.rlim_cur = FS_BLOCK_SIZE * 4;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &lim);
+
+    // no ck_assert until the limit is lifted, as check may write a file
+    int rv1 = fs_ops.create(path, S_IFREG | 0777, NULL);
+    int rv2 = fs_ops.write(path, buf, size, 0, NULL);
+    int rv3 = fs_ops.fsync(path, 0, NULL);
+
+    setrlimit(RLIMIT_FSIZE, &old);
+    signal(SIGXFSZ, SIG_DFL);
+    ck_assert(rv1 >= 0 && rv2 == size);
+    ck_assert_int_eq(rv3, -EIO);
+
+    // the blocks are still cached, and go out now
+    int rv = fs_ops.fsync(path, 0, NULL);
+    ck_assert_int_eq(rv, 0);
+
+    fs_ops.destroy(NULL);
+    fs_writeback = 0;
+    fs_ops.init(NULL);
+    memset(buf, 0, size);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size && buf[0] == 'E' && buf[size-1] == 'E');
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+
+    // blocks still failing at unmount are reported by fs5600_close
+    system("python gen-disk.py -q disk1.in wb.img");
+    struct fs5600_opts wb = {.writeback = 1};
+    struct fs5600 *fs = fs5600_open("wb.img", &wb);
+    ck_assert(fs != NULL);
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &lim);
+    rv1 = fs5600_create(fs, "/unwritten", S_IFREG | 0777);
+    rv2 = fs5600_write(fs, "/unwritten", buf, size, 0);
+    rv3 = fs5600_close(fs);
+    setrlimit(RLIMIT_FSIZE, &old);
+    signal(SIGXFSZ, SIG_DFL);
+    ck_assert(rv1 == 0 && rv2 == size);
+    ck_assert_int_eq(rv3, -EIO);
+    unlink("wb.img");
+
+    free(buf);
+}
+END_TEST
+
+/* reads whole disk, as a maintenance task would
+ */
+static void *maint_reader(void *arg)
+{
+    char *buf = malloc(FS_BLOCK_SIZE * 16);
+    block_io_class(IO_MAINT);
+    for (int pass = 0; pass < 20; pass++)
+        for (int i = 0; i < 256; i += 16)
+            block_read(buf, i, 16);
+    free(buf);
+    return NULL;
+}
+
+START_TEST(io_class_test)
+{
+    char *buf = malloc(12 * 1024);
+    pthread_t t[2];
+    for (int i = 0; i < 2; i++)
+        pthread_create(&t[i], NULL, maint_reader, NULL);
+
+    // foreground reads still get through, and see the right data
+    for (int i = 0; i < 100; i++) {
+        memset(buf, 0, 12 * 1024);
+        int rv = fs_ops.read("/dir3/subdir/file.12k", buf, 12 * 1024, 0, NULL);
+        ck_assert(rv == 12 * 1024);
+        unsigned cksum = crc32(0, (unsigned char *)buf, 12 * 1024);
+        ck_assert(cksum == 3243963207U);
+    }
+    for (int i = 0; i < 2; i++)
+        pthread_join(t[i], NULL);
+    free(buf);
+}
+END_TEST
+
+START_TEST(warm_test)
+{
+    char *path = "/dir3/subdir/file.12k";
+    char *buf = malloc(12 * 1024);
+
+    fs_ops.destroy(NULL);
+    unlink("test2.img.hot");
+    fs_warm = 1;
+    fs_ops.init(NULL);
+    for (int i = 0; i < 10; i++) {
+        int rv = fs_ops.read(path, buf, 12 * 1024, 0, NULL);
+        ck_assert(rv == 12 * 1024);
+    }
+    fs_ops.destroy(NULL);
+
+    // the file's blocks are on the list saved at unmount
+    uint64_t idx = 1;
+    FILE *fp = fopen("test2.img.hot", "r");
+    ck_assert(fp != NULL);
+    char magic[8];
+    uint32_t n, list[8192];
+    ck_assert(fread(magic, 8, 1, fp) == 1 && memcmp(magic, "5600HOT1", 8) == 0);
+    ck_assert(fread(&n, sizeof(n), 1, fp) == 1 && n > 0 && n <= 8192);
+    ck_assert(fread(list, sizeof(uint32_t), n, fp) == n);
+    fclose(fp);
+
+    // and are read in at the next mount, while we carry on
+    fs_ops.init(NULL);
+    int rv = fs_ops.bmap(path, FS_BLOCK_SIZE, &idx);
+    ck_assert(rv == 0 && idx != 0);
+    int found = 0;
+    for (int i = 0; i < n; i++)
+        found |= (list[i] == idx);
+    ck_assert(found);
+    rv = fs_ops.read(path, buf, 12 * 1024, 0, NULL);
+    ck_assert(rv == 12 * 1024);
+    unsigned cksum = crc32(0, (unsigned char *)buf, 12 * 1024);
+    ck_assert(cksum == 3243963207U);
+
+    fs_ops.destroy(NULL);
+    fs_warm = 0;
+    fs_ops.init(NULL);
+    unlink("test2.img.hot");
+    free(buf);
+}
+END_TEST
+
+START_TEST(clean_mount_test)
+{
+    struct statvfs st1, st2;
+    struct fs_super *sb = malloc(sizeof(*sb));
+    int rv = fs_ops.statfs("/", &st1);
+    ck_assert(rv == 0);
+
+    // unmount marks the image clean and saves the free counts...
+    fs_ops.destroy(NULL);
+    block_read(sb, 0, 1);
+    ck_assert(sb->state == FS_STATE_CLEAN);
+    int nfree = 0;
+    for (int g = 0; g < DIV_ROUND_UP(sb->disk_size, FS_GROUP_SIZE); g++)
+        nfree += sb->group_free[g];
+    ck_assert(nfree == st1.f_bfree);
+
+    // ...which mount uses, marking it in use again
+    fs_ops.init(NULL);
+    block_read(sb, 0, 1);
+    ck_assert(sb->state != FS_STATE_CLEAN);
+    rv = fs_ops.statfs("/", &st2);
+    ck_assert(rv == 0 && st2.f_bfree == st1.f_bfree);
+
+    // an unclean image is counted from the bitmap
+    fs_ops.destroy(NULL);
+    block_read(sb, 0, 1);
+    sb->state = 0;
+    sb->group_free[0] = 0;
+    int fd = open("test2.img", O_RDWR);
+    pwrite(fd, sb, FS_BLOCK_SIZE, 0);
+    close(fd);
+    fs_ops.init(NULL);
+    rv = fs_ops.statfs("/", &st2);
+    ck_assert(rv == 0 && st2.f_bfree == st1.f_bfree);
+    free(sb);
+}
+END_TEST
+
+/* library API: two images open at once, written from a thread each,
+ * alongside the FUSE instance
+ */
+struct lib_job {
+    struct fs5600 *fs;
+    char fill;
+    int rv;
+};
+
+void *lib_writer(void *arg)
+{
+    struct lib_job *job = arg;
+    int len = 20 * FS_BLOCK_SIZE;
+    char *buf = malloc(len);
+    memset(buf, job->fill, len);
+    job->rv = fs5600_create(job->fs, "/libfile", S_IFREG | 0644);
+    for (int i = 0; i < 20 && job->rv == 0; i++)
+        if (fs5600_write(job->fs, "/libfile", buf + i * FS_BLOCK_SIZE,
+                         FS_BLOCK_SIZE, i * FS_BLOCK_SIZE) != FS_BLOCK_SIZE)
+            job->rv = -1;
+    if (job->rv == 0)
+        job->rv = fs5600_fsync(job->fs);
+    free(buf);
+    return NULL;
+}
+
+int lib_check(struct fs5600 *fs, char fill)
+{
+    int len = 20 * FS_BLOCK_SIZE, ok = 1;
+    char *buf = malloc(len);
+    if (fs5600_read(fs, "/libfile", buf, len, 0) != len)
+        ok = 0;
+    for (int i = 0; i < len && ok; i++)
+        if (buf[i] != fill)
+            ok = 0;
+    free(buf);
+    return ok;
+}
+
+START_TEST(library_test)
+{
+    system("python gen-disk.py -q disk1.in lib1.img");
+    system("python gen-disk.py -q disk1.in lib2.img");
+    struct fs5600_opts wb = {.writeback = 1};
+    struct fs5600 *fs1 = fs5600_open("lib1.img", NULL);
+    struct fs5600 *fs2 = fs5600_open("lib2.img", &wb);
+    ck_assert(fs1 != NULL && fs2 != NULL);
+    ck_assert(fs5600_open("no-such.img", NULL) == NULL && errno == ENOENT);
+
+    struct lib_job jobs[2] = {{fs1, 'A'}, {fs2, 'B'}};
+    pthread_t t[2];
+    for (int i = 0; i < 2; i++)
+        pthread_create(&t[i], NULL, lib_writer, &jobs[i]);
+    for (int i = 0; i < 2; i++)
+        pthread_join(t[i], NULL);
+    ck_assert(jobs[0].rv == 0 && jobs[1].rv == 0);
+
+    // each image has its own file, and the FUSE one has neither
+    struct stat sb;
+    ck_assert(lib_check(fs1, 'A') && lib_check(fs2, 'B'));
+    ck_assert(fs_ops.getattr("/libfile", &sb) == -ENOENT);
+    struct statvfs st1, st2;
+    fs5600_statfs(fs1, &st1);
+    fs5600_statfs(fs2, &st2);
+    ck_assert(st1.f_bfree == st2.f_bfree);
+
+    fs5600_close(fs1);
+    fs5600_close(fs2);
+    fs1 = fs5600_open("lib1.img", NULL);
+    fs2 = fs5600_open("lib2.img", NULL);
+    ck_assert(lib_check(fs1, 'A') && lib_check(fs2, 'B'));
+    ck_assert(fs5600_unlink(fs1, "/libfile") == 0);
+    ck_assert(fs5600_getattr(fs1, "/libfile", &sb) == -ENOENT);
+    ck_assert(fs5600_getattr(fs2, "/libfile", &sb) == 0);
+    fs5600_close(fs1);
+    fs5600_close(fs2);
+    unlink("lib1.img");
+    unlink("lib2.img");
+}
+END_TEST
+
+/* only one mount may have an image: the FUSE instance has test2.img
+ * locked, so the library (or the LD_PRELOAD client) can't open it
+ */
+START_TEST(image_lock_test)
+{
+    errno = 0;
+    ck_assert(fs5600_open("test2.img", NULL) == NULL && errno == EBUSY);
+    struct fs5600 *fs = fs5600_open("lib1.img", NULL);
+    ck_assert(fs == NULL && errno == ENOENT);
+    system("python gen-disk.py -q disk1.in lib1.img");
+    fs = fs5600_open("lib1.img", NULL);
+    ck_assert(fs != NULL);
+    ck_assert(fs5600_open("lib1.img", NULL) == NULL && errno == EBUSY);
+    fs5600_close(fs);
+    fs = fs5600_open("lib1.img", NULL);
+    ck_assert(fs != NULL);
+    fs5600_close(fs);
+    unlink("lib1.img");
+}
+END_TEST
+
+/* an image from before the block size was recorded is used if its
+ * inodes have nothing where the tail fields now are, and refused if
+ * they do
+ */
+START_TEST(old_format_test)
+{
+    system("python gen-disk.py -q disk1.in old.img");
+    struct fs_super *sb = malloc(sizeof(*sb));
+    struct fs_inode *root = malloc(sizeof(*root));
+    int fd = open("old.img", O_RDWR);
+    pread(fd, sb, FS_BLOCK_SIZE, 0);
+    sb->block_size = 0;
+    pwrite(fd, sb, FS_BLOCK_SIZE, 0);
+    pread(fd, root, FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE);
+    root->tail_blk = 100;       // i.e. a block pointer
+    pwrite(fd, root, FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE);
+
+    errno = 0;
+    ck_assert(fs5600_open("old.img", NULL) == NULL && errno == EINVAL);
+
+    root->tail_blk = 0;
+    pwrite(fd, root, FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE);
+    struct fs5600 *fs = fs5600_open("old.img", NULL);
+    ck_assert(fs != NULL);
+    char buf[12288];
+    int rv = fs5600_read(fs, "/dir3/subdir/file.12k", buf, sizeof(buf), 0);
+    ck_assert(rv == 12288 && crc32(0, (void *)buf, rv) == 3243963207U);
+    fs5600_close(fs);
+    pread(fd, sb, FS_BLOCK_SIZE, 0);
+    ck_assert(sb->block_size == FS_BLOCK_SIZE);
+
+    close(fd);
+    free(root);
+    free(sb);
+    unlink("old.img");
+}
+END_TEST
+
+/* striping: 3 members, 4-block stripes. Files made by gen-disk.py read
+ * back the same, and a large file's blocks are spread over all three
+ */
+START_TEST(stripe_test)
+{
+    system("python gen-disk.py -q -s 3:4 disk1.in stripe.img");
+    struct fs5600 *fs = fs5600_open("stripe.img", NULL);
+    ck_assert(fs != NULL);
+    char *buf = malloc(300 * FS_BLOCK_SIZE), *buf2 = malloc(300 * FS_BLOCK_SIZE);
+    int rv = fs5600_read(fs, "/dir3/subdir/file.12k", buf, 12288, 0);
+    ck_assert(rv == 12288 && crc32(0, (void *)buf, rv) == 3243963207U);
+
+    for (int i = 0; i < 300 * FS_BLOCK_SIZE; i++)
+        buf[i] = i / FS_BLOCK_SIZE + i % 97;
+    ck_assert(fs5600_create(fs, "/striped", S_IFREG | 0644) == 0);
+    ck_assert(fs5600_write(fs, "/striped", buf, 300 * FS_BLOCK_SIZE, 0) ==
+              300 * FS_BLOCK_SIZE);
+    fs5600_close(fs);
+
+    fs = fs5600_open("stripe.img", NULL);
+    ck_assert(fs != NULL);
+    ck_assert(fs5600_read(fs, "/striped", buf2, 300 * FS_BLOCK_SIZE, 0) ==
+              300 * FS_BLOCK_SIZE);
+    ck_assert(memcmp(buf, buf2, 300 * FS_BLOCK_SIZE) == 0);
+    fs5600_close(fs);
+
+    // the members have about a third of the file each
+    char *names[] = {"stripe.img", "stripe-1.img", "stripe-2.img"};
+    for (int m = 0; m < 3; m++) {
+        struct stat sb;
+        ck_assert(stat(names[m], &sb) == 0);
+        ck_assert(sb.st_size >= 100 * FS_BLOCK_SIZE);
+        unlink(names[m]);
+    }
+    free(buf);
+    free(buf2);
+}
+END_TEST
+
+/* is there a block of all 'c' in one of the fast tier's slots? */
+static int in_fast_tier(char c)
+{
+    struct stat sb;
+    stat("tier-fast.img", &sb);
+    char *data = malloc(sb.st_size), blk[FS_BLOCK_SIZE];
+    int fd = open("tier-fast.img", O_RDONLY), found = 0;
+    int n = read(fd, data, sb.st_size);
+    close(fd);
+    memset(blk, c, FS_BLOCK_SIZE);
+    for (int i = 0; i + FS_BLOCK_SIZE <= n && !found; i += FS_BLOCK_SIZE)
+        found = memcmp(data + i, blk, FS_BLOCK_SIZE) == 0;
+    free(data);
+    return found;
+}
+
+/* tiering: metadata starts out on the fast tier, a file that's read
+ * over and over moves up to it, and where everything is survives a
+ * remount
+ */
+START_TEST(tier_test)
+{
+    system("python gen-disk.py -q -t tier-fast.img:64 disk1.in tier.img");
+    struct fs5600 *fs = fs5600_open("tier.img", NULL);
+    ck_assert(fs != NULL);
+    char *buf = malloc(16 * FS_BLOCK_SIZE), *buf2 = malloc(16 * FS_BLOCK_SIZE);
+    int rv = fs5600_read(fs, "/dir3/subdir/file.12k", buf, 12288, 0);
+    ck_assert(rv == 12288 && crc32(0, (void *)buf, rv) == 3243963207U);
+
+    memset(buf, 'T', 16 * FS_BLOCK_SIZE);
+    ck_assert(fs5600_create(fs, "/hot", S_IFREG | 0644) == 0);
+    ck_assert(fs5600_write(fs, "/hot", buf, 16 * FS_BLOCK_SIZE, 0) == 16 * FS_BLOCK_SIZE);
+    ck_assert(!in_fast_tier('T'));
+    int i;
+    for (i = 0; i < 30 && !in_fast_tier('T'); i++) {
+        fs5600_read(fs, "/hot", buf2, 16 * FS_BLOCK_SIZE, 0);
+        usleep(100000);
+    }
+    ck_assert(i < 30);
+    fs5600_close(fs);
+
+    fs = fs5600_open("tier.img", NULL);
+    ck_assert(fs != NULL);
+    ck_assert(fs5600_read(fs, "/hot", buf2, 16 * FS_BLOCK_SIZE, 0) == 16 * FS_BLOCK_SIZE);
+    ck_assert(memcmp(buf, buf2, 16 * FS_BLOCK_SIZE) == 0);
+    rv = fs5600_read(fs, "/dir3/subdir/file.12k", buf, 12288, 0);
+    ck_assert(rv == 12288 && crc32(0, (void *)buf, rv) == 3243963207U);
+    fs5600_close(fs);
+    unlink("tier.img");
+    unlink("tier-fast.img");
+    free(buf);
+    free(buf2);
+}
+END_TEST
+
+/* the LD_PRELOAD client, loaded with dlopen and called directly: reads
+ * under the prefix come from the image, and a forked child can use
+ * and close a descriptor it inherited, which is just /dev/null to it
+ */
+START_TEST(preload_test)
+{
+    system("python gen-disk.py -q disk1.in preload.img");
+    setenv("FS5600_IMAGE", "preload.img", 1);
+    setenv("FS5600_PREFIX", "/pl", 1);
+    void *h = dlopen("./libfs5600-preload.so", RTLD_NOW | RTLD_LOCAL);
+    ck_assert(h != NULL);
+    int (*p_open)(const char *, int, ...) = dlsym(h, "open");
+    int (*p_close)(int) = dlsym(h, "close");
+    ssize_t (*p_read)(int, void *, size_t) = dlsym(h, "read");
+
+    char buf[12288];
+    int fd = p_open("/pl/dir3/subdir/file.12k", O_RDONLY);
+    ck_assert(fd >= 0);
+    ck_assert(p_read(fd, buf, 6000) == 6000);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        _exit(p_read(fd, &c, 1) == 0 && p_close(fd) == 0 ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // the parent's is still the file, at the same offset
+    ck_assert(p_read(fd, buf + 6000, 6288) == 6288);
+    ck_assert(crc32(0, (void *)buf, 12288) == 3243963207U);
+    ck_assert(p_close(fd) == 0);
+    unlink("preload.img");
+}
+END_TEST
+
+START_TEST(unlink_large_test)
+{
+    char *path = "/dir3/large";
+    int size = FS_BLOCK_SIZE * 100;
+    char *buf = malloc(size);
+    memset(buf, 'L', size);
+    struct statvfs *st = malloc(sizeof(*st));
+    struct stat *sb = malloc(sizeof(*sb));
+
+    int rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+    rv = fs_ops.create(path, S_IFREG | 0777, NULL);
+    ck_assert(rv >= 0);
+    rv = fs_ops.write(path, buf, size, 0, NULL);
+    ck_assert(rv == size);
+
+    // the name goes away at once, the blocks in the background
+    rv = fs_ops.unlink(path);
+    ck_assert(rv == 0);
+    rv = fs_ops.getattr(path, sb);
+    ck_assert(rv == -ENOENT);
+    for (int i = 0; i < 500; i++) {
+        fs_ops.statfs("/", st);
+        if (st->f_bfree == nfree_blks_before) break;
+        usleep(10000);
+    }
+    ck_assert(st->f_bfree == nfree_blks_before);
+
+    free(buf);
     free(st);
+    free(sb);
+}
+END_TEST
+
+START_TEST(defrag_test)
+{
+    char *path = "/file.8k+";   // blocks 65, 363, 326 in disk1.in
+    int size = 8195;
+    char *buf = malloc(size);
+    struct statvfs *st = malloc(sizeof(*st));
 
+    int rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size);
+    unsigned cksum_before = crc32(0, (unsigned char *)buf, size);
+    rv = fs_ops.statfs("/", st);
+    int nfree_blks_before = st->f_bfree;
+
+    rv = fs_ops.ioctl(path, FS_IOC_DEFRAG, NULL, NULL, 0, NULL);
+    ck_assert(rv == 0);
+    uint64_t first = 0;
+    fs_ops.bmap(path, FS_BLOCK_SIZE, &first);
+    for (uint64_t i = 1; i < 3; i++) {
+        uint64_t blk = i;
+        fs_ops.bmap(path, FS_BLOCK_SIZE, &blk);
+        ck_assert(blk == first + i);
+    }
+
+    // same contents, same space used
+    memset(buf, 'R', size);
+    rv = fs_ops.read(path, buf, size, 0, NULL);
+    ck_assert(rv == size);
+    ck_assert(crc32(0, (unsigned char *)buf, size) == cksum_before);
+    rv = fs_ops.statfs("/", st);
+    ck_assert(st->f_bfree == nfree_blks_before);
+
+    // already contiguous - nothing to do
+    rv = fs_ops.ioctl(path, FS_IOC_DEFRAG, NULL, NULL, 0, NULL);
+    ck_assert(rv == 0);
+    uint64_t again = 0;
+    fs_ops.bmap(path, FS_BLOCK_SIZE, &again);
+    ck_assert(again == first);
+
+    free(buf);
+    free(st);
 }
 END_TEST
 
+/* a clone of a compressed file, rewritten with the disk full: the
+ * write fails and the block it shares is still shared
+ */
+START_TEST(compress_enospc_test)
+{
+    system("python gen-disk.py -q disk1.in full.img");
+    struct fs5600 *fs = fs5600_open("full.img", NULL);
+    ck_assert(fs != NULL);
+    int size = FS_CLUSTER_BLKS * FS_BLOCK_SIZE;
+    char *data = malloc(size), *junk = malloc(size), *buf = malloc(size);
+    for (int i = 0, n = 0; n < size; i++) {
+        n += snprintf(data + n, size - n, "%06d: nothing to report\n", i);
+    }
+    srand(5600);
+    for (int i = 0; i < size; i++) {
+        junk[i] = rand();
+    }
+
+    int flags = FS_COMPR_FL;
+    struct fs_clone_arg arg = {.src = "/src"};
+    ck_assert(fs5600_create(fs, "/src", S_IFREG | 0777) == 0);
+    ck_assert(fs5600_ioctl(fs, "/src", FS_IOC_SETFLAGS, &flags) == 0);
+    ck_assert(fs5600_write(fs, "/src", data, size, 0) == size);
+    ck_assert(fs5600_create(fs, "/dst", S_IFREG | 0777) == 0);
+    ck_assert(fs5600_ioctl(fs, "/dst", FS_IOC_CLONE_FROM, &arg) == 0);
+
+    ck_assert(fs5600_create(fs, "/fill", S_IFREG | 0777) == 0);
+    int off = 0;
+    while (fs5600_write(fs, "/fill", junk, FS_BLOCK_SIZE, off) == FS_BLOCK_SIZE)
+        off += FS_BLOCK_SIZE;
+    ck_assert(fs5600_write(fs, "/dst", junk, size, 0) == -ENOSPC);
+
+    // with the original gone, its blocks can be reused by /fill...
+    ck_assert(fs5600_unlink(fs, "/src") == 0);
+    while (fs5600_write(fs, "/fill", junk, FS_BLOCK_SIZE, off) == FS_BLOCK_SIZE)
+        off += FS_BLOCK_SIZE;
+    // ...but not the one /dst still has
+    ck_assert(fs5600_read(fs, "/dst", buf, size, 0) == size);
+    ck_assert(memcmp(buf, data, size) == 0);
+
+    fs5600_close(fs);
+    unlink("full.img");
+    free(data);
+    free(junk);
+    free(buf);
+}
+END_TEST
+
+
+static void *lib_defrag(void *arg)
+{
+    fs5600_ioctl(arg, "/file.8k+", FS_IOC_DEFRAG, NULL);
+    return NULL;
+}
+
+/* a write that lands while defrag is copying the file (it drops the
+ * lock between chunks) must win, and an unlink must free the file and
+ * nothing else; defrag_rate 3 makes the wait ~1s
+ */
+START_TEST(defrag_race_test)
+{
+    system("python gen-disk.py -q disk1.in defrag.img");
+    struct fs5600_opts opts = {.defrag_rate = 3};
+    struct fs5600 *fs = fs5600_open("defrag.img", &opts);
+    ck_assert(fs != NULL);
+    pthread_t t;
+    pthread_create(&t, NULL, lib_defrag, fs);
+    usleep(200000);
+    ck_assert(fs5600_write(fs, "/file.8k+", "XYZ", 3, 0) == 3);
+    pthread_join(t, NULL);
+    char buf[4] = {0};
+    ck_assert(fs5600_read(fs, "/file.8k+", buf, 3, 0) == 3);
+    ck_assert_str_eq(buf, "XYZ");
+    fs5600_close(fs);
+
+    fs = fs5600_open("defrag.img", NULL);
+    ck_assert(fs5600_read(fs, "/file.8k+", buf, 3, 0) == 3);
+    ck_assert_str_eq(buf, "XYZ");
+    fs5600_close(fs);
 
+    // 3 blocks and the inode, once the copy has given up (counted
+    // without the background defragger, which holds blocks as it goes)
+    struct statvfs st1, st2;
+    fs = fs5600_open("defrag.img", NULL);
+    fs5600_statfs(fs, &st1);
+    fs5600_close(fs);
+    fs = fs5600_open("defrag.img", &opts);
+    pthread_create(&t, NULL, lib_defrag, fs);
+    usleep(200000);
+    ck_assert(fs5600_unlink(fs, "/file.8k+") == 0);
+    pthread_join(t, NULL);
+    fs5600_close(fs);
+    fs = fs5600_open("defrag.img", NULL);
+    fs5600_statfs(fs, &st2);
+    ck_assert_int_eq(st2.f_bfree, st1.f_bfree + 4);
+    fs5600_close(fs);
+    unlink("defrag.img");
+}
+END_TEST
 
 /* note that your tests will call:
  *  fs_ops.getattr(path, struct stat *sb)
@@ -517,15 +2006,51 @@ int main(int argc, char **argv)
     tcase_add_test(tc, rmdir_errors);  
     tcase_add_test(tc, mkdir_rmdir);
     tcase_add_test(tc, create_unlink);
+    tcase_add_test(tc, unlink_large_test);
 
     /* write tests */
     tcase_add_test(tc, write_errors);
     tcase_add_test(tc, write_data_test); 
     tcase_add_test(tc, append_test); 
     tcase_add_test(tc, overwrite_test); 
+    tcase_add_test(tc, sparse_test); 
+    tcase_add_test(tc, tail_pack_test);
+    tcase_add_test(tc, compress_test);
+    tcase_add_test(tc, dedup_test);
+    tcase_add_test(tc, clone_test);
+    tcase_add_test(tc, compress_enospc_test);
+    tcase_add_test(tc, snapshot_test);
+    tcase_add_test(tc, checkpoint_test);
 
     /* truncate test */
     tcase_add_test(tc, truncate_test); 
+    tcase_add_test(tc, truncate_len_test); 
+
+    /* preallocation tests */
+    tcase_add_test(tc, fallocate_test);
+    tcase_add_test(tc, interleaved_append_test);
+
+    tcase_add_test(tc, defrag_test);
+    tcase_add_test(tc, defrag_race_test);
+
+    /* discard tests */
+    tcase_add_test(tc, discard_test);
+
+    tcase_add_test(tc, writeback_test);
+    tcase_add_test(tc, writeback_error_test);
+    tcase_add_test(tc, io_class_test);
+    tcase_add_test(tc, warm_test);
+    tcase_add_test(tc, clean_mount_test);
+    tcase_add_test(tc, library_test);
+    tcase_add_test(tc, image_lock_test);
+    tcase_add_test(tc, old_format_test);
+    tcase_add_test(tc, stripe_test);
+    tcase_add_test(tc, tier_test);
+    tcase_add_test(tc, preload_test);
+
+    /* checksum test - turns checksums on for the rest of the run */
+    tcase_add_test(tc, checksum_test);
+    tcase_add_test(tc, checksum_crash_test);
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);